@@ -0,0 +1,43 @@
+/*!
+ allocnew.cpp - global operator new counting heap allocations.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "allocstats.hpp"
+#include <cstdlib>
+#include <new>
+
+/*
+ * Replaces the global allocation function in the programs that report
+ * GetAllocStats. operator new[] and the nothrow forms call this one; the
+ * aligned forms don't, so aligned allocations aren't counted. operator
+ * delete frees with free() as before.
+ */
+void* operator new(std::size_t size) {
+    zvm::CountAllocation(size);
+    if (size == 0)
+        size = 1;
+
+    for (;;) {
+        void* ptr = std::malloc(size);
+        if (ptr)
+            return ptr;
+
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
@@ -0,0 +1,36 @@
+/*!
+ allocstats.cpp - counters of heap allocations of the process.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "allocstats.hpp"
+#include <atomic>
+
+namespace zvm {
+
+static std::atomic<std::uint64_t> alloc_count(0);
+static std::atomic<std::uint64_t> alloc_bytes(0);
+
+void CountAllocation(std::size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+AllocStats GetAllocStats() {
+    return { alloc_count.load(std::memory_order_relaxed),
+             alloc_bytes.load(std::memory_order_relaxed) };
+}
+
+}  // namespace zvm
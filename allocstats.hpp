@@ -0,0 +1,47 @@
+/*!
+ allocstats.hpp - counts heap allocations of the process.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_ALLOCSTATS_HPP_
+#define ZVM_ALLOCSTATS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace zvm {
+
+/*!
+ * Allocations made through operator new by all threads of the process
+ * since it started, and the bytes they asked for. Memory is never
+ * subtracted when it is freed. Only programs linked with allocnew.cpp
+ * count allocations, the others always get zeros.
+ */
+struct AllocStats {
+    std::uint64_t count;
+    std::uint64_t bytes;
+};
+
+AllocStats GetAllocStats();
+
+/*!
+ * Counts an allocation of 'size' bytes, called by the operator new of
+ * allocnew.cpp.
+ */
+void CountAllocation(std::size_t size);
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_ALLOCSTATS_HPP_ */
@@ -0,0 +1,738 @@
+/*
+ bench.cpp - microbenchmarks of the ZVM interpreter and the translator.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "zvm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "bintran.hpp"
+#include "exceptions.hpp"
+#include "io.hpp"
+#include "objfile.hpp"
+#include "sandbox.hpp"
+#include "transcache.hpp"
+
+namespace fs = std::experimental::filesystem;
+
+namespace zvm {
+
+typedef std::chrono::steady_clock Clock;
+
+/*!
+ * Assembles a program in memory. Labels may be used before they are
+ * placed.
+ */
+class ProgramBuilder {
+public:
+    void Emit(Opcode opcode);
+    void Emit(Opcode opcode, Data arg);
+    void Jump(Opcode opcode, const std::string& label);
+    void Label(const std::string& name);
+    void AddData(Data value);
+    void Write(const std::string& filename) const;
+private:
+    std::vector<Byte> code_;
+    std::map<std::string, std::uint32_t> labels_;
+    std::vector<std::pair<std::size_t, std::string>> patches_;
+    std::vector<Data> data_;
+};
+
+void ProgramBuilder::Emit(Opcode opcode) {
+    code_.push_back(Byte(opcode));
+}
+
+void ProgramBuilder::Emit(Opcode opcode, Data arg) {
+    Emit(opcode);
+    const Byte* bytes = (const Byte*)&arg;
+    code_.insert(code_.end(), bytes, bytes + sizeof(arg));
+}
+
+void ProgramBuilder::Jump(Opcode opcode, const std::string& label) {
+    Emit(opcode, 0);
+    patches_.emplace_back(code_.size() - sizeof(Data), label);
+}
+
+void ProgramBuilder::Label(const std::string& name) {
+    labels_[name] = code_.size();
+}
+
+void ProgramBuilder::AddData(Data value) {
+    data_.push_back(value);
+}
+
+void ProgramBuilder::Write(const std::string& filename) const {
+    std::vector<Byte> code = code_;
+    ObjectWriter writer;
+    for (const auto& patch: patches_) {
+        auto label = labels_.find(patch.second);
+        if (label == labels_.end())
+            throw std::logic_error("undefined label " + patch.second);
+        Data target = Data(label->second);
+        std::memcpy(&code[patch.first], &target, sizeof(target));
+        writer.AddJumpTarget(label->second);
+    }
+    writer.SetCode(code.data(), code.size());
+    for (const auto& label: labels_)
+        writer.AddSymbol(label.first, label.second);
+    for (Data value: data_)
+        writer.AddData(value);
+    writer.Write(filename);
+}
+
+/*
+ * Data stack slots of the generated programs. The counter counts the
+ * loop down from the iteration count and the middle holds half of it.
+ * The result is printed at the end, scratch slots feed and take values
+ * of the workload.
+ */
+const Data SLOT_COUNTER = 0;
+const Data SLOT_MIDDLE = 1;
+const Data SLOT_DEPTH = 2;
+const Data SLOT_RESULT = 3;
+const Data SLOT_SCRATCH = 4;
+const Data SLOT_COUNT = 9;
+
+/*!
+ * Copies of the workload's body per loop iteration, so that the loop
+ * itself costs little.
+ */
+const int BODY_COPIES = 8;
+
+/*!
+ * Depth the recursion workload descends to on every iteration.
+ */
+const Data CALL_DEPTH = 64;
+
+/*!
+ * Workload shape. The generated program runs 'copies' copies of 'body'
+ * per iteration of a counted loop, then prints the result slot and halts;
+ * 'subroutines', if any, are placed after the HALT. An iteration does
+ * 'units' units of work, which the timings are also given per.
+ */
+struct Workload {
+    const char* name;
+    const char* description;
+    std::uint32_t iterations;  // at scale 1
+    int copies;
+    std::uint32_t units;
+    bool reads_input;          // one value per unit
+    void (*body)(ProgramBuilder& program, int copy);
+    void (*subroutines)(ProgramBuilder& program);
+};
+
+inline std::string CopyLabel(const char* name, int copy) {
+    return std::string(name) + "_" + std::to_string(copy);
+}
+
+void ArithBody(ProgramBuilder& program, int) {
+    program.Emit(OPCODE_LOAD, SLOT_COUNTER);
+    program.Emit(OPCODE_PUSH, 3);
+    program.Emit(OPCODE_MUL);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH);
+    program.Emit(OPCODE_ADD);
+    program.Emit(OPCODE_PUSH, 5);
+    program.Emit(OPCODE_SUB);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH + 1);
+    program.Emit(OPCODE_MUL);
+    program.Emit(OPCODE_PUSH, 9);
+    program.Emit(OPCODE_ADD);
+    program.Emit(OPCODE_STORE, SLOT_RESULT);
+}
+
+void DivideBody(ProgramBuilder& program, int) {
+    program.Emit(OPCODE_LOAD, SLOT_COUNTER);
+    program.Emit(OPCODE_PUSH, 7);
+    program.Emit(OPCODE_DIV);
+    program.Emit(OPCODE_LOAD, SLOT_COUNTER);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH);
+    program.Emit(OPCODE_DIV);
+    program.Emit(OPCODE_ADD);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH + 1);
+    program.Emit(OPCODE_DIV);
+    program.Emit(OPCODE_STORE, SLOT_RESULT);
+}
+
+/*!
+ * Compares the counter with the middle of the loop, so each branch goes
+ * one way for the first half of the run and the other way after.
+ */
+void BranchBody(ProgramBuilder& program, int copy) {
+    const Opcode COMPARES[] = { OPCODE_GZ, OPCODE_BZ, OPCODE_GEZ,
+                                OPCODE_BEZ, OPCODE_EQZ, OPCODE_NEQZ };
+    std::string skip = CopyLabel("SKIP", copy);
+    program.Emit(OPCODE_LOAD, SLOT_COUNTER);
+    program.Emit(OPCODE_LOAD, SLOT_MIDDLE);
+    program.Emit(OPCODE_SUB);
+    program.Emit(COMPARES[copy % (sizeof(COMPARES) / sizeof(*COMPARES))]);
+    program.Jump(OPCODE_JMC, skip);
+    program.Emit(OPCODE_LOAD, SLOT_RESULT);
+    program.Emit(OPCODE_PUSH, 1);
+    program.Emit(OPCODE_ADD);
+    program.Emit(OPCODE_STORE, SLOT_RESULT);
+    program.Label(skip);
+}
+
+void LoadStoreBody(ProgramBuilder& program, int) {
+    // rotates the scratch slots
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH + 1);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH + 2);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH + 3);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH + 4);
+    program.Emit(OPCODE_STORE, SLOT_SCRATCH);
+    program.Emit(OPCODE_STORE, SLOT_SCRATCH + 4);
+    program.Emit(OPCODE_STORE, SLOT_SCRATCH + 3);
+    program.Emit(OPCODE_STORE, SLOT_SCRATCH + 2);
+    program.Emit(OPCODE_STORE, SLOT_SCRATCH + 1);
+    program.Emit(OPCODE_LOAD, SLOT_SCRATCH);
+    program.Emit(OPCODE_STORE, SLOT_RESULT);
+}
+
+void CallBody(ProgramBuilder& program, int) {
+    program.Emit(OPCODE_PUSH, CALL_DEPTH);
+    program.Emit(OPCODE_STORE, SLOT_DEPTH);
+    program.Jump(OPCODE_CALL, "DESCEND");
+}
+
+/*!
+ * Calls itself until the depth slot reaches 0.
+ */
+void CallSubroutines(ProgramBuilder& program) {
+    program.Label("DESCEND");
+    program.Emit(OPCODE_LOAD, SLOT_DEPTH);
+    program.Emit(OPCODE_EQZ);
+    program.Jump(OPCODE_JMC, "DESCEND_RET");
+    program.Emit(OPCODE_LOAD, SLOT_DEPTH);
+    program.Emit(OPCODE_PUSH, 1);
+    program.Emit(OPCODE_SUB);
+    program.Emit(OPCODE_STORE, SLOT_DEPTH);
+    program.Jump(OPCODE_CALL, "DESCEND");
+    program.Emit(OPCODE_LOAD, SLOT_RESULT);
+    program.Emit(OPCODE_PUSH, 1);
+    program.Emit(OPCODE_ADD);
+    program.Emit(OPCODE_STORE, SLOT_RESULT);
+    program.Label("DESCEND_RET");
+    program.Emit(OPCODE_RET);
+}
+
+void StreamBody(ProgramBuilder& program, int) {
+    program.Emit(OPCODE_INPUT);
+    program.Emit(OPCODE_PUSH, 2);
+    program.Emit(OPCODE_MUL);
+    program.Emit(OPCODE_OUTPUT);
+}
+
+const Workload WORKLOADS[] = {
+    { "arith", "ADD, SUB and MUL chains", 200000,
+      BODY_COPIES, BODY_COPIES, false, ArithBody, nullptr },
+    { "divide", "DIV chains", 200000,
+      BODY_COPIES, BODY_COPIES, false, DivideBody, nullptr },
+    { "branch", "compares and conditional jumps", 200000,
+      BODY_COPIES, BODY_COPIES, false, BranchBody, nullptr },
+    { "loadstore", "LOAD and STORE of stack slots", 200000,
+      BODY_COPIES, BODY_COPIES, false, LoadStoreBody, nullptr },
+    { "call", "CALL and RET recursion", 20000,
+      1, CALL_DEPTH + 1, false, CallBody, CallSubroutines },
+    { "stream", "INPUT and OUTPUT of text values", 20000,
+      BODY_COPIES, BODY_COPIES, true, StreamBody, nullptr },
+};
+
+void GenerateProgram(const Workload& workload, std::uint32_t iterations,
+                     ProgramBuilder& program) {
+    for (Data slot = 0; slot < SLOT_COUNT; slot++) {
+        if (slot == SLOT_COUNTER)
+            program.AddData(Data(iterations));
+        else if (slot == SLOT_MIDDLE)
+            program.AddData(Data(iterations / 2));
+        else
+            program.AddData(slot);
+    }
+
+    program.Label("LOOP");
+    program.Emit(OPCODE_LOAD, SLOT_COUNTER);
+    program.Emit(OPCODE_EQZ);
+    program.Jump(OPCODE_JMC, "DONE");
+    for (int copy = 0; copy < workload.copies; copy++)
+        workload.body(program, copy);
+    program.Emit(OPCODE_LOAD, SLOT_COUNTER);
+    program.Emit(OPCODE_PUSH, 1);
+    program.Emit(OPCODE_SUB);
+    program.Emit(OPCODE_STORE, SLOT_COUNTER);
+    program.Jump(OPCODE_JMP, "LOOP");
+
+    program.Label("DONE");
+    program.Emit(OPCODE_LOAD, SLOT_RESULT);
+    program.Emit(OPCODE_OUTPUT);
+    program.Emit(OPCODE_HALT);
+    if (workload.subroutines)
+        workload.subroutines(program);
+}
+
+/*!
+ * The ways a program is run.
+ */
+enum Engine {
+    ENGINE_SWITCH,    // interpreter, switch dispatch
+    ENGINE_THREADED,  // interpreter, threaded dispatch
+    ENGINE_TIERED,    // interpreter translating hot blocks
+    ENGINE_BINTRAN    // whole program translated ahead of the runs
+};
+
+const char* const ENGINE_NAMES[] = { "zvm-switch", "zvm", "zvm-tiered",
+                                     "bintran" };
+const std::size_t ENGINE_COUNT = sizeof(ENGINE_NAMES) / sizeof(*ENGINE_NAMES);
+
+/*!
+ * Engine the speedups are relative to.
+ */
+const Engine BASELINE_ENGINE = ENGINE_THREADED;
+
+struct BenchOptions {
+    int warmup;
+    int repeat;
+    double scale;
+    bool json;
+    std::vector<const Workload*> workloads;
+    std::vector<Engine> engines;
+};
+
+/*!
+ * Timings of one workload on one engine, in seconds.
+ */
+struct BenchResult {
+    const Workload* workload;
+    Engine engine;
+    std::uint32_t iterations;
+    double translate_seconds;  // bintran only, not part of the runs
+    std::vector<double> runs;  // sorted
+    std::string output;        // of the checked run
+    std::string error;
+    bool output_matches;       // the same as the first engine's
+
+    double Percentile(double p) const;
+    double Mean() const;
+
+    std::uint64_t Units() const {
+        return std::uint64_t(iterations) * workload->units;
+    }
+};
+
+/*!
+ * Nearest-rank percentile.
+ */
+double BenchResult::Percentile(double p) const {
+    if (runs.empty())
+        return 0.0;
+    std::size_t rank = std::size_t(std::ceil(p / 100.0 * runs.size()));
+    return runs[std::min(std::max(rank, std::size_t(1)), runs.size()) - 1];
+}
+
+double BenchResult::Mean() const {
+    double sum = 0.0;
+    for (double run: runs)
+        sum += run;
+    return runs.empty() ? 0.0 : sum / runs.size();
+}
+
+/*!
+ * Descriptor of a file that is closed on scope exit.
+ */
+class ScopedFd {
+public:
+    explicit ScopedFd(int fd): fd_(fd) {}
+    ~ScopedFd() {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+
+    int Get() const {
+        return fd_;
+    }
+private:
+    int fd_;
+};
+
+inline int OpenFile(const std::string& filename, int flags) {
+    int fd = open(filename.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
+    return fd;
+}
+
+inline std::string ReadFile(const std::string& filename) {
+    std::string contents;
+    std::FILE* f = std::fopen(filename.c_str(), "rb");
+    if (!f)
+        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
+    char buf[1 << 12];
+    std::size_t read = 0;
+    while ((read = std::fread(buf, 1, sizeof(buf), f)) > 0)
+        contents.append(buf, read);
+    std::fclose(f);
+    return contents;
+}
+
+/*!
+ * Runs the program once and returns the seconds it took. Only the run
+ * itself is timed, loading the binary and setting up stacks is not.
+ */
+double RunOnce(Engine engine, const std::string& program, BinTran* translator,
+               Sandbox* sandbox, int input_fd, int output_fd) {
+    if (input_fd >= 0 && lseek(input_fd, 0, SEEK_SET) < 0)
+        throw IoException("benchmark input", ERR_FILE_OPEN_FAILURE);
+
+    Clock::time_point start;
+    if (engine == ENGINE_BINTRAN) {
+        io::Reader reader(input_fd);
+        io::Writer writer(output_fd);
+        reader.Tie(&writer);
+        io::TextInput input(reader);
+        io::TextOutput output(writer);
+        std::unique_ptr<io::Runtime> rt(new io::Runtime);
+        io::InitRuntime(*rt, input, output);
+
+        start = Clock::now();
+        translator->Execute(*rt, *sandbox);
+    } else {
+        const DispatchMode MODES[] = { DISPATCH_SWITCH, DISPATCH_THREADED,
+                                       DISPATCH_TIERED };
+        Zvm zvm(DATA_MEMORY_SIZE, CALL_STACK_SIZE, input_fd, output_fd);
+        zvm.LoadBinary(program);
+
+        start = Clock::now();
+        zvm.Run(MODES[engine]);
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/*!
+ * Runs 'workload' on 'engine': once untimed with its output kept, then
+ * the warmup runs, then the timed runs.
+ */
+BenchResult RunBench(const BenchOptions& options, const Workload& workload,
+                     Engine engine, const std::string& dir) {
+    BenchResult result = {};
+    result.workload = &workload;
+    result.engine = engine;
+    result.iterations = std::max(std::uint32_t(1),
+        std::uint32_t(workload.iterations * options.scale));
+
+    std::string base = dir + "/" + workload.name;
+    std::string program = base + ".zo";
+    std::string input = base + ".in";
+    std::string checked = base + "." + ENGINE_NAMES[engine] + ".out";
+    try {
+        ScopedFd input_fd(workload.reads_input ?
+                          OpenFile(input, O_RDONLY) : -1);
+        ScopedFd null_fd(OpenFile("/dev/null", O_WRONLY));
+
+        std::unique_ptr<BinTran> translator;
+        std::unique_ptr<Sandbox> sandbox;
+        if (engine == ENGINE_BINTRAN) {
+            translator.reset(new BinTran());
+            translator->LoadBinary(program);
+            Clock::time_point start = Clock::now();
+            translator->Translate();
+            result.translate_seconds = std::chrono::duration<double>(
+                Clock::now() - start).count();
+            sandbox.reset(new Sandbox(DATA_MEMORY_SIZE, CALL_STACK_SIZE));
+        }
+
+        {
+            ScopedFd output_fd(OpenFile(checked, O_WRONLY | O_CREAT |
+                                                 O_TRUNC));
+            RunOnce(engine, program, translator.get(), sandbox.get(),
+                    input_fd.Get(), output_fd.Get());
+        }
+        result.output = ReadFile(checked);
+        fs::remove(checked);
+
+        for (int i = 0; i < options.warmup; i++)
+            RunOnce(engine, program, translator.get(), sandbox.get(),
+                    input_fd.Get(), null_fd.Get());
+        for (int i = 0; i < options.repeat; i++)
+            result.runs.push_back(RunOnce(engine, program, translator.get(),
+                                          sandbox.get(), input_fd.Get(),
+                                          null_fd.Get()));
+        std::sort(result.runs.begin(), result.runs.end());
+    } catch (const std::exception& err) {
+        result.error = err.what();
+        result.runs.clear();
+    }
+    return result;
+}
+
+/*!
+ * Writes the program of 'workload' and its input into 'dir'.
+ */
+void PrepareWorkload(const BenchOptions& options, const Workload& workload,
+                     const std::string& dir) {
+    std::uint32_t iterations = std::max(std::uint32_t(1),
+        std::uint32_t(workload.iterations * options.scale));
+    std::string base = dir + "/" + workload.name;
+
+    ProgramBuilder program;
+    GenerateProgram(workload, iterations, program);
+    program.Write(base + ".zo");
+
+    if (!workload.reads_input)
+        return;
+    std::FILE* f = std::fopen((base + ".in").c_str(), "w");
+    if (!f)
+        throw IoException(base + ".in", ERR_FILE_OPEN_FAILURE);
+    std::uint64_t count = std::uint64_t(iterations) * workload.units;
+    for (std::uint64_t i = 0; i < count; i++)
+        std::fprintf(f, "%d\n", int(i % 100000) - 50000);
+    std::fclose(f);
+}
+
+inline double Ms(double seconds) {
+    return seconds * 1e3;
+}
+
+/*!
+ * Time of the baseline engine on the same workload over this one's, 0 if
+ * either is missing.
+ */
+double Speedup(const std::vector<BenchResult>& results,
+               const BenchResult& result) {
+    for (const auto& other: results) {
+        if (other.workload == result.workload &&
+            other.engine == BASELINE_ENGINE &&
+            !other.runs.empty() && !result.runs.empty())
+            return other.Percentile(50) / result.Percentile(50);
+    }
+    return 0.0;
+}
+
+inline const char* Status(const BenchResult& result) {
+    if (!result.error.empty())
+        return "error";
+    return result.output_matches ? "ok" : "mismatch";
+}
+
+void WriteCsv(std::FILE* f, const std::vector<BenchResult>& results,
+              std::uint64_t build) {
+    std::fprintf(f, "workload,engine,iterations,units,translate_ms,min_ms,"
+                    "p50_ms,p90_ms,p99_ms,max_ms,mean_ms,ns_per_unit,"
+                    "speedup,status,build\n");
+    for (const auto& result: results) {
+        double p50 = result.Percentile(50);
+        std::fprintf(f, "%s,%s,%u,%llu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,"
+                        "%.2f,%.2f,%s,%016llx\n",
+                     result.workload->name, ENGINE_NAMES[result.engine],
+                     result.iterations,
+                     (unsigned long long)result.Units(),
+                     Ms(result.translate_seconds),
+                     Ms(result.Percentile(0)), Ms(p50),
+                     Ms(result.Percentile(90)), Ms(result.Percentile(99)),
+                     Ms(result.Percentile(100)), Ms(result.Mean()),
+                     p50 * 1e9 / result.Units(),
+                     Speedup(results, result), Status(result),
+                     (unsigned long long)build);
+    }
+}
+
+/*!
+ * Writes 'text' as a JSON string.
+ */
+void WriteJsonString(std::FILE* f, const std::string& text) {
+    std::fputc('"', f);
+    for (char c: text) {
+        if (c == '"' || c == '\\')
+            std::fprintf(f, "\\%c", c);
+        else if ((unsigned char)c < 0x20)
+            std::fprintf(f, "\\u%04x", c);
+        else
+            std::fputc(c, f);
+    }
+    std::fputc('"', f);
+}
+
+void WriteJson(std::FILE* f, const std::vector<BenchResult>& results,
+               const BenchOptions& options, std::uint64_t build) {
+    std::fprintf(f, "{\n  \"build\": \"%016llx\",\n  \"warmup\": %d,\n"
+                    "  \"repeat\": %d,\n  \"scale\": %g,\n"
+                    "  \"results\": [",
+                 (unsigned long long)build, options.warmup, options.repeat,
+                 options.scale);
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const BenchResult& result = results[i];
+        std::fprintf(f, "%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", "
+                        "\"iterations\": %u, \"units\": %llu,\n"
+                        "     \"translate_ms\": %.3f, \"runs_ms\": [",
+                     i ? "," : "", result.workload->name,
+                     ENGINE_NAMES[result.engine], result.iterations,
+                     (unsigned long long)result.Units(),
+                     Ms(result.translate_seconds));
+        for (std::size_t j = 0; j < result.runs.size(); j++)
+            std::fprintf(f, "%s%.3f", j ? ", " : "", Ms(result.runs[j]));
+        double p50 = result.Percentile(50);
+        std::fprintf(f, "],\n     \"min_ms\": %.3f, \"p50_ms\": %.3f, "
+                        "\"p90_ms\": %.3f, \"p99_ms\": %.3f, "
+                        "\"max_ms\": %.3f, \"mean_ms\": %.3f,\n"
+                        "     \"ns_per_unit\": %.2f, \"speedup\": %.2f, "
+                        "\"status\": \"%s\", \"error\": ",
+                     Ms(result.Percentile(0)), Ms(p50),
+                     Ms(result.Percentile(90)), Ms(result.Percentile(99)),
+                     Ms(result.Percentile(100)), Ms(result.Mean()),
+                     p50 * 1e9 / result.Units(), Speedup(results, result),
+                     Status(result));
+        WriteJsonString(f, result.error);
+        std::fprintf(f, "}");
+    }
+    std::fprintf(f, "\n  ]\n}\n");
+}
+
+}  // namespace zvm
+
+inline void DisplayUsage() {
+    std::printf("Usage: bench [--warmup N] [--repeat N] [--scale X] [--json] "
+                "[--output FILE]\n"
+                "             [--workload NAME]... [--engine NAME]...\n"
+                "Workloads:\n");
+    for (const auto& workload: zvm::WORKLOADS)
+        std::printf("  %-10s %s\n", workload.name, workload.description);
+    std::printf("Engines:");
+    for (const char* engine: zvm::ENGINE_NAMES)
+        std::printf(" %s", engine);
+    std::printf("\n");
+}
+
+/*!
+ * Generates a program per workload, runs each on every engine and writes
+ * the timings as CSV, or JSON with --json, to stdout or FILE. Progress
+ * goes to stderr. Fails if a run failed or an engine's output differed
+ * from the first engine's.
+ */
+int main(int argc, char* argv[]) {
+    using namespace zvm;
+
+    BenchOptions options = { 2, 10, 1.0, false, {}, {} };
+    std::string output_filename;
+    for (int argi = 1; argi < argc; argi++) {
+        std::string opt = argv[argi];
+        bool has_value = argi + 1 < argc;
+        if (opt == "--warmup" && has_value) {
+            options.warmup = std::atoi(argv[++argi]);
+        } else if (opt == "--repeat" && has_value) {
+            options.repeat = std::max(1, std::atoi(argv[++argi]));
+        } else if (opt == "--scale" && has_value) {
+            options.scale = std::strtod(argv[++argi], nullptr);
+        } else if (opt == "--json") {
+            options.json = true;
+        } else if (opt == "--output" && has_value) {
+            output_filename = argv[++argi];
+        } else if (opt == "--workload" && has_value) {
+            std::string name = argv[++argi];
+            auto found = std::find_if(std::begin(WORKLOADS),
+                                      std::end(WORKLOADS),
+                                      [&](const Workload& workload) {
+                                          return name == workload.name;
+                                      });
+            if (found == std::end(WORKLOADS)) {
+                DisplayUsage();
+                return ERR_WRONG_CMD_LINE_ARGS;
+            }
+            options.workloads.push_back(found);
+        } else if (opt == "--engine" && has_value) {
+            std::string name = argv[++argi];
+            std::size_t engine = 0;
+            while (engine < ENGINE_COUNT && name != ENGINE_NAMES[engine])
+                engine++;
+            if (engine == ENGINE_COUNT) {
+                DisplayUsage();
+                return ERR_WRONG_CMD_LINE_ARGS;
+            }
+            options.engines.push_back(Engine(engine));
+        } else {
+            DisplayUsage();
+            return ERR_WRONG_CMD_LINE_ARGS;
+        }
+    }
+    if (options.workloads.empty())
+        for (const auto& workload: WORKLOADS)
+            options.workloads.push_back(&workload);
+    if (options.engines.empty())
+        for (std::size_t engine = 0; engine < ENGINE_COUNT; engine++)
+            options.engines.push_back(Engine(engine));
+
+    std::string dir = (fs::temp_directory_path() /
+                       ("zvm-bench-" + std::to_string(getpid()))).string();
+    std::vector<BenchResult> results;
+    try {
+        fs::create_directories(dir);
+        for (const Workload* workload: options.workloads) {
+            PrepareWorkload(options, *workload, dir);
+            std::size_t reference = results.size();  // first one to finish
+            for (Engine engine: options.engines) {
+                results.push_back(RunBench(options, *workload, engine, dir));
+                BenchResult& result = results.back();
+                if (reference == results.size() - 1 && !result.error.empty())
+                    reference++;
+                result.output_matches =
+                    result.error.empty() &&
+                    result.output == results[reference].output;
+                std::fprintf(stderr, "%-10s %-11s p50 %9.3f ms  %s%s\n",
+                             workload->name, ENGINE_NAMES[engine],
+                             Ms(result.Percentile(50)), Status(result),
+                             result.error.empty() ?
+                             "" : (": " + result.error).c_str());
+            }
+        }
+    } catch (const std::exception& err) {
+        std::fprintf(stderr, "Error: %s\n", err.what());
+        fs::remove_all(dir);
+        return ERR_FILE_OPEN_FAILURE;
+    }
+    fs::remove_all(dir);
+
+    std::FILE* f = stdout;
+    if (!output_filename.empty()) {
+        f = std::fopen(output_filename.c_str(), "w");
+        if (!f) {
+            std::fprintf(stderr, "Can't open %s\n", output_filename.c_str());
+            return ERR_FILE_OPEN_FAILURE;
+        }
+    }
+    std::uint64_t build = TranslatorBuildHash();
+    if (options.json)
+        WriteJson(f, results, options, build);
+    else
+        WriteCsv(f, results, build);
+    if (f != stdout)
+        std::fclose(f);
+
+    for (const auto& result: results)
+        if (!result.output_matches)
+            return EXIT_FAILURE;
+    return ERR_OK;
+}
@@ -18,73 +18,95 @@
 #include "bintran.hpp"
 #include "datatools.hpp"
 #include "exceptions.hpp"
+#include "sandbox.hpp"
 #include "x86arch.hpp"
-#include <experimental/filesystem>
-#include <sys/mman.h>
-
-namespace fs = std::experimental::filesystem;
+#include "x86encoder.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 namespace zvm {
 
-BinTran::BinTran(std::size_t alloc_size)
-    : zvmbinary_(nullptr),
+BinTran::BinTran()
+    : object_(&own_object_),
+      zvmbinary_(nullptr),
+      zvmbinary_size_(0),
+      own_cache_(new CodeCache()),
+      cache_(*own_cache_),
+      code_(nullptr),
+      translated_code_(nullptr),
+      actual_x86_size_(0),
+      thread_count_(0),
+      data_capacity_(DATA_MEMORY_SIZE),
+      collect_stats_(false),
+      profile_(false),
+      analyzed_(false),
+      lazy_(false),
+      lazy_resolver_(0),
+      lazy_halt_(0) {}
+
+BinTran::BinTran(CodeCache& cache)
+    : object_(&own_object_),
+      zvmbinary_(nullptr),
       zvmbinary_size_(0),
-      translated_code_(AllocWriteableMemory(alloc_size)),
-      allocated_size_(alloc_size),
-      actual_x86_size_(0) {}
+      cache_(cache),
+      code_(nullptr),
+      translated_code_(nullptr),
+      actual_x86_size_(0),
+      thread_count_(0),
+      data_capacity_(DATA_MEMORY_SIZE),
+      collect_stats_(false),
+      profile_(false),
+      analyzed_(false),
+      lazy_(false),
+      lazy_resolver_(0),
+      lazy_halt_(0) {}
 
 BinTran::~BinTran() {
-    delete[] zvmbinary_;
-    if (translated_code_)
-        munmap((void*)translated_code_, allocated_size_);
+    ReleaseCode();
+    ReleaseTier();
 }
 
 void BinTran::LoadBinary(const std::string& filename) {
-    if (!fs::exists(filename))
-        throw IoException(filename, ERR_FILE_DOESNT_EXIST);
-
-    std::size_t filesize = fs::file_size(filename);
-    std::FILE* f = std::fopen(filename.c_str(), "rb");
-    if (!f)
-        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
-
-    if (zvmbinary_)
-        delete[] zvmbinary_;
-    zvmbinary_ = new Byte[filesize]();
-    if (!zvmbinary_)
-        throw AllocException();
-
-    std::fread(zvmbinary_, 1, filesize, f);
-    std::fclose(f);
+    own_object_.Load(filename);
+    own_object_.AdviseSequential();
+    LoadProgram(own_object_);
+}
 
-    zvmbinary_size_ = filesize;
+void BinTran::LoadProgram(const ObjectFile& object) {
+    ReleaseCode();
+    ReleaseTier();
+    object_ = &object;
+    zvmbinary_ = object_->Code();
+    zvmbinary_size_ = object_->CodeSize();
 }
 
+/*!
+ * Sets where an instruction takes its operands from and puts its result.
+ * DATALOC_STACK operands are popped from the ZVM stack, a DATALOC_STACK
+ * result is pushed onto it; BtInstr::Effect() relies on that.
+ */
 inline void InitDataLocations(BtInstr& btinstr) {
     switch (btinstr.opcode) {
-        case OPCODE_POP:
         case OPCODE_HALT:
         case OPCODE_POPBP:
         case OPCODE_PUSHBP:
+        case OPCODE_CALL:
+        case OPCODE_JMP:
+        case OPCODE_RET:
             btinstr.op1_loc = DATALOC_NONE;
             btinstr.op2_loc = DATALOC_NONE;
             btinstr.res_loc = DATALOC_NONE;
             break;
         case OPCODE_PUSH:
         case OPCODE_LOAD:
-        case OPCODE_STORE:
             btinstr.op1_loc = DATALOC_IMM;
             btinstr.op2_loc = DATALOC_NONE;
             btinstr.res_loc = DATALOC_STACK;
             break;
-        case OPCODE_CALL:
-        case OPCODE_JMP:
+        case OPCODE_POP:
+        case OPCODE_STORE:
         case OPCODE_JMC:
-            btinstr.op1_loc = DATALOC_IMM;
-            btinstr.op2_loc = DATALOC_STACK;
-            btinstr.res_loc = DATALOC_NONE;
-            break;
-        case OPCODE_RET:
             btinstr.op1_loc = DATALOC_STACK;
             btinstr.op2_loc = DATALOC_NONE;
             btinstr.res_loc = DATALOC_NONE;
@@ -122,115 +144,1088 @@ inline void InitDataLocations(BtInstr& btinstr) {
     }
 }
 
-void BinTran::Translate() {
-    Register pc = 0;
+void BinTran::Decode() {
+    program_.clear();
+    zvmaddr_index_.assign(zvmbinary_size_, NO_INDEX);
 
-    while (pc < zvmbinary_size_) {
-        Register bpc = pc;
+    program_.reserve(object_->InstrCount());
+    for (std::size_t i = 0; i < object_->InstrCount(); i++) {
+        Register bpc = object_->InstrAddr(i);
+        Register pc = bpc;
         DecodedInstr instr = FetchInstr(zvmbinary_, pc);
         BtInstr btinstr = { .opcode = instr.opcode,
                             .arg = instr.args[0],
-                            .zvm_addr = std::size_t(bpc) };
+                            .zvm_addr = std::size_t(bpc),
+                            .target = NO_INDEX,
+                            .block = NO_INDEX,
+                            .short_jump = false,
+                            .removed = false,
+                            .cond = OPCODE_NEQZ,
+                            .probe = false,
+                            .inlined = false };
 
         InitDataLocations(btinstr);
+        zvmaddr_index_[bpc] = program_.size();
         program_.push_back(btinstr);
-        zvmaddr_map_[bpc] = &program_.back();
     }
+}
+
+/*!
+ * Splits program_ into basic blocks. Leaders are the first instruction,
+ * every jump/call target and every instruction following a control
+ * transfer. Object files with a jump table list the targets up front;
+ * jumps elsewhere are rejected.
+ */
+void BinTran::BuildCfg() {
+    blocks_.clear();
+    if (program_.empty())
+        return;
+
+    std::vector<bool> leader(program_.size(), false);
+    leader[0] = true;
+
+    bool listed = object_->HasJumpTable();
+    for (std::size_t i = 0; listed && i < object_->JumpTableSize(); i++) {
+        std::uint32_t target = object_->JumpTarget(i);
+        if (target < zvmbinary_size_)
+            leader[zvmaddr_index_[target]] = true;
+    }
+
+    for (std::size_t i = 0; i < program_.size(); i++) {
+        BtInstr& instr = program_[i];
+
+        if (instr.IsJump()) {
+            if (instr.arg < 0 || std::size_t(instr.arg) >= zvmbinary_size_ ||
+                zvmaddr_index_[instr.arg] == NO_INDEX)
+                throw OutOfBoundsException("jump target out of bounds");
 
-    // scan for jumps
-    for (auto it = program_.begin(); it != program_.end(); it++) {
-        if (it->opcode == OPCODE_JMP || it->opcode == OPCODE_JMC ||
-            it->opcode == OPCODE_CALL) {
-            jmp_map_[&(*it)] = zvmaddr_map_[it->arg];
+            instr.target = zvmaddr_index_[instr.arg];
+            if (listed && !leader[instr.target])
+                throw OutOfBoundsException("jump target missing from the "
+                                           "jump table");
+            leader[instr.target] = true;
         }
+
+        if (EndsBasicBlock(instr.opcode) && i + 1 < program_.size())
+            leader[i + 1] = true;
     }
 
-    Optimize();
+    for (std::size_t i = 0; i < program_.size(); i++) {
+        if (leader[i]) {
+            if (!blocks_.empty())
+                blocks_.back().last = i;
+            blocks_.push_back({ i, program_.size() });
+        }
+        program_[i].block = blocks_.size() - 1;
+    }
+
+    BuildEdges();
+}
+
+/*!
+ * Whether control can run past the end of a block ending with 'tail'.
+ */
+inline bool FallsThrough(const BtInstr& tail) {
+    return tail.removed || !(tail.opcode == OPCODE_JMP ||
+                             tail.opcode == OPCODE_RET ||
+                             tail.opcode == OPCODE_HALT);
+}
+
+/*!
+ * (Re)computes block successors and predecessors from the instructions
+ * that end each block, taking rewrites done by optimization passes into
+ * account.
+ */
+void BinTran::BuildEdges() {
+    for (auto& block: blocks_) {
+        block.preds.clear();
+        block.succs.clear();
+    }
+
+    for (std::size_t b = 0; b < blocks_.size(); b++) {
+        const BtInstr& tail = program_[blocks_[b].last - 1];
+        bool jumps = !tail.removed && tail.IsJump();
+        bool falls_through = FallsThrough(tail);
+
+        if (jumps)
+            blocks_[b].succs.push_back(program_[tail.target].block);
+        if (falls_through && b + 1 < blocks_.size() &&
+            (blocks_[b].succs.empty() || blocks_[b].succs[0] != b + 1))
+            blocks_[b].succs.push_back(b + 1);
+
+        for (std::size_t succ: blocks_[b].succs)
+            blocks_[succ].preds.push_back(b);
+    }
+}
+
+/*!
+ * ZVM stack depth after an instruction with 'effect', -1 if not known.
+ */
+inline int ApplyEffect(int height, StackEffect effect) {
+    if (height < 0 || height < effect.pops)
+        return -1;
+    return height - effect.pops + effect.pushes;
+}
+
+/*!
+ * Forward dataflow over the CFG computing the ZVM stack depth at every
+ * block entry. Blocks reachable with different depths, return points of
+ * calls that aren't inlined and unreachable blocks get -1.
+ */
+void BinTran::ComputeStackHeights() {
+    const int UNVISITED = -2;
+
+    for (auto& block: blocks_)
+        block.entry_height = UNVISITED;
+    if (blocks_.empty())
+        return;
+
+    std::vector<std::size_t> worklist;
+    auto merge = [&](std::size_t succ, int height) {
+        int& entry = blocks_[succ].entry_height;
+        if (entry == UNVISITED) {
+            entry = height;
+            worklist.push_back(succ);
+        } else if (entry != height && entry != -1) {
+            entry = -1;
+            worklist.push_back(succ);
+        }
+    };
+
+    merge(0, object_->DataSize());
+    while (!worklist.empty()) {
+        std::size_t b = worklist.back();
+        worklist.pop_back();
+
+        const BasicBlock& block = blocks_[b];
+        int height = block.entry_height;
+        for (std::size_t i = block.first; i < block.last; i++) {
+            const BtInstr& instr = program_[i];
+            if (instr.inlined) {
+                const CallTarget& target =
+                    call_targets_.at(program_[instr.target].zvm_addr);
+                for (const auto& body_instr: target.body)
+                    height = ApplyEffect(height, body_instr.Effect());
+            }
+            height = ApplyEffect(height, instr.Effect());
+        }
+
+        const BtInstr& tail = program_[block.last - 1];
+        for (std::size_t succ: block.succs) {
+            bool return_point = !tail.removed && !tail.inlined &&
+                                tail.opcode == OPCODE_CALL && succ == b + 1;
+            merge(succ, return_point ? -1 : height);
+        }
+    }
+
+    for (auto& block: blocks_) {
+        if (block.entry_height == UNVISITED)
+            block.entry_height = -1;
+    }
+}
+
+/*!
+ * Splits the blocks into functions at CALL targets. Functions longer than
+ * MAX_FUNCTION_SIZE are cut further; the cuts only depend on the program.
+ */
+void BinTran::SplitFunctions() {
+    functions_.clear();
+    if (blocks_.empty())
+        return;
+
+    std::vector<bool> entry(blocks_.size(), false);
+    entry[0] = true;
+    for (const auto& instr: program_) {
+        if (instr.opcode == OPCODE_CALL)
+            entry[program_[instr.target].block] = true;
+    }
+
+    std::size_t first = 0;
+    for (std::size_t b = 1; b <= blocks_.size(); b++) {
+        if (b < blocks_.size() && !entry[b] &&
+            blocks_[b].first - blocks_[first].first < MAX_FUNCTION_SIZE)
+            continue;
+
+        for (std::size_t i = first; i < b; i++)
+            blocks_[i].function = functions_.size();
+        functions_.push_back({ first, b, {}, 0 });
+        first = b;
+    }
+}
+
+void BinTran::SetThreadCount(std::size_t thread_count) {
+    if (thread_count != thread_count_)
+        pool_.reset();
+    thread_count_ = thread_count;
+}
+
+/*!
+ * Runs 'pass' on every function, on the thread pool if there is more
+ * than one thread.
+ */
+void BinTran::ForEachFunction(const std::function<void(Function&)>& pass) {
+    if (!pool_)
+        pool_.reset(new ThreadPool(thread_count_));
+
+    if (pool_->ThreadCount() == 1 || functions_.size() == 1) {
+        for (auto& function: functions_)
+            pass(function);
+        return;
+    }
+
+    pool_->ParallelFor(functions_.size(), [&](std::size_t i) {
+        pass(functions_[i]);
+    });
+}
+
+/*!
+ * Makes room for one more instruction in a function's code buffer.
+ */
+inline void ReserveCode(std::vector<Byte>& code, Byte*& ptr,
+                        std::size_t size) {
+    std::size_t used = ptr - code.data();
+    if (code.size() - used >= size)
+        return;
+
+    code.resize(std::max(code.size() * 2, used + size));
+    ptr = code.data() + used;
+}
+
+/*!
+ * Emits a function into its own buffer. Addresses of its instructions are
+ * relative to the buffer until Link() rebases them; jumps within the
+ * function are relaxed and patched right away since their distances won't
+ * change.
+ *
+ * Tier code is self-contained: the buffer starts with the tier prologue
+ * and ends with link stubs for jumps out of the function and the tier
+ * epilogue exits lead to.
+ */
+void BinTran::EmitFunction(Function& function, bool tier) {
+    RegisterStack regstack;
+    std::vector<Byte>& code = function.code;
+    std::vector<std::size_t> exits;  // rel32 fields jumping to the epilogue
+    code.assign(MAX_INSTR_SIZE, 0);
+    Byte* ptr = code.data();
+
+    if (tier)
+        WriteTierPrologue(ptr);
+
+    bool profile = profile_ && !tier;
+    for (std::size_t b = function.first_block; b < function.last_block; b++) {
+        const BasicBlock& block = blocks_[b];
+        regstack.Reset(block.entry_height);
+        std::size_t entry = ptr - code.data();
+        if (profile) {
+            ReserveCode(code, ptr, MAX_INSTR_SIZE);
+            WriteProfileCount(ptr, 2 * b);
+        }
+        for (std::size_t i = block.first; i < block.last; i++) {
+            BtInstr& instr = program_[i];
+            ReserveCode(code, ptr, instr.inlined ?
+                        MAX_INSTR_SIZE * (MAX_INLINE_SIZE + 2) :
+                        MAX_INSTR_SIZE);
+            if (tier && instr.IsTierExit()) {
+                instr.x86_addr = ptr - code.data();
+                regstack.Flush(ptr);
+                WriteTierExit(ptr, instr.zvm_addr);
+                exits.push_back(ptr - code.data() - sizeof(std::int32_t));
+                continue;
+            }
+            if (tier && instr.opcode == OPCODE_CALL) {
+                Register ret = Register(instr.zvm_addr);
+                FetchInstr(zvmbinary_, ret);
+                instr.x86_addr = ptr - code.data();
+                WriteTierCall(ptr, ret, regstack);
+                instr.x86_patch = ptr - code.data() - sizeof(std::int32_t);
+                continue;
+            }
+            if (tier && instr.opcode == OPCODE_RET) {
+                instr.x86_addr = ptr - code.data();
+                WriteTierRet(ptr, regstack);
+                exits.push_back(ptr - code.data() - sizeof(std::int32_t));
+                continue;
+            }
+            if (profile && instr.inlined)
+                WriteProfileCount(ptr, 2 * program_[instr.target].block);
+            WriteInstr(ptr, code.data(), instr, regstack);
+        }
+        // jumps to the block count its entry too
+        if (profile)
+            program_[block.first].x86_addr = entry;
+        ReserveCode(code, ptr, MAX_INSTR_SIZE);
+        WriteBlockEnd(ptr, block, regstack);
+        if (profile && LoopsBack(b))
+            WriteProfileCount(ptr, 2 * b + 1);
+    }
+    RelaxBranches(function, ptr, exits);
+
+    if (tier) {
+        // falling off the end of the function
+        std::size_t next = zvmbinary_size_;
+        if (function.last_block < blocks_.size())
+            next = program_[blocks_[function.last_block].first].zvm_addr;
+        ReserveCode(code, ptr, MAX_INSTR_SIZE);
+        WriteTierLink(ptr, next);
+        exits.push_back(ptr - code.data() - sizeof(std::int32_t));
+    }
+
+    std::size_t first = blocks_[function.first_block].first;
+    std::size_t last = blocks_[function.last_block - 1].last;
+    for (std::size_t i = first; i < last; i++) {
+        BtInstr& source = program_[i];
+        if (source.removed || source.inlined || !source.IsJump() ||
+            source.short_jump)
+            continue;
+
+        const BtInstr& dest = program_[source.target];
+        std::size_t dest_addr = dest.x86_addr;
+        if (blocks_[dest.block].function != blocks_[source.block].function) {
+            if (!tier)
+                continue;
+
+            ReserveCode(code, ptr, MAX_INSTR_SIZE);
+            dest_addr = ptr - code.data();
+            WriteTierLink(ptr, dest.zvm_addr);
+            exits.push_back(ptr - code.data() - sizeof(std::int32_t));
+        }
+
+        *(std::int32_t*)(code.data() + source.x86_patch) =
+            dest_addr - (source.x86_patch + sizeof(std::int32_t));
+    }
+
+    if (tier) {
+        ReserveCode(code, ptr, MAX_INSTR_SIZE);
+        std::size_t epilogue = ptr - code.data();
+        WriteTierEpilogue(ptr);
+        for (std::size_t patch: exits) {
+            *(std::int32_t*)(code.data() + patch) =
+                epilogue - (patch + sizeof(std::int32_t));
+        }
+    }
+    code.resize(ptr - code.data());
+}
+
+/*!
+ * Whether block 'b' ends with a JMC that may jump back to a block of its
+ * function, i.e. to the header of a loop.
+ */
+bool BinTran::LoopsBack(std::size_t b) const {
+    const BtInstr& tail = program_[blocks_[b].last - 1];
+    if (tail.removed || tail.opcode != OPCODE_JMC)
+        return false;
+
+    std::size_t target = program_[tail.target].block;
+    return target <= b && blocks_[target].function == blocks_[b].function;
+}
+
+/*!
+ * A jump RelaxBranches may shorten: the 'jmp rel32' or 'jCC rel32' at
+ * [start, end) of the function's code, leading to the instruction 'dest'.
+ */
+struct BranchSite {
+    std::size_t instr;
+    std::size_t start;
+    std::size_t end;
+    std::size_t dest;
+    bool conditional;
+    X86Condition cc;
+    bool short_form;
+};
+
+/*!
+ * Change to the function's code at 'offset': alignment padding in front
+ * of a loop header if 'site' is NO_INDEX, a jump to shorten otherwise.
+ * Offsets from 'from' on move by 'shift'.
+ */
+struct CodeEdit {
+    std::size_t offset;
+    std::size_t site;
+    std::size_t from;
+    std::ptrdiff_t shift;
+};
+
+/*!
+ * Offset that 'offset' of the unrelaxed code moves to.
+ */
+inline std::size_t RelaxedOffset(const std::vector<CodeEdit>& edits,
+                                 std::size_t offset) {
+    auto after = std::upper_bound(edits.begin(), edits.end(), offset,
+                                  [](std::size_t value, const CodeEdit& e) {
+                                      return value < e.from;
+                                  });
+    if (after == edits.begin())
+        return offset;
+    return offset + (after - 1)->shift;
+}
+
+/*!
+ * Branch relaxation of a freshly emitted function, before any of its
+ * rel32 fields is patched. Jumps within the function become 2-byte rel8
+ * jumps wherever their target is in reach, and targets of backward jumps
+ * are aligned to LOOP_ALIGNMENT with nops. Every jump starts out short;
+ * the ones out of reach in the resulting layout are made long and the
+ * layout is recomputed until none has to grow, which takes at most one
+ * round per jump. CALLs keep their rel32, their return address is taken
+ * relative to the jump.
+ *
+ * 'ptr' is the end of the function's code, 'fields' are offsets into it
+ * that are moved along with the instruction addresses.
+ */
+void BinTran::RelaxBranches(Function& function, Byte*& ptr,
+                            std::vector<std::size_t>& fields) {
+    std::vector<Byte>& code = function.code;
+    std::size_t first = blocks_[function.first_block].first;
+    std::size_t last = blocks_[function.last_block - 1].last;
+
+    std::vector<BranchSite> sites;
+    std::vector<CodeEdit> edits;
+    for (std::size_t i = first; i < last; i++) {
+        const BtInstr& instr = program_[i];
+        if (instr.removed || instr.inlined || !instr.IsJump() ||
+            instr.opcode == OPCODE_CALL ||
+            blocks_[program_[instr.target].block].function !=
+            blocks_[instr.block].function)
+            continue;
+
+        const Byte* opcode = code.data() + instr.x86_patch - 1;
+        BranchSite site = { i, instr.x86_patch - 1,
+                            instr.x86_patch + sizeof(std::int32_t),
+                            program_[instr.target].x86_addr,
+                            *opcode != 0xE9, X86Condition(*opcode & 0xF),
+                            true };
+        if (site.conditional)
+            site.start--;
+
+        if (instr.target <= i)
+            edits.push_back({ site.dest, NO_INDEX, site.dest, 0 });
+        edits.push_back({ site.start, sites.size(), site.end, 0 });
+        sites.push_back(site);
+    }
+    if (sites.empty())
+        return;
+
+    // padding goes first where a loop starts with a jump
+    std::sort(edits.begin(), edits.end(),
+              [](const CodeEdit& a, const CodeEdit& b) {
+                  if (a.offset != b.offset)
+                      return a.offset < b.offset;
+                  return a.site == NO_INDEX && b.site != NO_INDEX;
+              });
+    edits.erase(std::unique(edits.begin(), edits.end(),
+                            [](const CodeEdit& a, const CodeEdit& b) {
+                                return a.offset == b.offset &&
+                                       a.site == b.site;
+                            }),
+                edits.end());
+
+    for (bool grown = true; grown;) {
+        std::ptrdiff_t shift = 0;
+        for (auto& edit: edits) {
+            if (edit.site == NO_INDEX) {
+                shift += -(edit.offset + shift) & (LOOP_ALIGNMENT - 1);
+            } else {
+                const BranchSite& site = sites[edit.site];
+                if (site.short_form)
+                    shift -= site.end - site.start - 2;
+            }
+            edit.shift = shift;
+        }
+
+        grown = false;
+        for (auto& site: sites) {
+            std::ptrdiff_t distance = RelaxedOffset(edits, site.dest);
+            distance -= RelaxedOffset(edits, site.start) + 2;
+            if (site.short_form && !FitsInt8(distance)) {
+                site.short_form = false;
+                grown = true;
+            }
+        }
+    }
+
+    std::vector<Byte> relaxed(code.size() + edits.back().shift +
+                              MAX_INSTR_SIZE);
+    Byte* out = relaxed.data();
+    std::size_t copied = 0;
+    for (const auto& edit: edits) {
+        std::memcpy(out, code.data() + copied, edit.offset - copied);
+        out += edit.offset - copied;
+        copied = edit.offset;
+        if (edit.site == NO_INDEX) {
+            EmitNop(out, -(out - relaxed.data()) & (LOOP_ALIGNMENT - 1));
+            continue;
+        }
 
-    Byte* program_ptr = (Byte*)translated_code_;
+        const BranchSite& site = sites[edit.site];
+        BtInstr& instr = program_[site.instr];
+        if (!site.short_form)
+            continue;
+
+        Byte* end = site.conditional ? EmitJcc8(out, site.cc) : EmitJmp8(out);
+        PatchRel8(end, relaxed.data() + RelaxedOffset(edits, site.dest));
+        instr.short_jump = true;
+        instr.x86_patch = end - relaxed.data() - 1;
+        copied = site.end;
+    }
+    std::size_t size = ptr - code.data();
+    std::memcpy(out, code.data() + copied, size - copied);
+    out += size - copied;
+
+    for (std::size_t i = first; i < last; i++) {
+        BtInstr& instr = program_[i];
+        if (!instr.removed && !instr.inlined && instr.IsJump() &&
+            !instr.short_jump)
+            instr.x86_patch = RelaxedOffset(edits, instr.x86_patch);
+        instr.x86_addr = RelaxedOffset(edits, instr.x86_addr);
+    }
+    for (auto& field: fields)
+        field = RelaxedOffset(edits, field);
+
+    relaxed.resize(out - relaxed.data());
+    code.swap(relaxed);
+    ptr = code.data() + code.size();
+}
+
+/*!
+ * Lays out the header, the functions in program order and the footer in
+ * a new code region, then resolves jumps between functions. Every jump is
+ * recorded as a relocation.
+ */
+void BinTran::Link() {
+    Byte* program_ptr = BeginCode();
+    cache_.EnsureSpace(program_ptr, MAX_INSTR_SIZE);
     WriteCodeHeader(program_ptr);
-    for (auto it = program_.begin(); it != program_.end(); it++) {
-        WriteInstr(program_ptr, *it);
+    for (std::size_t i = 0; i < object_->DataSize(); i++) {
+        cache_.EnsureSpace(program_ptr, MAX_INSTR_SIZE);
+        WriteInitialData(program_ptr, object_->InitialData()[i]);
+    }
+
+    for (auto& function: functions_) {
+        // functions fall through into each other, so the gap holds nops
+        std::size_t padding = -(program_ptr - code_) & (LOOP_ALIGNMENT - 1);
+        cache_.EnsureSpace(program_ptr, padding);
+        EmitNop(program_ptr, padding);
+
+        function.offset = program_ptr - code_;
+        cache_.EnsureSpace(program_ptr, function.code.size());
+        std::memcpy(program_ptr, function.code.data(), function.code.size());
+        program_ptr += function.code.size();
+
+        std::size_t first = blocks_[function.first_block].first;
+        std::size_t last = blocks_[function.last_block - 1].last;
+        for (std::size_t i = first; i < last; i++) {
+            program_[i].x86_addr += function.offset;
+            program_[i].x86_patch += function.offset;
+        }
     }
+    cache_.EnsureSpace(program_ptr, MAX_INSTR_SIZE);
     WriteCodeFooter(program_ptr);
 
-    // patch jumps
-    for (const auto& it: jmp_map_) {
-        const int PATCH_OFFSET = 1;
-        const int JMC_ADD_OFFSET = 6;
-        const int JUMP_OFFSET = -5;
-
-        BtInstr* source = it.first;
-        BtInstr* dest = it.second;
-
-        int src_x86_addr = source->x86_addr;
-        int dest_x86_addr = dest->x86_addr;
-        int jmp_dist = dest_x86_addr - src_x86_addr + JUMP_OFFSET;
-        Byte* patch_addr = (Byte*)translated_code_ + src_x86_addr + PATCH_OFFSET;
-        if (source->opcode == OPCODE_JMC) {
-            patch_addr += JMC_ADD_OFFSET;
-            jmp_dist -= JMC_ADD_OFFSET;
+    for (const auto& source: program_) {
+        if (source.removed || source.inlined || !source.IsJump() ||
+            source.short_jump)
+            continue;
+
+        const BtInstr& dest = program_[source.target];
+        if (blocks_[dest.block].function != blocks_[source.block].function) {
+            *(std::int32_t*)(code_ + source.x86_patch) =
+                dest.x86_addr - (source.x86_patch + sizeof(std::int32_t));
         }
-        *(int*)patch_addr = jmp_dist;
+        relocations_.push_back({ std::uint32_t(source.x86_patch),
+                                 RELOC_REL32 });
+    }
+
+    EndCode(program_ptr);
+}
+
+/*!
+ * Builds what tier translation needs from the whole program. Functions
+ * are only optimized when they are translated.
+ */
+void BinTran::Analyze() {
+    Decode();
+    BuildCfg();
+    SplitFunctions();
+    ComputeStackHeights();
+    tier_code_.assign(functions_.size(), nullptr);
+    // one past the end for returns after a CALL that ends the program
+    tier_entries_.assign(zvmbinary_size_ + 1, nullptr);
+    analyzed_ = true;
+}
+
+bool BinTran::PrepareTier() {
+    if (analyzed_)
+        return true;
+
+    try {
+        Analyze();
+    } catch (const OutOfBoundsException&) {
+        return false;
+    }
+    return true;
+}
+
+bool BinTran::IsBlockStart(std::size_t zvm_addr) {
+    if (!analyzed_)
+        Analyze();
+    if (zvm_addr >= zvmbinary_size_ || zvmaddr_index_[zvm_addr] == NO_INDEX)
+        return false;
+
+    std::size_t index = zvmaddr_index_[zvm_addr];
+    return blocks_[program_[index].block].first == index;
+}
+
+bool BinTran::TranslateTier(std::size_t zvm_addr, TierEntry& entry) {
+    if (!analyzed_)
+        Analyze();
+    if (zvm_addr >= zvmbinary_size_ || zvmaddr_index_[zvm_addr] == NO_INDEX)
+        return false;
+
+    std::size_t index = zvmaddr_index_[zvm_addr];
+    const BasicBlock& block = blocks_[program_[index].block];
+    if (block.first != index || program_[index].IsTierExit())
+        return false;
+
+    Byte*& code = tier_code_[block.function];
+    if (!code) {
+        // folding leaves heights valid, so edges and heights aren't redone
+        Function& function = functions_[block.function];
+        FoldConstants(function, true);
+        FuseCompareBranch(function);
+        EmitFunction(function, true);
+
+        Byte* ptr = cache_.BeginRegion();
+        cache_.EnsureSpace(ptr, function.code.size());
+        std::memcpy(ptr, function.code.data(), function.code.size());
+        cache_.EndRegion(ptr + function.code.size());
+        code = ptr;
+
+        function.code.clear();
+        function.code.shrink_to_fit();
+
+        for (std::size_t b = function.first_block; b < function.last_block;
+             b++) {
+            const BtInstr& first = program_[blocks_[b].first];
+            tier_entries_[first.zvm_addr] = code + first.x86_addr;
+        }
+    }
+
+    entry.code = (TierCode)code;
+    entry.block = tier_entries_[zvm_addr];
+    return true;
+}
+
+void BinTran::ReleaseTier() {
+    for (Byte* code: tier_code_) {
+        if (code)
+            cache_.Release(code);
+    }
+    tier_code_.clear();
+    tier_entries_.clear();
+    analyzed_ = false;
+}
+
+void BinTran::TranslateLazy() {
+    Decode();
+    BuildCfg();
+    SplitFunctions();
+    ComputeStackHeights();
+
+    Byte* ptr = BeginCode();
+    lazy_addr_.assign(blocks_.size(), NO_INDEX);
+    lazy_stub_.assign(blocks_.size(), NO_INDEX);
+    lazy_sites_.assign(blocks_.size(), {});
+    lazy_optimized_.assign(functions_.size(), false);
+    lazy_error_ = nullptr;
+
+    cache_.EnsureSpace(ptr, MAX_INSTR_SIZE);
+    lazy_resolver_ = ptr - code_;
+    WriteLazyResolver(ptr);
+    lazy_halt_ = ptr - code_;
+    WriteCodeFooter(ptr);
+
+    cache_.EnsureSpace(ptr, MAX_INSTR_SIZE);
+    std::size_t entry = ptr - code_;
+    WriteCodeHeader(ptr);
+    for (std::size_t i = 0; i < object_->DataSize(); i++) {
+        cache_.EnsureSpace(ptr, MAX_INSTR_SIZE);
+        WriteInitialData(ptr, object_->InitialData()[i]);
+    }
+    if (blocks_.empty()) {
+        cache_.EnsureSpace(ptr, MAX_INSTR_SIZE);
+        WriteCodeFooter(ptr);
+    } else {
+        EmitLazyBlock(ptr, 0);
+    }
+
+    EndCode(ptr);
+    translated_code_ = (JittedCode)(code_ + entry);
+    lazy_ = true;
+}
+
+/*!
+ * Sets the rel32 field at 'site' of the code region to lead to 'dest'.
+ */
+inline void PatchRel32(Byte* code, std::size_t site, std::size_t dest) {
+    *(std::int32_t*)(code + site) = dest - (site + sizeof(std::int32_t));
+}
+
+/*!
+ * Appends block 'b' at 'ptr' together with stubs for the blocks it leads
+ * to that have no code yet, then links its branches and the ones waiting
+ * for it. A function is optimized when its first block is translated.
+ */
+void BinTran::EmitLazyBlock(Byte*& ptr, std::size_t b) {
+    const BasicBlock& block = blocks_[b];
+    if (!lazy_optimized_[block.function]) {
+        // folding leaves heights valid, so edges and heights aren't redone
+        FoldConstants(functions_[block.function]);
+        FuseCompareBranch(functions_[block.function]);
+        ElideFrames(functions_[block.function]);
+        lazy_optimized_[block.function] = true;
+    }
+
+    lazy_addr_[b] = ptr - code_;
+    RegisterStack regstack;
+    regstack.Reset(block.entry_height);
+    for (std::size_t i = block.first; i < block.last; i++) {
+        cache_.EnsureSpace(ptr, MAX_INSTR_SIZE);
+        WriteInstr(ptr, code_, program_[i], regstack);
+    }
+    cache_.EnsureSpace(ptr, MAX_INSTR_SIZE);
+    WriteBlockEnd(ptr, block, regstack);
+
+    // rel32 fields leaving the block and the blocks they lead to
+    std::vector<std::pair<std::size_t, std::size_t>> branches;
+    const BtInstr& tail = program_[block.last - 1];
+    if (!tail.removed && tail.IsJump())
+        branches.push_back({ tail.x86_patch, program_[tail.target].block });
+    if (FallsThrough(tail)) {
+        WriteFallThrough(ptr);
+        branches.push_back({ ptr - code_ - sizeof(std::int32_t), b + 1 });
+    }
+
+    for (const auto& branch: branches) {
+        std::size_t dest = branch.second;
+        if (dest < blocks_.size() && lazy_addr_[dest] == NO_INDEX &&
+            lazy_stub_[dest] == NO_INDEX) {
+            cache_.EnsureSpace(ptr, MAX_INSTR_SIZE);
+            lazy_stub_[dest] = ptr - code_;
+            WriteLazyStub(ptr, dest);
+        }
+    }
+
+    // nothing is patched before all code is in place
+    for (const auto& branch: branches) {
+        std::size_t site = branch.first;
+        std::size_t dest = branch.second;
+        if (dest == blocks_.size()) {
+            PatchRel32(code_, site, lazy_halt_);
+        } else if (lazy_addr_[dest] != NO_INDEX) {
+            PatchRel32(code_, site, lazy_addr_[dest]);
+        } else {
+            PatchRel32(code_, site, lazy_stub_[dest]);
+            lazy_sites_[dest].push_back(site);
+        }
+    }
+
+    for (std::size_t site: lazy_sites_[b])
+        PatchRel32(code_, site, lazy_addr_[b]);
+    lazy_sites_[b].clear();
+    lazy_sites_[b].shrink_to_fit();
+}
+
+/*!
+ * Translates block 'b' while the program runs and returns its code.
+ */
+const Byte* BinTran::TranslateLazyBlock(std::size_t b) {
+    if (lazy_addr_[b] != NO_INDEX)
+        return code_ + lazy_addr_[b];
+
+    Byte* ptr = cache_.ReopenRegion(code_);
+    Byte* end = ptr;
+    try {
+        EmitLazyBlock(ptr, b);
+    } catch (...) {
+        cache_.EndRegion(end);
+        throw;
     }
+    cache_.EndRegion(ptr);
+    actual_x86_size_ = ptr - code_;
+    return code_ + lazy_addr_[b];
+}
+
+/*!
+ * Called by the lazy resolver. Exceptions can't unwind through translated
+ * code, so a failure is kept for Execute() and the program halts.
+ */
+const Byte* BinTran::ResolveLazy(BinTran* bt, std::size_t b) {
+    try {
+        return bt->TranslateLazyBlock(b);
+    } catch (...) {
+        bt->lazy_error_ = std::current_exception();
+        return bt->code_ + bt->lazy_halt_;
+    }
+}
 
-    actual_x86_size_ = program_ptr - (Byte*)translated_code_;
+void BinTran::Translate() {
+    stats_ = {};
+    RunPhase("decode", false, [this] { Decode(); });
+    RunPhase("build cfg", false, [this] { BuildCfg(); });
+    RunPhase("split functions", false, [this] { SplitFunctions(); });
+    Optimize();
+    RunPhase("emit", false, [this] {
+        ForEachFunction([this](Function& function) {
+            EmitFunction(function, false);
+        });
+    });
+    RunPhase("link", false, [this] { Link(); });
+    if (collect_stats_)
+        CountCode();
+    profile_counts_.assign(ProfileCounterCount(), 0);
+
+    for (auto& function: functions_) {
+        function.code.clear();
+        function.code.shrink_to_fit();
+    }
 }
 
-#define IT_PTR() (&(*it))
+/*!
+ * Runs the optimization passes and the analyses code generation relies
+ * on. Stack heights are computed over the whole program, the passes run
+ * per function. Register allocation itself is done on the fly by
+ * RegisterStack while emitting each block.
+ */
 void BinTran::Optimize() {
-    if (program_.size() < 2)
+    auto heights = [this] { ComputeStackHeights(); };
+    RunPhase("stack heights", false, heights);
+    RunPhase("fold constants", true, [this] {
+        ForEachFunction([this](Function& function) {
+            FoldConstants(function);
+        });
+    });
+    RunPhase("build edges", false, [this] { BuildEdges(); });
+    RunPhase("stack heights", false, heights);
+    RunPhase("fuse compares", true, [this] {
+        ForEachFunction([this](Function& function) {
+            FuseCompareBranch(function);
+        });
+    });
+    RunPhase("elide frames", true, [this] {
+        ForEachFunction([this](Function& function) {
+            ElideFrames(function);
+        });
+    });
+    RunPhase("inline calls", true, [this] { InlineCalls(); });
+    RunPhase("stack heights", false, heights);
+}
+
+/*!
+ * Whether a pass changed what code 'after' translates into.
+ */
+inline bool Rewritten(const BtInstr& before, const BtInstr& after) {
+    return before.opcode != after.opcode || before.arg != after.arg ||
+           before.op1_loc != after.op1_loc ||
+           before.op2_loc != after.op2_loc ||
+           before.res_loc != after.res_loc || before.imm != after.imm ||
+           before.removed != after.removed || before.cond != after.cond ||
+           before.probe != after.probe || before.inlined != after.inlined;
+}
+
+/*!
+ * Runs a phase of Translate(), accounting for it in stats_ if they are
+ * collected. 'rewrites' phases are optimization passes whose changes to
+ * the program are counted; the copy that takes isn't timed.
+ */
+void BinTran::RunPhase(const char* name, bool rewrites,
+                       const std::function<void()>& phase) {
+    if (!collect_stats_) {
+        phase();
         return;
+    }
 
-    auto it = program_.begin();
+    std::vector<BtInstr> before;
+    if (rewrites)
+        before = program_;
 
-    BtInstr* instr_prev = IT_PTR();
-    it++;
-    BtInstr* instr = IT_PTR();
+    AllocStats allocs = GetAllocStats();
+    auto start = std::chrono::steady_clock::now();
+    phase();
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    AllocStats allocs_after = GetAllocStats();
 
-    while (it != program_.end()) {
-        it++;
-        if (jmp_map_.find(instr) == jmp_map_.end() && instr->IsArithmetic() &&
-            jmp_map_.find(instr_prev) == jmp_map_.end() &&
-            instr_prev->IsArithmetic())
-        {
-            instr_prev->res_loc = DATALOC_R9;
-            instr->op2_loc = DATALOC_R9;
+    auto found = std::find_if(stats_.phases.begin(), stats_.phases.end(),
+                              [&](const PhaseStats& stats) {
+                                  return std::strcmp(stats.name, name) == 0;
+                              });
+    if (found == stats_.phases.end())
+        found = stats_.phases.insert(found, { name, 0.0, { 0, 0 },
+                                              rewrites, 0 });
+    found->seconds += seconds.count();
+    found->allocs.count += allocs_after.count - allocs.count;
+    found->allocs.bytes += allocs_after.bytes - allocs.bytes;
+    for (std::size_t i = 0; i < before.size(); i++)
+        found->rewrites += Rewritten(before[i], program_[i]);
+}
+
+/*!
+ * Fills in the sizes in stats_ once the program is linked.
+ */
+void BinTran::CountCode() {
+    stats_.instructions = program_.size();
+    stats_.blocks = blocks_.size();
+    stats_.functions = functions_.size();
+    stats_.zvm_bytes = zvmbinary_size_;
+    stats_.x86_bytes = actual_x86_size_;
+
+    for (const auto& function: functions_) {
+        std::size_t first = blocks_[function.first_block].first;
+        std::size_t last = blocks_[function.last_block - 1].last;
+        std::size_t end = function.offset + function.code.size();
+        for (std::size_t i = first; i < last; i++) {
+            const BtInstr& instr = program_[i];
+            std::size_t next = i + 1 < last ? program_[i + 1].x86_addr : end;
+            // by the opcode in the binary, passes may have changed it
+            Register pc = instr.zvm_addr;
+            Opcode opcode = FetchInstr(zvmbinary_, pc).opcode;
+
+            OpcodeStats& stats = stats_.opcodes[opcode];
+            stats.count++;
+            stats.zvm_bytes += pc - instr.zvm_addr;
+            stats.x86_bytes += next - instr.x86_addr;
+            stats_.short_jumps += instr.short_jump;
         }
+    }
+}
+
+void BinTran::Execute() {
+    if (!translated_code_)
+        throw std::logic_error("no translated code to execute");
 
-        instr_prev = instr;
-        instr = IT_PTR();
+    io::Reader reader;
+    io::Writer writer;
+    reader.Tie(&writer);
+    io::TextInput input(reader);
+    io::TextOutput output(writer);
+    Execute(input, output);
+}
+
+void BinTran::Execute(io::InputChannel& input, io::OutputChannel& output) {
+    if (!translated_code_)
+        throw std::logic_error("no translated code to execute");
+
+    std::unique_ptr<io::Runtime> rt(new io::Runtime);
+    io::InitRuntime(*rt, input, output);
+
+    Sandbox sandbox(data_capacity_, CALL_STACK_SIZE);
+    Execute(*rt, sandbox);
+}
+
+void BinTran::Execute(io::Runtime& rt, Sandbox& sandbox) {
+    if (!translated_code_)
+        throw std::logic_error("no translated code to execute");
+    if (sandbox.Capacity() < data_capacity_)
+        throw std::logic_error("sandbox smaller than the data stack");
+    if (profile_ && !rt.counters)
+        rt.counters = profile_counts_.data();
+
+    sandbox.Run(&rt, [&] {
+        translated_code_(&rt, sandbox.Slot0(), sandbox.CallTop(),
+                         sandbox.BpTop());
+    });
+    io::FlushRuntime(rt);
+
+    if (lazy_error_) {
+        std::exception_ptr error = lazy_error_;
+        lazy_error_ = nullptr;
+        std::rethrow_exception(error);
     }
 }
-#undef IT_PTR
 
-Data Input() {
-    Data d = 0;
-    std::scanf("%d", &d);
-    return d;
+/*!
+ * Hash of the parts of the object file the translation depends on.
+ */
+std::uint64_t BinTran::SourceHash() const {
+    std::uint64_t hash = HashBytes(zvmbinary_, zvmbinary_size_);
+    hash = HashBytes(object_->InitialData(),
+                     object_->DataSize() * sizeof(Data), hash);
+    for (std::size_t i = 0; i < object_->JumpTableSize(); i++) {
+        std::uint32_t target = object_->JumpTarget(i);
+        hash = HashBytes(&target, sizeof(target), hash);
+    }
+    return hash;
 }
 
-void Output(Data val) {
-    std::printf("%d\n", val);
+/*!
+ * Hash of everything besides the source that affects the translation.
+ */
+std::uint64_t BinTran::ConfigHash() const {
+    std::uint64_t config[] = { TranslatorBuildHash(), MAX_INSTR_SIZE,
+                               MAX_FUNCTION_SIZE, LOOP_ALIGNMENT,
+                               data_capacity_ };
+    return HashBytes(config, sizeof(config));
 }
 
-void BinTran::Execute() {
-    translated_code_(&Input, &Output, NULL);
+/*!
+ * Loads the translation of the current binary from 'cache'. Returns false
+ * if there is no valid one.
+ */
+bool BinTran::LoadCached(TranslationCache& cache) {
+    if (profile_)
+        return false;
+
+    CachedTranslation translation;
+    if (!cache.Load(SourceHash(), ConfigHash(), translation))
+        return false;
+
+    ReleaseCode();
+    code_ = cache_.MapRegion(translation.path, translation.code_offset,
+                             translation.code_size);
+    actual_x86_size_ = translation.code_size;
+    translated_code_ = (JittedCode)(code_ + translation.entry);
+    relocations_ = translation.relocations;
+
+    if (HashBytes(code_, actual_x86_size_) != translation.code_hash ||
+        !CheckRelocations()) {
+        ReleaseCode();
+        cache.Remove(SourceHash(), ConfigHash());
+        return false;
+    }
+    return true;
 }
 
-void BinTran::LoadX86CodeFromFile(const std::string& filename) {
-    if (!fs::exists(filename))
-        throw IoException(filename, ERR_FILE_DOESNT_EXIST);
+/*!
+ * Checks that every relocation of the code can be honoured where it lies.
+ */
+bool BinTran::CheckRelocations() const {
+    for (const auto& reloc: relocations_) {
+        if (reloc.kind != RELOC_REL32 ||
+            reloc.offset + sizeof(std::int32_t) > actual_x86_size_)
+            return false;
 
-    std::size_t filesize = fs::file_size(filename);
-    std::FILE* f = std::fopen(filename.c_str(), "rb");
-    if (!f)
-        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
+        std::int64_t target = std::int64_t(reloc.offset) +
+                              sizeof(std::int32_t) +
+                              *(const std::int32_t*)(code_ + reloc.offset);
+        if (target < 0 || std::uint64_t(target) >= actual_x86_size_)
+            return false;
+    }
+    return true;
+}
 
-    std::fread((void*)translated_code_, 1, allocated_size_, f);
-    std::fclose(f);
+void BinTran::StoreCached(TranslationCache& cache) const {
+    if (!code_)
+        throw std::logic_error("no translated code to store");
+    if (lazy_)
+        throw std::logic_error("lazily translated code can't be cached");
+    if (profile_)
+        throw std::logic_error("profiled code can't be cached");
 
-    actual_x86_size_ = filesize;
+    CachedTranslation translation;
+    translation.code.assign(code_, code_ + actual_x86_size_);
+    translation.entry = (Byte*)translated_code_ - code_;
+    translation.relocations = relocations_;
+    cache.Store(SourceHash(), ConfigHash(), translation);
 }
 
 void BinTran::SaveX86CodeToFile(const std::string& filename) {
@@ -238,20 +1233,132 @@ void BinTran::SaveX86CodeToFile(const std::string& filename) {
     if (!f)
         throw IoException(filename, ERR_FILE_OPEN_FAILURE);
 
-    std::fwrite((void*)translated_code_, 1, actual_x86_size_, f);
+    std::fwrite(code_, 1, actual_x86_size_, f);
     std::fclose(f);
 }
 
-BinTran::JittedCode BinTran::AllocWriteableMemory(std::size_t size) const {
-    void* ptr = mmap(0, size,
-                     PROT_READ | PROT_WRITE | PROT_EXEC,
-                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+/*!
+ * The label at or closest before the ZVM address 'addr' in 'symbols',
+ * which are sorted by address, as "LABEL" or "LABEL+offset".
+ */
+inline std::string AddressLabel(const std::vector<ObjectSymbol>& symbols,
+                                std::size_t addr) {
+    auto next = std::upper_bound(symbols.begin(), symbols.end(), addr,
+                                 [](std::size_t value,
+                                    const ObjectSymbol& symbol) {
+                                     return value < symbol.address;
+                                 });
+    if (next == symbols.begin())
+        return "";
+
+    const ObjectSymbol& symbol = *(next - 1);
+    if (symbol.address == addr)
+        return symbol.name;
+    return symbol.name + "+" + std::to_string(addr - symbol.address);
+}
+
+void BinTran::WriteProfile(std::FILE* f) const {
+    if (profile_counts_.empty())
+        throw std::logic_error("no profiled translation");
+
+    std::vector<ObjectSymbol> symbols = object_->Symbols();
+    std::stable_sort(symbols.begin(), symbols.end(),
+                     [](const ObjectSymbol& a, const ObjectSymbol& b) {
+                         return a.address < b.address;
+                     });
+
+    // blocks by the instructions they ran
+    struct BlockCount {
+        std::size_t block;
+        std::uint64_t count;
+        std::uint64_t instrs;
+    };
+    std::vector<BlockCount> blocks;
+    std::vector<BlockCount> loops;  // by back edges taken
+    std::uint64_t entries = 0;
+    std::uint64_t instrs = 0;
+    for (std::size_t b = 0; b < blocks_.size(); b++) {
+        std::uint64_t count = profile_counts_[2 * b];
+        std::uint64_t size = blocks_[b].last - blocks_[b].first;
+        if (count == 0)
+            continue;
 
-    if (ptr == (void*)-1) {
-        throw AllocException();
+        blocks.push_back({ b, count, count * size });
+        entries += count;
+        instrs += count * size;
+
+        const BtInstr& tail = program_[blocks_[b].last - 1];
+        if (LoopsBack(b)) {
+            loops.push_back({ b, count - profile_counts_[2 * b + 1], 0 });
+        } else if (!tail.removed && tail.opcode == OPCODE_JMP) {
+            std::size_t target = program_[tail.target].block;
+            if (target <= b &&
+                blocks_[target].function == blocks_[b].function) {
+                loops.push_back({ b, count, 0 });
+            }
+        }
     }
+    std::stable_sort(blocks.begin(), blocks.end(),
+                     [](const BlockCount& a, const BlockCount& b) {
+                         return a.instrs > b.instrs;
+                     });
+    std::stable_sort(loops.begin(), loops.end(),
+                     [](const BlockCount& a, const BlockCount& b) {
+                         return a.count > b.count;
+                     });
 
-    return (JittedCode)ptr;
+    std::fprintf(f, "%llu block entries, %llu ZVM instructions\n\n"
+                 "%12s %12s %6s %8s  %s\n",
+                 (unsigned long long)entries, (unsigned long long)instrs,
+                 "entries", "instrs", "share", "address", "label");
+    for (const auto& block: blocks) {
+        std::size_t addr = program_[blocks_[block.block].first].zvm_addr;
+        std::fprintf(f, "%12llu %12llu %5.1f%% %8zu  %s\n",
+                     (unsigned long long)block.count,
+                     (unsigned long long)block.instrs,
+                     100.0 * block.instrs / instrs, addr,
+                     AddressLabel(symbols, addr).c_str());
+    }
+
+    if (loops.empty())
+        return;
+    std::fprintf(f, "\n%12s %8s %8s  %s\n", "back edges", "from", "to",
+                 "loop");
+    for (const auto& loop: loops) {
+        const BtInstr& tail = program_[blocks_[loop.block].last - 1];
+        std::size_t header = program_[tail.target].zvm_addr;
+        std::fprintf(f, "%12llu %8zu %8zu  %s\n",
+                     (unsigned long long)loop.count, tail.zvm_addr, header,
+                     AddressLabel(symbols, header).c_str());
+    }
+}
+
+void BinTran::ReleaseCode() {
+    if (code_)
+        cache_.Release(code_);
+    code_ = nullptr;
+    translated_code_ = nullptr;
+    actual_x86_size_ = 0;
+    relocations_.clear();
+    lazy_ = false;
+}
+
+/*!
+ * Opens a code cache region for a new program, dropping the old one.
+ */
+Byte* BinTran::BeginCode() {
+    ReleaseCode();
+    code_ = cache_.BeginRegion();
+    return code_;
+}
+
+/*!
+ * Closes the program's region. The entry point defaults to its start.
+ */
+void BinTran::EndCode(Byte* end) {
+    cache_.EndRegion(end);
+    actual_x86_size_ = end - code_;
+    translated_code_ = (JittedCode)code_;
 }
 
 }  // namespace zvm
@@ -18,25 +18,30 @@
 #ifndef ZVM_BINTRAN_HPP_
 #define ZVM_BINTRAN_HPP_
 
-#include <string>
+#include <cstdio>
+#include <exception>
+#include <functional>
 #include <map>
+#include <memory>
+#include <string>
 #include <vector>
-#include <list>
+#include "allocstats.hpp"
+#include "codecache.hpp"
+#include "io.hpp"
+#include "objfile.hpp"
+#include "sandbox.hpp"
+#include "threadpool.hpp"
+#include "transcache.hpp"
 #include "zvmarch.hpp"
+#include "x86arch.hpp"
+#include "datatools.hpp"
 
 namespace zvm {
 
-enum DataLocation {
-    DATALOC_NONE,
-    DATALOC_STACK,
-    DATALOC_RAX,
-    DATALOC_R8,
-    DATALOC_R9,
-    DATALOC_R14,
-    DATALOC_IMM,
-    DATALOC_STDIN,
-    DATALOC_STDOUT
-};
+/*!
+ * Index value meaning "no instruction" / "no block".
+ */
+const std::size_t NO_INDEX = std::size_t(-1);
 
 struct BtInstr {
     Opcode opcode;
@@ -49,47 +54,410 @@ struct BtInstr {
     DataLocation op2_loc;
     DataLocation res_loc;
 
-    bool IsArithmetic() {
+    std::size_t target;  // index of the jump target in BinTran::program_
+    std::size_t block;   // index of the containing block in BinTran::blocks_
+    std::size_t x86_patch;  // offset of the rel32 field of a jump
+    bool short_jump;        // relaxed to a rel8 jump, x86_patch is its rel8
+
+    Data imm;      // value of a DATALOC_IMM operand folded into the instruction
+    bool removed;  // folded away, emits no code
+    Opcode cond;   // JMC condition on the popped value, a fused compare or NEQZ
+    bool probe;    // PUSHBP of an elided frame, only checks the bp stack
+    bool inlined;  // CALL replaced by the body of its callee
+
+    bool IsArithmetic() const {
         return opcode == OPCODE_ADD || opcode == OPCODE_SUB ||
                opcode == OPCODE_MUL;
     }
+
+    bool IsCompare() const {
+        return opcode == OPCODE_GZ || opcode == OPCODE_BZ ||
+               opcode == OPCODE_GEZ || opcode == OPCODE_BEZ ||
+               opcode == OPCODE_EQZ || opcode == OPCODE_NEQZ;
+    }
+
+    bool IsJump() const {
+        return opcode == OPCODE_JMP || opcode == OPCODE_JMC ||
+               opcode == OPCODE_CALL;
+    }
+
+    /*!
+     * Whether tier code leaves the instruction to the interpreter.
+     */
+    bool IsTierExit() const {
+        return opcode == OPCODE_HALT;
+    }
+
+    StackEffect Effect() const {
+        if (removed)
+            return { 0, 0 };
+        return { (op1_loc == DATALOC_STACK) + (op2_loc == DATALOC_STACK),
+                 res_loc == DATALOC_STACK };
+    }
+};
+
+/*!
+ * Basic block: instructions [first, last) of BinTran::program_.
+ * CALL blocks have two successors: the callee and the return point.
+ */
+struct BasicBlock {
+    std::size_t first;
+    std::size_t last;
+
+    int entry_height;  // ZVM stack depth on entry, -1 if not known
+
+    std::vector<std::size_t> preds;
+    std::vector<std::size_t> succs;
+
+    std::size_t function;  // index of the containing BinTran::functions_
+};
+
+/*!
+ * Translation unit: blocks [first_block, last_block) of BinTran::blocks_,
+ * starting at the program entry, at a CALL target or where a long
+ * function is cut. Functions are optimized and emitted independently into
+ * 'code'; the link step places them at 'offset' in the code region, which
+ * is a multiple of BinTran::LOOP_ALIGNMENT.
+ */
+struct Function {
+    std::size_t first_block;
+    std::size_t last_block;
+
+    std::vector<Byte> code;
+    std::size_t offset;
+};
+
+/*!
+ * Entry of a CALL target. Leaf functions small enough to be inlined keep
+ * a copy of their optimized body without the final RET.
+ */
+struct CallTarget {
+    std::size_t block;
+    bool inlinable;
+    std::vector<BtInstr> body;
+};
+
+/*!
+ * ZVM state handed to and back from tier code. The stacks are laid out as
+ * in translated programs: slot i is the 8-byte word at slot 0 - 8 * i,
+ * the call stack holds ZVM return addresses in the low half of its words
+ * and the bp stack holds the slot addresses bp pointed at.
+ */
+struct TierFrame {
+    std::uint64_t* base;   // address of the slot bp points at, becomes r15
+    std::uint64_t* sp;     // address of the top slot, becomes rsp
+    std::uint64_t* calls;  // top of the call stack, becomes r12
+    std::uint64_t* bps;    // top of the bp stack, becomes rbp
+    std::uint32_t pc;      // set on exit: ZVM address to continue at
+};
+
+/*!
+ * Runs tier code from 'block' until control reaches a block that isn't
+ * translated yet or an instruction left to the interpreter.
+ */
+typedef void (*TierCode)(io::Runtime* rt, TierFrame* frame,
+                         const Byte* block);
+
+/*!
+ * Native entry point of a ZVM block.
+ */
+struct TierEntry {
+    TierCode code;
+    const Byte* block;
+};
+
+/*!
+ * One phase of a translation: its wall time, the heap allocations made
+ * meanwhile by the whole process and, for optimization passes, the
+ * instructions it rewrote. A phase that runs several times adds up.
+ */
+struct PhaseStats {
+    const char* name;
+    double seconds;
+    AllocStats allocs;
+    bool pass;
+    std::size_t rewrites;
+};
+
+/*!
+ * Instructions with one opcode in the binary and the code they were
+ * translated into. The x86 bytes of an instruction include the block end
+ * it is followed by and padding in front of the next one.
+ */
+struct OpcodeStats {
+    std::size_t count;
+    std::size_t zvm_bytes;
+    std::size_t x86_bytes;
+};
+
+/*!
+ * What Translate() did, collected when enabled with BinTran::EnableStats.
+ */
+struct TranslationStats {
+    std::vector<PhaseStats> phases;  // in the order they first ran
+    std::size_t instructions;
+    std::size_t blocks;
+    std::size_t functions;
+    std::size_t zvm_bytes;
+    std::size_t x86_bytes;           // whole code region
+    std::size_t short_jumps;         // jumps relaxed to rel8
+    std::map<Opcode, OpcodeStats> opcodes;
 };
 
 class BinTran {
 public:
-    BinTran(std::size_t alloc_size = MAX_OUTPUT_SIZE);
+    BinTran();
+    explicit BinTran(CodeCache& cache);
     ~BinTran();
 
     void LoadBinary(const std::string& filename);
+
+    /*!
+     * Translates 'object' instead of a file of its own. 'object' must
+     * outlive the translator.
+     */
+    void LoadProgram(const ObjectFile& object);
     void Translate();
+
+    /*!
+     * Translates only the entry block. Every other block is translated
+     * when control first reaches it: branches to untranslated blocks lead
+     * to a stub that calls back into the translator, which appends the
+     * block to the code region and patches the branches to jump to it
+     * directly. The translator must outlive Execute(); lazily translated
+     * code can't be cached.
+     */
+    void TranslateLazy();
     void Optimize();
+
+    /*!
+     * Runs the translated program with text I/O on stdin and stdout.
+     */
     void Execute();
-    void LoadX86CodeFromFile(const std::string& filename);
+
+    /*!
+     * Runs the translated program on a sandbox of its own, sized by
+     * SetDataCapacity(), reading INPUT from 'input' and writing OUTPUT to
+     * 'output'.
+     */
+    void Execute(io::InputChannel& input, io::OutputChannel& output);
+
+    /*!
+     * Runs the translated program on 'sandbox' with I/O through 'rt'. The
+     * sandbox must hold the data stack set by SetDataCapacity().
+     * Translations made by Translate() or LoadCached() may run on several
+     * threads at once, each with its own runtime and sandbox.
+     */
+    void Execute(io::Runtime& rt, Sandbox& sandbox);
+    bool LoadCached(TranslationCache& cache);
+    void StoreCached(TranslationCache& cache) const;
     void SaveX86CodeToFile(const std::string& filename);
 
-    const static std::size_t MAX_OUTPUT_SIZE = 4096 * 16;
+    /*!
+     * Threads used by Translate, 0 for one per hardware thread. The code
+     * produced doesn't depend on it.
+     */
+    void SetThreadCount(std::size_t thread_count);
+
+    /*!
+     * Slots of the data stack the code runs on, DATA_MEMORY_SIZE unless
+     * set. LOADs and STOREs of slots past it fault without looking, so
+     * the code must run on a sandbox at least this large.
+     */
+    void SetDataCapacity(std::size_t capacity) {
+        data_capacity_ = capacity;
+    }
+
+    /*!
+     * Makes Translate() collect TranslationStats. This costs a copy of the
+     * program per optimization pass.
+     */
+    void EnableStats(bool enable) {
+        collect_stats_ = enable;
+    }
+
+    const TranslationStats& Stats() const {
+        return stats_;
+    }
+
+    /*!
+     * Makes Translate() instrument the code with block counters: counter
+     * 2b counts the entries of block b, counter 2b + 1 the times the JMC
+     * ending it fell through instead of jumping back into a loop. Inlined
+     * calls count as entries of the callee. Profiled code counts into the
+     * io::Runtime's counters, ProfileCounterCount() of them, or into the
+     * translator's own ones if those are null. It isn't cached.
+     */
+    void EnableProfile(bool enable) {
+        profile_ = enable;
+    }
+
+    std::size_t ProfileCounterCount() const {
+        return profile_ ? 2 * blocks_.size() : 0;
+    }
+
+    /*!
+     * Reports the translator's own counters: blocks by the ZVM
+     * instructions they ran, hottest first, and the loops' back edges,
+     * with ZVM addresses and the labels of the object file.
+     */
+    void WriteProfile(std::FILE* f) const;
+
+    /*!
+     * Analyzes the program for IsBlockStart() and TranslateTier(). Returns
+     * false if the translator rejects it, for a jump out of bounds, in
+     * which case the program can only be interpreted.
+     */
+    bool PrepareTier();
+
+    /*!
+     * Whether a basic block starts at 'zvm_addr'. Tier code only exits to
+     * such addresses.
+     */
+    bool IsBlockStart(std::size_t zvm_addr);
+
+    /*!
+     * Translates the function containing the block at 'zvm_addr' into tier
+     * code on first use and returns the block's entry point. Returns false
+     * if no block starts there or the block starts with an instruction left
+     * to the interpreter.
+     *
+     * Tier code runs on the interpreter's stacks in place (see TierFrame).
+     * Jumps, calls and returns to blocks translated before go straight to
+     * their tier code, other ones exit to the interpreter at the target,
+     * and HALT is left to the interpreter by exiting in front of it. It
+     * assumes bp is 0 wherever block heights are known statically. Not to
+     * be mixed with Translate() on one instance.
+     */
+    bool TranslateTier(std::size_t zvm_addr, TierEntry& entry);
+
+    std::uint64_t SourceHash() const;
+    std::uint64_t ConfigHash() const;
+
+    /*!
+     * Upper bound on the code emitted for one instruction or block end,
+     * including the register spills around it.
+     */
+    const static std::size_t MAX_INSTR_SIZE = 256;
+
+    /*!
+     * Functions longer than this many instructions are cut at the next
+     * block boundary, so one huge function doesn't serialize translation.
+     */
+    const static std::size_t MAX_FUNCTION_SIZE = 4096;
+
+    /*!
+     * Callees of at most this many instructions besides RET are inlined.
+     */
+    const static std::size_t MAX_INLINE_SIZE = 16;
+
+    /*!
+     * Targets of backward jumps within a function start at multiples of
+     * this many bytes, and so does every function.
+     */
+    const static std::size_t LOOP_ALIGNMENT = 16;
 private:
-    typedef Data (*InputFunc)();
-    typedef void (*OutputFunc)(Data val);
-    typedef void (*JittedCode)(InputFunc inputfun,
-                               OutputFunc outputfun,
-                               Byte* bp_stack);
+    /*!
+     * Translated program, run on the ZVM stack whose slot 0 is at 'slot0'
+     * and on empty return address and bp stacks topped at 'call_top' and
+     * 'bp_top' (see Sandbox).
+     */
+    typedef void (*JittedCode)(io::Runtime* rt, std::uint64_t* slot0,
+                               std::uint64_t* call_top,
+                               std::uint64_t* bp_top);
 
-    Byte* zvmbinary_;
+    ObjectFile own_object_;
+    const ObjectFile* object_;
+    const Byte* zvmbinary_;
     std::size_t zvmbinary_size_;
 
-    JittedCode translated_code_;
-    std::size_t allocated_size_;
+    std::unique_ptr<CodeCache> own_cache_;
+    CodeCache& cache_;
+    Byte* code_;                  // start of the program's code cache region
+    JittedCode translated_code_;  // entry point
+    std::vector<Relocation> relocations_;
     std::size_t actual_x86_size_;
 
-    std::list<BtInstr> program_;
-    std::map<std::size_t, BtInstr*> zvmaddr_map_;
-    std::map<BtInstr*, BtInstr*> jmp_map_;
+    std::vector<BtInstr> program_;
+    std::vector<BasicBlock> blocks_;
+    std::vector<std::size_t> zvmaddr_index_;
+    std::vector<Function> functions_;
+    std::map<std::size_t, CallTarget> call_targets_;  // by ZVM address
+
+    std::size_t thread_count_;
+    std::size_t data_capacity_;
+    std::unique_ptr<ThreadPool> pool_;
+
+    bool collect_stats_;
+    TranslationStats stats_;
+
+    bool profile_;
+    std::vector<std::uint64_t> profile_counts_;
+
+    bool analyzed_;                // tier mode: CFG and heights are ready
+    std::vector<Byte*> tier_code_; // tier code region of every function
+    std::vector<const Byte*> tier_entries_;  // tier code of every block
+                                             // start by ZVM address
+
+    // lazy mode, addresses are offsets into code_
+    bool lazy_;
+    std::vector<std::size_t> lazy_addr_;  // of every block, NO_INDEX if absent
+    std::vector<std::size_t> lazy_stub_;  // of every block's stub, if any
+    std::vector<std::vector<std::size_t>> lazy_sites_;  // rel32 fields
+                                                        // leading to stubs
+    std::vector<bool> lazy_optimized_;    // by function
+    std::size_t lazy_resolver_;
+    std::size_t lazy_halt_;
+    std::exception_ptr lazy_error_;       // translation failed at run time
 
-    JittedCode AllocWriteableMemory(std::size_t size) const;
+    void Decode();
+    void BuildCfg();
+    void BuildEdges();
+    void SplitFunctions();
+    void ComputeStackHeights();
+    void FoldConstants(const Function& function, bool tier = false);
+    void FuseCompareBranch(const Function& function);
+    void ElideFrames(const Function& function);
+    CallTarget LeafCallTarget(std::size_t b) const;
+    void InlineCalls();
+    void Analyze();
+    void ReleaseTier();
+    void EmitLazyBlock(Byte*& ptr, std::size_t b);
+    void LinkLazy(std::size_t site, std::size_t b);
+    const Byte* TranslateLazyBlock(std::size_t b);
+    static const Byte* ResolveLazy(BinTran* bt, std::size_t b);
+    void EmitFunction(Function& function, bool tier);
+    void RelaxBranches(Function& function, Byte*& ptr,
+                       std::vector<std::size_t>& fields);
+    bool LoopsBack(std::size_t b) const;
+    void Link();
+    void ForEachFunction(const std::function<void(Function&)>& pass);
+    void RunPhase(const char* name, bool rewrites,
+                  const std::function<void()>& phase);
+    void CountCode();
+    void ReleaseCode();
+    Byte* BeginCode();
+    void EndCode(Byte* end);
+    bool CheckRelocations() const;
     void WriteCodeHeader(Byte*& ptr);
+    void WriteInitialData(Byte*& ptr, Data value);
     void WriteCodeFooter(Byte*& ptr);
-    void WriteInstr(Byte*& ptr, BtInstr& instr);
+    void WriteTierPrologue(Byte*& ptr);
+    void WriteTierExit(Byte*& ptr, std::size_t zvm_addr);
+    void WriteTierLink(Byte*& ptr, std::size_t zvm_addr);
+    void WriteTierCall(Byte*& ptr, Register ret_addr, RegisterStack& rs);
+    void WriteTierRet(Byte*& ptr, RegisterStack& rs);
+    void WriteTierEpilogue(Byte*& ptr);
+    void WriteLazyResolver(Byte*& ptr);
+    void WriteLazyStub(Byte*& ptr, std::size_t b);
+    void WriteFallThrough(Byte*& ptr);
+    void WriteProfileCount(Byte*& ptr, std::size_t counter);
+    void WriteInstr(Byte*& ptr, const Byte* base, BtInstr& instr,
+                    RegisterStack& rs);
+    void WriteInlinedCall(Byte*& ptr, const Byte* base, const BtInstr& instr,
+                          RegisterStack& rs);
+    void WriteBlockEnd(Byte*& ptr, const BasicBlock& block,
+                       RegisterStack& rs);
 };
 
 }  // namespace zvm
@@ -1,47 +1,333 @@
 #include "bintran.hpp"
+#include "channels.hpp"
 #include "exceptions.hpp"
-#include <experimental/filesystem>
+#include "host.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <memory>
 #include <string>
-
-namespace fs = std::experimental::filesystem;
+#include <unistd.h>
+#include <vector>
 
 inline void DisplayUsage() {
-    std::printf("Usage: bintran PROGRAM\n");
+    std::printf("Usage: bintran [--no-cache] [--cache-dir DIR] "
+                "[--dump-x86 FILE] [--threads N] [--lazy]\n"
+                "               [--raw-input FILE] [--raw-output FILE] "
+                "[--stats]\n"
+                "               [--profile FILE] PROGRAM\n"
+                "       bintran [--no-cache] [--cache-dir DIR] [--threads N] "
+                "--batch FILE\n");
+}
+
+/*!
+ * Opens 'filename' for a job, "-" is the standard stream 'std_fd'.
+ */
+inline int OpenJobFile(const std::string& filename, int std_fd, int flags) {
+    if (filename == "-")
+        return std_fd;
+
+    int fd = open(filename.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw zvm::IoException(filename, zvm::ERR_FILE_OPEN_FAILURE);
+    return fd;
+}
+
+/*!
+ * Runs the jobs listed in 'filename' on one host and reports each on
+ * stderr. A line lists a job as 'PROGRAM [INPUT [OUTPUT]]'; input
+ * defaults to /dev/null and output to stdout. Returns the first failing
+ * job's status.
+ */
+int RunBatch(const std::string& filename, std::size_t thread_count,
+             zvm::TranslationCache* cache) {
+    using namespace zvm;
+
+    io::MappedFile list;
+    list.Open(filename);
+    const char* text = (const char*)list.Bytes();
+    const char* end = text + list.Size();
+
+    std::vector<HostJob> jobs;
+    std::vector<int> fds;
+    try {
+        while (text < end) {
+            const char* eol = std::find(text, end, '\n');
+            std::vector<std::string> fields;
+            while (text < eol) {
+                const char* field = text;
+                while (text < eol && *text != ' ' && *text != '\t')
+                    text++;
+                if (text > field)
+                    fields.emplace_back(field, text);
+                while (text < eol && (*text == ' ' || *text == '\t'))
+                    text++;
+            }
+            text = eol + 1;
+            if (fields.empty())
+                continue;
+
+            std::string input = fields.size() > 1 ? fields[1] : "/dev/null";
+            std::string output = fields.size() > 2 ? fields[2] : "-";
+            HostJob job = { fields[0], -1, -1, nullptr, nullptr };
+            job.input_fd = OpenJobFile(input, io::STDIN_FD, O_RDONLY);
+            fds.push_back(job.input_fd);
+            job.output_fd = OpenJobFile(output, io::STDOUT_FD,
+                                        O_WRONLY | O_CREAT | O_TRUNC);
+            fds.push_back(job.output_fd);
+            jobs.push_back(job);
+        }
+    } catch (...) {
+        for (int fd: fds) {
+            if (fd > io::STDOUT_FD)
+                close(fd);
+        }
+        throw;
+    }
+
+    Host host(thread_count, cache);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<JobResult> results = host.Run(jobs);
+    std::chrono::duration<double> total =
+        std::chrono::steady_clock::now() - start;
+    for (int fd: fds) {
+        if (fd > io::STDOUT_FD)
+            close(fd);
+    }
+
+    int status = ERR_OK;
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const JobResult& result = results[i];
+        if (result.status != ERR_OK) {
+            std::fprintf(stderr, "job %zu: %s: %s\n", i,
+                         jobs[i].program.c_str(), result.error.c_str());
+            if (status == ERR_OK)
+                status = result.status;
+            continue;
+        }
+        std::fprintf(stderr, "job %zu: %s: %s in %.3f ms, "
+                     "ran in %.3f ms, %llu values in, %llu out, "
+                     "%.0f values/s\n",
+                     i, jobs[i].program.c_str(),
+                     result.reused ? "reused" : "translated",
+                     result.translate_seconds * 1e3, result.run_seconds * 1e3,
+                     (unsigned long long)result.values_read,
+                     (unsigned long long)result.values_written,
+                     result.Throughput());
+    }
+
+    HostStats stats = host.Stats();
+    std::fprintf(stderr, "%zu jobs on %zu threads in %.3f s, %zu distinct "
+                 "programs, %zu jobs reused a translation, %zu bytes of "
+                 "code\n",
+                 stats.jobs, host.ThreadCount(), total.count(),
+                 stats.programs, stats.reused, stats.code.used);
+    return status;
+}
+
+/*!
+ * Reports on stderr where translating 'program' went: the 'load' phase
+ * reading the binary, then the phases of the translation.
+ */
+void PrintStats(const std::string& program, const zvm::PhaseStats& load,
+                const zvm::TranslationStats& stats) {
+    using namespace zvm;
+
+    std::fprintf(stderr, "%s: %zu instructions, %zu blocks, %zu functions, "
+                 "%zu bytes -> %zu bytes of x86 (%.2fx), %zu short jumps\n",
+                 program.c_str(), stats.instructions, stats.blocks,
+                 stats.functions, stats.zvm_bytes, stats.x86_bytes,
+                 stats.zvm_bytes ? double(stats.x86_bytes) / stats.zvm_bytes :
+                                   0.0,
+                 stats.short_jumps);
+
+    std::fprintf(stderr, "\n%-16s %10s %8s %10s %8s\n", "phase", "ms",
+                 "allocs", "bytes", "rewrites");
+    PhaseStats total = { "total", 0.0, { 0, 0 }, true, 0 };
+    auto print_phase = [&](const PhaseStats& phase) {
+        std::fprintf(stderr, "%-16s %10.3f %8llu %10llu ", phase.name,
+                     phase.seconds * 1e3,
+                     (unsigned long long)phase.allocs.count,
+                     (unsigned long long)phase.allocs.bytes);
+        if (phase.pass)
+            std::fprintf(stderr, "%8zu\n", phase.rewrites);
+        else
+            std::fprintf(stderr, "%8s\n", "-");
+    };
+    std::vector<PhaseStats> phases = stats.phases;
+    phases.insert(phases.begin(), load);
+    for (const auto& phase: phases) {
+        print_phase(phase);
+        total.seconds += phase.seconds;
+        total.allocs.count += phase.allocs.count;
+        total.allocs.bytes += phase.allocs.bytes;
+        total.rewrites += phase.rewrites;
+    }
+    print_phase(total);
+
+    std::fprintf(stderr, "\n%-8s %8s %10s %10s %8s\n", "opcode", "count",
+                 "zvm bytes", "x86 bytes", "x86/zvm");
+    for (const auto& entry: stats.opcodes) {
+        const OpcodeStats& opcode = entry.second;
+        std::fprintf(stderr, "%-8s %8zu %10zu %10zu %8.2f\n",
+                     OpcodeName(entry.first), opcode.count, opcode.zvm_bytes,
+                     opcode.x86_bytes,
+                     double(opcode.x86_bytes) / opcode.zvm_bytes);
+    }
 }
 
-static const char* FILE_EXTENSION = ".x86";
+/*!
+ * Writes the execution profile of 'bt' to 'filename', "-" is stderr.
+ */
+inline void WriteProfile(const zvm::BinTran& bt, const std::string& filename) {
+    if (filename == "-") {
+        bt.WriteProfile(stderr);
+        return;
+    }
+
+    std::FILE* f = std::fopen(filename.c_str(), "w");
+    if (!f)
+        throw zvm::IoException(filename, zvm::ERR_FILE_OPEN_FAILURE);
+    bt.WriteProfile(f);
+    std::fclose(f);
+}
 
 int main(int argc, char* argv[]) {
     using namespace zvm;
 
-    if (argc != 2) {
+    bool use_cache = true;
+    std::string cache_dir = TranslationCache::DefaultDirectory();
+    std::string dump_filename;
+    std::string raw_input_filename;
+    std::string raw_output_filename;
+    std::size_t thread_count = 0;
+    bool lazy = false;
+    bool stats = false;
+    std::string profile_filename;
+    std::string batch_filename;
+
+    int argi = 1;
+    for (; argi < argc; argi++) {
+        std::string opt = argv[argi];
+        if (opt == "--no-cache") {
+            use_cache = false;
+        } else if (opt == "--cache-dir" && argi + 2 < argc) {
+            cache_dir = argv[++argi];
+        } else if (opt == "--dump-x86" && argi + 2 < argc) {
+            dump_filename = argv[++argi];
+        } else if (opt == "--threads" && argi + 2 < argc) {
+            thread_count = std::strtoul(argv[++argi], nullptr, 10);
+        } else if (opt == "--raw-input" && argi + 2 < argc) {
+            raw_input_filename = argv[++argi];
+        } else if (opt == "--raw-output" && argi + 2 < argc) {
+            raw_output_filename = argv[++argi];
+        } else if (opt == "--lazy") {
+            lazy = true;
+        } else if (opt == "--stats") {
+            stats = true;
+        } else if (opt == "--profile" && argi + 2 < argc) {
+            profile_filename = argv[++argi];
+        } else if (opt == "--batch" && argi + 1 < argc) {
+            batch_filename = argv[++argi];
+        } else {
+            break;
+        }
+    }
+
+    bool batch = !batch_filename.empty();
+    bool profile = !profile_filename.empty();
+    if (argi + (batch ? 0 : 1) != argc || (batch && lazy) ||
+        ((stats || profile) && (batch || lazy))) {
         DisplayUsage();
         return ERR_WRONG_CMD_LINE_ARGS;
     }
+    use_cache = use_cache && !cache_dir.empty() && !lazy && !profile;
 
-    std::string filename = argv[1];
-    std::string x86_filename = argv[1] + std::string(FILE_EXTENSION);
-
+    const char* phase = "Translation";
     try {
+        if (batch) {
+            std::unique_ptr<TranslationCache> cache;
+            if (use_cache)
+                cache.reset(new TranslationCache(cache_dir));
+            return RunBatch(batch_filename, thread_count, cache.get());
+        }
+
         BinTran bt;
-        if (fs::exists(filename) && fs::exists(x86_filename) &&
-            fs::last_write_time(filename) <= fs::last_write_time(x86_filename)) {
-            bt.LoadX86CodeFromFile(x86_filename);
+        bt.SetThreadCount(thread_count);
+        bt.EnableStats(stats);
+        bt.EnableProfile(profile);
+        PhaseStats load = { "load", 0.0, GetAllocStats(), false, 0 };
+        auto start = std::chrono::steady_clock::now();
+        bt.LoadBinary(argv[argi]);
+        std::chrono::duration<double> load_time =
+            std::chrono::steady_clock::now() - start;
+        AllocStats allocs = GetAllocStats();
+        load.seconds = load_time.count();
+        load.allocs = { allocs.count - load.allocs.count,
+                        allocs.bytes - load.allocs.bytes };
+
+        if (lazy) {
+            bt.TranslateLazy();
+        } else if (use_cache) {
+            // statistics are of a translation, not of a cache hit
+            TranslationCache cache(cache_dir);
+            if (stats || !bt.LoadCached(cache)) {
+                bt.Translate();
+                bt.StoreCached(cache);
+            }
         } else {
-            bt.LoadBinary(filename);
             bt.Translate();
         }
-        bt.Execute();
-        bt.SaveX86CodeToFile(x86_filename);
+        if (stats)
+            PrintStats(argv[argi], load, bt.Stats());
+        if (!dump_filename.empty())
+            bt.SaveX86CodeToFile(dump_filename);
+        phase = "Runtime";
+
+        // raw values through mapped files, text on stdin/stdout otherwise
+        io::Reader reader;
+        io::Writer writer;
+        reader.Tie(&writer);
+        std::unique_ptr<io::InputChannel> input(new io::TextInput(reader));
+        std::unique_ptr<io::OutputChannel> output(new io::TextOutput(writer));
+        if (!raw_input_filename.empty())
+            input.reset(new io::MappedInput(raw_input_filename));
+        if (!raw_output_filename.empty())
+            output.reset(new io::MappedOutput(raw_output_filename));
+        // the profile is wanted most when the program fails
+        try {
+            bt.Execute(*input, *output);
+        } catch (...) {
+            if (profile)
+                WriteProfile(bt, profile_filename);
+            throw;
+        }
+        if (profile)
+            WriteProfile(bt, profile_filename);
     } catch (const IoException& ioerr) {
         std::fprintf(stderr, "IO error: %s\n", ioerr.what());
         return ioerr.GetErrorCode();
+    } catch (const ObjectFormatException& objerr) {
+        std::fprintf(stderr, "Object file error: %s\n", objerr.what());
+        return ERR_BAD_OBJECT_FILE;
     } catch (const AllocException& allocerr) {
         std::fprintf(stderr, "Allocation error: %s\n", allocerr.what());
         return ERR_FAILED_MEM_ALLOC;
+    } catch (const OutOfBoundsException& bnderr) {
+        std::fprintf(stderr, "%s error: %s\n", phase, bnderr.what());
+        return ERR_OUT_OF_BOUNDS;
+    } catch (const StackUnderflowException& stackerr) {
+        std::fprintf(stderr, "Runtime error: %s\n", stackerr.what());
+        return ERR_STACK_UNDERFLOW;
+    } catch (const StackOverflowException& stackerr) {
+        std::fprintf(stderr, "Runtime error: %s\n", stackerr.what());
+        return ERR_STACK_OVERFLOW;
     } catch (const UndefinedOpcodeException& opcerr) {
         std::fprintf(stderr, "Runtime error: %s\n", opcerr.what());
         return ERR_OUT_OF_BOUNDS;
+    } catch (const DivisionByZeroException& diverr) {
+        std::fprintf(stderr, "Runtime error: %s\n", diverr.what());
+        return ERR_OUT_OF_BOUNDS;
     }
 
     return ERR_OK;
@@ -0,0 +1,486 @@
+/*!
+ bintran_opt.cpp - optimization passes of the binary translator.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "bintran.hpp"
+#include "datatools.hpp"
+#include <climits>
+
+namespace zvm {
+
+/*!
+ * Abstract value of a ZVM stack slot for constant propagation.
+ */
+struct ConstSlot {
+    bool known;
+    Data value;
+    std::size_t producer;  // instruction to delete when the value is folded
+};
+
+/*!
+ * Constant state of the ZVM stack. An absolute state describes all slots
+ * from the bottom of the stack, so LOAD/STORE can be tracked; a relative
+ * one only describes values pushed on top of an unknown part.
+ */
+struct ConstState {
+    bool visited;
+    bool absolute;
+    std::vector<ConstSlot> slots;
+};
+
+static const ConstSlot UNKNOWN_SLOT = { false, 0, NO_INDEX };
+
+inline ConstSlot PopSlot(ConstState& state) {
+    if (state.slots.empty()) {
+        state.absolute = false;
+        return UNKNOWN_SLOT;
+    }
+
+    ConstSlot slot = state.slots.back();
+    state.slots.pop_back();
+    return slot;
+}
+
+/*!
+ * Merges 'src' into a block entry state. Returns true if 'dst' changed.
+ */
+inline bool MergeState(ConstState& dst, const ConstState& src) {
+    if (!dst.visited) {
+        dst.visited = true;
+        dst.absolute = src.absolute;
+        dst.slots.clear();
+        if (src.absolute) {
+            for (const auto& slot: src.slots)
+                dst.slots.push_back({ slot.known, slot.value, NO_INDEX });
+        }
+        return true;
+    }
+
+    if (!dst.absolute)
+        return false;
+
+    if (!src.absolute || src.slots.size() != dst.slots.size()) {
+        dst.absolute = false;
+        dst.slots.clear();
+        return true;
+    }
+
+    bool changed = false;
+    for (std::size_t i = 0; i < dst.slots.size(); i++) {
+        ConstSlot& slot = dst.slots[i];
+        if (slot.known && (!src.slots[i].known ||
+                           src.slots[i].value != slot.value)) {
+            slot.known = false;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+inline bool EvalBinary(Opcode opcode, Data a, Data b, Data& result) {
+    std::uint32_t ua = a, ub = b;
+    switch (opcode) {
+        case OPCODE_ADD:
+            result = Data(ua + ub);
+            return true;
+        case OPCODE_SUB:
+            result = Data(ua - ub);
+            return true;
+        case OPCODE_MUL:
+            result = Data(ua * ub);
+            return true;
+        case OPCODE_DIV:
+            // leave runtime errors to runtime
+            if (b == 0 || (a == INT32_MIN && b == -1))
+                return false;
+            result = a / b;
+            return true;
+        default:
+            return false;
+    }
+}
+
+inline Data EvalCompare(Opcode opcode, Data a) {
+    switch (opcode) {
+        case OPCODE_GZ: return a > 0;
+        case OPCODE_BZ: return a < 0;
+        case OPCODE_GEZ: return a >= 0;
+        case OPCODE_BEZ: return a <= 0;
+        case OPCODE_EQZ: return a == 0;
+        default: return a != 0;
+    }
+}
+
+/*!
+ * A constant can be folded into its consumer if the instruction that
+ * pushed it can be deleted. Deleting it moves every value pushed after it
+ * one slot down, so no LOAD or STORE may be left in between.
+ */
+inline bool Removable(const std::vector<BtInstr>& program,
+                      const ConstSlot& slot, std::size_t consumer) {
+    if (!slot.known || slot.producer == NO_INDEX)
+        return false;
+
+    for (std::size_t i = slot.producer + 1; i < consumer; i++) {
+        const BtInstr& instr = program[i];
+        if (!instr.removed && (instr.opcode == OPCODE_LOAD ||
+                               instr.opcode == OPCODE_STORE))
+            return false;
+    }
+    return true;
+}
+
+inline void MakePush(BtInstr& instr, Data value) {
+    instr.opcode = OPCODE_PUSH;
+    instr.arg = value;
+    instr.op1_loc = DATALOC_IMM;
+    instr.op2_loc = DATALOC_NONE;
+    instr.res_loc = DATALOC_STACK;
+}
+
+/*!
+ * Interprets a block over constant states, starting from 'state'. With
+ * 'rewrite' set the block is folded along the way. Returns the state at
+ * the end of the block; 'branch' is set to 0/1 if the block ends with a
+ * JMC whose condition is known, -1 otherwise. With 'tier' set, values on
+ * the stack at a tier exit stay there for the interpreter.
+ */
+inline ConstState InterpretBlock(std::vector<BtInstr>& program,
+                                 const BasicBlock& block, ConstState state,
+                                 bool rewrite, bool tier, int& branch) {
+    branch = -1;
+
+    for (std::size_t i = block.first; i < block.last; i++) {
+        BtInstr& instr = program[i];
+        if (instr.removed)
+            continue;
+
+        if (tier && instr.IsTierExit()) {
+            for (auto& slot: state.slots)
+                slot.producer = NO_INDEX;
+        }
+
+        ConstSlot a = UNKNOWN_SLOT, b = UNKNOWN_SLOT;
+        Data result = 0;
+
+        switch (instr.opcode) {
+            case OPCODE_PUSH:
+                state.slots.push_back({ true, instr.arg, i });
+                break;
+            case OPCODE_POP:
+                a = PopSlot(state);
+                if (rewrite && Removable(program, a, i)) {
+                    program[a.producer].removed = true;
+                    instr.removed = true;
+                }
+                break;
+            case OPCODE_LOAD:
+                if (state.absolute && instr.arg >= 0 &&
+                    std::size_t(instr.arg) < state.slots.size() &&
+                    state.slots[instr.arg].known) {
+                    result = state.slots[instr.arg].value;
+                    if (rewrite)
+                        MakePush(instr, result);
+                    state.slots.push_back({ true, result, i });
+                } else {
+                    state.slots.push_back(UNKNOWN_SLOT);
+                }
+                break;
+            case OPCODE_STORE:
+                a = PopSlot(state);
+                if (state.absolute) {
+                    if (instr.arg >= 0 &&
+                        std::size_t(instr.arg) < state.slots.size())
+                        state.slots[instr.arg] = { a.known, a.value, NO_INDEX };
+                } else {
+                    for (auto& slot: state.slots)
+                        slot = UNKNOWN_SLOT;
+                }
+                if (rewrite && Removable(program, a, i)) {
+                    program[a.producer].removed = true;
+                    instr.op1_loc = DATALOC_IMM;
+                    instr.imm = a.value;
+                }
+                break;
+            case OPCODE_INPUT:
+                state.slots.push_back(UNKNOWN_SLOT);
+                break;
+            case OPCODE_OUTPUT:
+                a = PopSlot(state);
+                if (rewrite && Removable(program, a, i)) {
+                    program[a.producer].removed = true;
+                    instr.op1_loc = DATALOC_IMM;
+                    instr.imm = a.value;
+                }
+                break;
+            case OPCODE_ADD:
+            case OPCODE_SUB:
+            case OPCODE_MUL:
+            case OPCODE_DIV: {
+                b = PopSlot(state);
+                a = PopSlot(state);
+                bool known = a.known && b.known &&
+                             EvalBinary(instr.opcode, a.value, b.value, result);
+                bool fold_a = rewrite && Removable(program, a, i);
+                bool fold_b = rewrite && Removable(program, b, i);
+
+                if (known && fold_a && fold_b) {
+                    program[a.producer].removed = true;
+                    program[b.producer].removed = true;
+                    MakePush(instr, result);
+                    state.slots.push_back({ true, result, i });
+                    break;
+                }
+
+                if (fold_b && instr.opcode != OPCODE_DIV) {
+                    program[b.producer].removed = true;
+                    instr.op2_loc = DATALOC_IMM;
+                    instr.imm = b.value;
+                } else if (fold_a && instr.opcode != OPCODE_DIV) {
+                    program[a.producer].removed = true;
+                    instr.op1_loc = DATALOC_IMM;
+                    instr.imm = a.value;
+                }
+                state.slots.push_back({ known, result, NO_INDEX });
+                break;
+            }
+            case OPCODE_GZ:
+            case OPCODE_BZ:
+            case OPCODE_GEZ:
+            case OPCODE_BEZ:
+            case OPCODE_EQZ:
+            case OPCODE_NEQZ:
+                a = PopSlot(state);
+                result = EvalCompare(instr.opcode, a.value);
+                if (rewrite && Removable(program, a, i)) {
+                    program[a.producer].removed = true;
+                    MakePush(instr, result);
+                    state.slots.push_back({ true, result, i });
+                } else {
+                    state.slots.push_back({ a.known, result, NO_INDEX });
+                }
+                break;
+            case OPCODE_JMC:
+                a = PopSlot(state);
+                if (!a.known)
+                    break;
+
+                branch = a.value != 0;
+                if (!rewrite)
+                    break;
+
+                if (Removable(program, a, i)) {
+                    program[a.producer].removed = true;
+                    if (branch) {
+                        instr.opcode = OPCODE_JMP;
+                        instr.op1_loc = DATALOC_NONE;
+                    } else {
+                        instr.removed = true;
+                    }
+                } else {
+                    // the condition stays on the stack, pop it anyway
+                    instr.opcode = branch ? OPCODE_JMP : OPCODE_POP;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    return state;
+}
+
+/*!
+ * Constant folding and propagation.
+ *
+ * First a forward dataflow over the CFG finds which stack slots hold known
+ * constants at every block entry; JMCs with a known condition only
+ * propagate along the edge they take. Then every reachable block is
+ * interpreted once more and rewritten: operations on constants pushed in
+ * the same block become a single PUSH, single constant operands become
+ * DATALOC_IMM operands of their consumer, LOADs of known slots become
+ * PUSHes and JMCs with a known condition become JMP, POP or disappear.
+ * Works on one function at a time: blocks entered from outside it start
+ * with nothing known. Block entry heights must be computed before this
+ * pass. For 'tier' code, instructions left to the interpreter are
+ * barriers: nothing pushed before one is folded into an instruction after
+ * it.
+ */
+void BinTran::FoldConstants(const Function& function, bool tier) {
+    const std::size_t first = function.first_block;
+    const std::size_t last = function.last_block;
+    std::vector<ConstState> entry(last - first, { false, false, {} });
+    std::vector<std::size_t> worklist;
+
+    // nothing is known where control comes from outside the function
+    const ConstState unknown = { true, false, {} };
+    for (std::size_t b = first; b < last; b++) {
+        ConstState& state = entry[b - first];
+        if (b == 0) {
+            state = { true, true, {} };
+            for (std::size_t i = 0; i < object_->DataSize(); i++)
+                state.slots.push_back({ true, object_->InitialData()[i],
+                                        NO_INDEX });
+            worklist.push_back(b);
+        }
+
+        bool outside = b == first && b != 0;
+        for (std::size_t pred: blocks_[b].preds)
+            outside = outside || pred < first || pred >= last;
+        if (outside && MergeState(state, unknown) && b != 0)
+            worklist.push_back(b);
+    }
+
+    while (!worklist.empty()) {
+        std::size_t b = worklist.back();
+        worklist.pop_back();
+
+        int branch = -1;
+        ConstState exit = InterpretBlock(program_, blocks_[b], entry[b - first],
+                                         false, tier, branch);
+
+        const BtInstr& tail = program_[blocks_[b].last - 1];
+        for (std::size_t succ: blocks_[b].succs) {
+            if (succ < first || succ >= last)
+                continue;
+
+            bool jump_edge = tail.IsJump() && succ == program_[tail.target].block;
+            bool fall_edge = succ == b + 1;
+
+            if (branch >= 0 && !(branch ? jump_edge : fall_edge))
+                continue;
+
+            bool return_point = tail.opcode == OPCODE_CALL && fall_edge;
+            if (return_point || blocks_[succ].entry_height < 0) {
+                if (MergeState(entry[succ - first], unknown))
+                    worklist.push_back(succ);
+            } else if (MergeState(entry[succ - first], exit)) {
+                worklist.push_back(succ);
+            }
+        }
+    }
+
+    for (std::size_t b = first; b < last; b++) {
+        if (!entry[b - first].visited)
+            continue;
+
+        int branch = -1;
+        InterpretBlock(program_, blocks_[b], entry[b - first], true, tier,
+                       branch);
+    }
+}
+
+/*!
+ * Fuses a comparison with the JMC that consumes its result, so the branch
+ * tests the compared value directly instead of a materialized 0/1. Runs
+ * after constant folding: FoldConstants only understands plain JMCs.
+ */
+void BinTran::FuseCompareBranch(const Function& function) {
+    for (std::size_t b = function.first_block; b < function.last_block; b++) {
+        const BasicBlock& block = blocks_[b];
+        std::size_t cmp = NO_INDEX;
+        for (std::size_t i = block.first; i < block.last; i++) {
+            BtInstr& instr = program_[i];
+            if (instr.removed)
+                continue;
+
+            if (instr.opcode == OPCODE_JMC && instr.cond == OPCODE_NEQZ &&
+                cmp != NO_INDEX) {
+                instr.cond = program_[cmp].opcode;
+                program_[cmp].removed = true;
+            }
+            cmp = instr.IsCompare() ? i : NO_INDEX;
+        }
+    }
+}
+
+/*!
+ * Drops PUSHBP/POPBP pairs within a block. Nothing in between can change
+ * bp, so the pair saves and restores the value r15 holds anyway; the
+ * PUSHBP is kept as a probe so a full bp stack still overflows. Frames of
+ * leaf functions without branches vanish this way.
+ */
+void BinTran::ElideFrames(const Function& function) {
+    for (std::size_t b = function.first_block; b < function.last_block; b++) {
+        const BasicBlock& block = blocks_[b];
+        std::size_t push = NO_INDEX;
+        for (std::size_t i = block.first; i < block.last; i++) {
+            BtInstr& instr = program_[i];
+            if (instr.removed)
+                continue;
+
+            if (instr.opcode == OPCODE_PUSHBP) {
+                push = i;
+            } else if (instr.opcode == OPCODE_POPBP && push != NO_INDEX) {
+                program_[push].probe = true;
+                instr.removed = true;
+                push = NO_INDEX;
+            }
+        }
+    }
+}
+
+/*!
+ * Call target of the function starting with block 'b', inlinable if the
+ * block is all of it: it ends with RET and nothing else in it jumps. The
+ * program entry is never inlined, it is the only function entered with
+ * known constants (see FoldConstants); any other body is folded without
+ * assumptions about its caller and fits every call site.
+ */
+CallTarget BinTran::LeafCallTarget(std::size_t b) const {
+    CallTarget target = { b, false, {} };
+    const BasicBlock& block = blocks_[b];
+    const BtInstr& tail = program_[block.last - 1];
+    if (b == 0 || tail.removed || tail.opcode != OPCODE_RET)
+        return target;
+
+    for (std::size_t i = block.first; i + 1 < block.last; i++) {
+        const BtInstr& instr = program_[i];
+        if (instr.removed)
+            continue;
+        if (instr.IsJump() || instr.opcode == OPCODE_RET ||
+            instr.opcode == OPCODE_HALT ||
+            target.body.size() == MAX_INLINE_SIZE)
+            return { b, false, {} };
+        target.body.push_back(instr);
+    }
+    target.inlinable = true;
+    return target;
+}
+
+/*!
+ * Builds the table of CALL targets and marks the CALLs of small leaf
+ * functions for inlining. Runs after the other passes, as the recorded
+ * bodies must be final, and before code generation assigns registers to
+ * the instructions.
+ */
+void BinTran::InlineCalls() {
+    call_targets_.clear();
+    for (auto& instr: program_) {
+        if (instr.removed || instr.opcode != OPCODE_CALL)
+            continue;
+
+        const BtInstr& dest = program_[instr.target];
+        auto found = call_targets_.find(dest.zvm_addr);
+        if (found == call_targets_.end()) {
+            found = call_targets_.emplace(dest.zvm_addr,
+                                          LeafCallTarget(dest.block)).first;
+        }
+        instr.inlined = found->second.inlinable;
+    }
+}
+
+}  // namespace zvm
@@ -15,33 +15,182 @@
  */
 
 #include "bintran.hpp"
+#include "x86arch.hpp"
+#include "x86encoder.hpp"
+#include "sandbox.hpp"
 #include "exceptions.hpp"
 #include "datatools.hpp"
-#include <cstring>
+#include <cstddef>
 
 namespace zvm {
 
-#define EMIT_CODE() { std::memcpy(ptr, code, sizeof(code)); ptr += sizeof(code); }
-#define EMIT_DATA() { EmitAndShiftBuf(ptr, instr.arg); }
+/*!
+ * Registers RegisterStack may allocate, in order of preference.
+ */
+static const DataLocation REGISTER_POOL[] = {
+    DATALOC_RCX, DATALOC_RSI, DATALOC_RDI, DATALOC_R8,
+    DATALOC_R9, DATALOC_R10, DATALOC_R11, DATALOC_RBX
+};
+
+X86Register LocationRegister(DataLocation loc) {
+    switch (loc) {
+        case DATALOC_RAX: return X86_RAX;
+        case DATALOC_RBX: return X86_RBX;
+        case DATALOC_RCX: return X86_RCX;
+        case DATALOC_RDX: return X86_RDX;
+        case DATALOC_RSI: return X86_RSI;
+        case DATALOC_RDI: return X86_RDI;
+        case DATALOC_R8: return X86_R8;
+        case DATALOC_R9: return X86_R9;
+        case DATALOC_R10: return X86_R10;
+        case DATALOC_R11: return X86_R11;
+        case DATALOC_R14: return X86_R14;
+        default: throw std::logic_error("data location is not a register");
+    }
+}
+
+/*!
+ * ZVM stack slot 'index' in memory. WriteSlotCheck keeps 'index' within
+ * the capacity of the stack, where the displacement fits.
+ */
+constexpr X86Mem SlotMem(Data index) {
+    return Mem(X86_R15, std::int32_t(-8 * std::int64_t(index)));
+}
+
+// RegisterStack
+
+RegisterStack::RegisterStack(): busy_(0), height_(-1) {}
+
+void RegisterStack::Reset(int height) {
+    cached_.clear();
+    popped_.clear();
+    busy_ = 0;
+    height_ = height;
+}
+
+DataLocation RegisterStack::AllocRegister(Byte*& ptr, DataLocation hint) {
+    if (hint != DATALOC_NONE && !(busy_ & (1u << LocationRegister(hint))))
+        return hint;
+
+    for (DataLocation loc: REGISTER_POOL) {
+        if (!(busy_ & (1u << LocationRegister(loc))))
+            return loc;
+    }
+
+    // spill the bottom-most cached value
+    DataLocation spilled = cached_.front();
+    cached_.erase(cached_.begin());
+    EmitPush(ptr, LocationRegister(spilled));
+    busy_ &= ~(1u << LocationRegister(spilled));
+    return spilled;
+}
+
+DataLocation RegisterStack::Push(Byte*& ptr, DataLocation hint) {
+    for (DataLocation loc: popped_) {
+        if (loc == hint)
+            busy_ &= ~(1u << LocationRegister(loc));
+    }
+
+    DataLocation loc = AllocRegister(ptr, hint);
+    busy_ |= 1u << LocationRegister(loc);
+    cached_.push_back(loc);
+    if (height_ >= 0)
+        height_++;
+    return loc;
+}
+
+DataLocation RegisterStack::Pop(Byte*& ptr) {
+    DataLocation loc = DATALOC_NONE;
+    if (!cached_.empty()) {
+        loc = cached_.back();
+        cached_.pop_back();
+    } else {
+        loc = AllocRegister(ptr, DATALOC_NONE);
+        busy_ |= 1u << LocationRegister(loc);
+        EmitPop(ptr, LocationRegister(loc));
+    }
+
+    popped_.push_back(loc);
+    if (height_ > 0)
+        height_--;
+    return loc;
+}
+
+void RegisterStack::EndInstr() {
+    for (DataLocation loc: popped_) {
+        bool cached = false;
+        for (DataLocation c: cached_)
+            cached = cached || c == loc;
+        if (!cached)
+            busy_ &= ~(1u << LocationRegister(loc));
+    }
+    popped_.clear();
+}
+
+void RegisterStack::Flush(Byte*& ptr) {
+    for (DataLocation loc: cached_) {
+        EmitPush(ptr, LocationRegister(loc));
+        busy_ &= ~(1u << LocationRegister(loc));
+    }
+    cached_.clear();
+}
+
+DataLocation RegisterStack::SlotLocation(Data index) const {
+    if (height_ < 0)
+        return DATALOC_NONE;
+
+    int memory_height = height_ - int(cached_.size());
+    if (index < memory_height)
+        return DATALOC_STACK;
+    if (index < height_)
+        return cached_[index - memory_height];
+    return DATALOC_STACK;
+}
+
+// code generation
+
+#define REG(loc) LocationRegister(loc)
+
+/*!
+ * Registers translated code keeps for the host, pushed by the entry code
+ * in this order.
+ */
+static const X86Register SAVED_REGISTERS[] = {
+    X86_RBX, X86_RBP, X86_R12, X86_R13, X86_R14, X86_R15
+};
+
+inline void EmitSaveRegisters(Byte*& ptr) {
+    for (X86Register reg: SAVED_REGISTERS)
+        EmitPush(ptr, reg);
+}
+
+inline void EmitRestoreRegisters(Byte*& ptr) {
+    for (std::size_t i = sizeof(SAVED_REGISTERS) / sizeof(*SAVED_REGISTERS);
+         i > 0; i--)
+        EmitPop(ptr, SAVED_REGISTERS[i - 1]);
+}
 
 void BinTran::WriteCodeHeader(Byte*& ptr) {
-    Byte code[] = {
-        0x49, 0x89, 0xE2,        // mov r10, rsp
-        0x49, 0x83, 0xEA, 0x08,  // sub r10, 8
-        0x49, 0x89, 0xFB,        // mov r11, rdi (input func)
-        0x49, 0x89, 0xF4,        // mov r12, rsi (output func)
-        0x49, 0x89, 0xE5         // mov r13, rsp
-    };
+    EmitSaveRegisters(ptr);
+    EmitMov(ptr, X86_QWORD, X86_R13, X86_RSP);
+    EmitMov(ptr, X86_QWORD, X86_R15, X86_RSI);     // slot 0
+    EmitLea(ptr, X86_RSP, Mem(X86_RSI, 8));
+    EmitMov(ptr, X86_QWORD, X86_R14, X86_RDI);     // io::Runtime*
+    EmitMov(ptr, X86_QWORD, X86_R12, X86_RDX);     // return address stack
+    EmitMov(ptr, X86_QWORD, X86_RBP, X86_RCX);     // bp stack
+}
 
-    EMIT_CODE();
+/*!
+ * Pushes an initial data stack value; runs right after the header.
+ */
+void BinTran::WriteInitialData(Byte*& ptr, Data value) {
+    EmitPushImm(ptr, value);
 }
 
 inline void WriteHalt(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x4C, 0x89, 0xEC, // mov rsp, r13
-        0xC3              // ret
-    };
-    EMIT_CODE();
+    EmitMov(ptr, X86_QWORD, X86_RSP, X86_R13);
+    EmitRestoreRegisters(ptr);
+    EmitRet(ptr);
 }
 
 void BinTran::WriteCodeFooter(Byte*& ptr) {
@@ -49,300 +198,497 @@ void BinTran::WriteCodeFooter(Byte*& ptr) {
     WriteHalt(ptr, instr);
 }
 
-inline void WritePush(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x68  // push IMM
-    };
+static_assert(offsetof(TierFrame, base) == 0 &&
+              offsetof(TierFrame, sp) == 8 &&
+              offsetof(TierFrame, calls) == 16 &&
+              offsetof(TierFrame, bps) == 24 &&
+              offsetof(TierFrame, pc) == 32,
+              "tier code relies on the TierFrame layout");
 
-    EMIT_CODE();
-    EMIT_DATA();
+/*!
+ * Entry of tier code (rdi: runtime, rsi: frame, rdx: block). Saves the
+ * host registers and the frame on the host stack, then switches to the
+ * ZVM stacks described by the frame and jumps to the block.
+ */
+void BinTran::WriteTierPrologue(Byte*& ptr) {
+    EmitSaveRegisters(ptr);
+    EmitPush(ptr, X86_RSI);
+    EmitMov(ptr, X86_QWORD, X86_R13, X86_RSP);
+    EmitMov(ptr, X86_QWORD, X86_R14, X86_RDI);     // io::Runtime*
+    EmitLoad(ptr, X86_QWORD, X86_R15, Mem(X86_RSI, offsetof(TierFrame, base)));
+    EmitLoad(ptr, X86_QWORD, X86_RSP, Mem(X86_RSI, offsetof(TierFrame, sp)));
+    EmitLoad(ptr, X86_QWORD, X86_R12,
+             Mem(X86_RSI, offsetof(TierFrame, calls)));
+    EmitLoad(ptr, X86_QWORD, X86_RBP, Mem(X86_RSI, offsetof(TierFrame, bps)));
+    EmitJmpReg(ptr, X86_RDX);
 }
 
-inline void WriteLoad(Byte*& ptr, const BtInstr& instr) {
-    {
-        Byte code[] = {
-            0x48, 0x31, 0xC0, // xor rax, rax
-            0x41, 0x8B, 0x82  // mov [r10+IMM]
-        };
-
-        EMIT_CODE();
-    }
-    EmitAndShiftBuf(ptr, -8 * instr.arg);
-    {
-        Byte code[] = {
-            0x50 // push rax
-        };
-
-        EMIT_CODE();
-    }
+/*!
+ * Leaves tier code, continuing at 'zvm_addr' in the interpreter. The
+ * jump to the epilogue is patched by EmitFunction; the ZVM stack must be
+ * flushed to memory.
+ */
+void BinTran::WriteTierExit(Byte*& ptr, std::size_t zvm_addr) {
+    EmitMovImm(ptr, X86_RAX, Data(zvm_addr));
+    EmitJmp32(ptr);
 }
 
-inline void WriteStore(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58,             // pop rax
-        0x49, 0x89, 0x82  // mov [r10+IMM]
-    };
+/*!
+ * Jumps to the tier code of the block at 'zvm_addr' if it's translated by
+ * now, otherwise exits as WriteTierExit does.
+ */
+void BinTran::WriteTierLink(Byte*& ptr, std::size_t zvm_addr) {
+    EmitMovImm64(ptr, X86_RDX, std::uint64_t(&tier_entries_[zvm_addr]));
+    EmitLoad(ptr, X86_QWORD, X86_RDX, Mem(X86_RDX));
+    EmitTest(ptr, X86_QWORD, X86_RDX, X86_RDX);
+    Byte* absent = EmitJcc8(ptr, X86_CC_E);
+    EmitJmpReg(ptr, X86_RDX);
+    PatchRel8(absent, ptr);
+    WriteTierExit(ptr, zvm_addr);
+}
 
-    EMIT_CODE();
-    EmitAndShiftBuf(ptr, -8 * instr.arg);
+/*!
+ * CALL in tier code pushes the ZVM return address 'ret_addr', which the
+ * interpreter can return to as well. The jump is patched by EmitFunction.
+ */
+void BinTran::WriteTierCall(Byte*& ptr, Register ret_addr,
+                            RegisterStack& rs) {
+    rs.Flush(ptr);
+    EmitAluImm(ptr, X86_SUB, X86_QWORD, X86_R12, 8);
+    EmitStoreImm(ptr, Mem(X86_R12), Data(ret_addr));
+    EmitJmp32(ptr);
 }
 
-inline void WritePop(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58  // pop rax
-    };
+/*!
+ * RET in tier code: a WriteTierLink to the popped ZVM address. The jump
+ * to the epilogue is patched by EmitFunction.
+ */
+void BinTran::WriteTierRet(Byte*& ptr, RegisterStack& rs) {
+    rs.Flush(ptr);
+    EmitLoad(ptr, X86_DWORD, X86_RAX, Mem(X86_R12));
+    EmitAluImm(ptr, X86_ADD, X86_QWORD, X86_R12, 8);
+    EmitMovImm64(ptr, X86_RDX, std::uint64_t(tier_entries_.data()));
+    EmitLoadIndexed(ptr, X86_RDX, X86_RDX, X86_RAX);
+    EmitTest(ptr, X86_QWORD, X86_RDX, X86_RDX);
+    Byte* absent = EmitJcc8(ptr, X86_CC_E);
+    EmitJmpReg(ptr, X86_RDX);
+    PatchRel8(absent, ptr);
+    EmitJmp32(ptr);
+}
 
-    EMIT_CODE();
+/*!
+ * Stores the ZVM registers and the exit address (eax) into the frame and
+ * returns to the host.
+ */
+void BinTran::WriteTierEpilogue(Byte*& ptr) {
+    EmitLoad(ptr, X86_QWORD, X86_RDX, Mem(X86_R13));  // frame
+    EmitStore(ptr, X86_QWORD, Mem(X86_RDX, offsetof(TierFrame, base)),
+              X86_R15);
+    EmitStore(ptr, X86_QWORD, Mem(X86_RDX, offsetof(TierFrame, sp)), X86_RSP);
+    EmitStore(ptr, X86_QWORD, Mem(X86_RDX, offsetof(TierFrame, calls)),
+              X86_R12);
+    EmitStore(ptr, X86_QWORD, Mem(X86_RDX, offsetof(TierFrame, bps)),
+              X86_RBP);
+    EmitStore(ptr, X86_DWORD, Mem(X86_RDX, offsetof(TierFrame, pc)), X86_RAX);
+    EmitMov(ptr, X86_QWORD, X86_RSP, X86_R13);
+    EmitPop(ptr, X86_RSI);
+    EmitRestoreRegisters(ptr);
+    EmitRet(ptr);
 }
 
-inline void LoadOperands(Byte*& ptr, const BtInstr& instr) {
-    if (instr.op2_loc == DATALOC_STACK) {
-        Byte code[] = {
-            0x41, 0x58        // pop r8
-        };
-        EMIT_CODE();
-    }
-    else if (instr.op2_loc == DATALOC_R9) {
-        Byte code[] = {
-            0x4D, 0x89, 0xC8  // mov rax, r9
-        };
-        EMIT_CODE();
-    }
-    else if (instr.op2_loc == DATALOC_R14) {
-        Byte code[] = {
-            0x4D, 0x89, 0xF0  // mov rax, r14
-        };
-        EMIT_CODE();
-    }
+/*!
+ * A field of the io::Runtime in r14.
+ */
+inline X86Mem RuntimeField(std::size_t field) {
+    return Mem(X86_R14, std::int32_t(field));
+}
 
-    if (instr.op1_loc == DATALOC_STACK) {
-        Byte code[] = {
-            0x58  // pop rax
-        };
-        EMIT_CODE();
-    }
-    else if (instr.op1_loc == DATALOC_R9) {
-        Byte code[] = {
-            0x4C, 0x89, 0xC8  // mov rax, r9
-        };
-        EMIT_CODE();
-    }
-    else if (instr.op1_loc == DATALOC_R14) {
-        Byte code[] = {
-            0x4C, 0x89, 0xF0  // mov rax, r9
-        };
-        EMIT_CODE();
-    }
+/*!
+ * Calls a host function on the host stack, 16-byte aligned. The ZVM stack
+ * is bounded by guard pages and has no room for host frames; its rsp is
+ * kept on the host stack, twice to preserve the alignment.
+ */
+inline void WriteHostCall(Byte*& ptr, X86Register func) {
+    EmitMov(ptr, X86_QWORD, X86_RDX, X86_RSP);
+    EmitMov(ptr, X86_QWORD, X86_RSP, X86_R13);
+    EmitAluImm(ptr, X86_AND, X86_QWORD, X86_RSP, -16);
+    EmitPush(ptr, X86_RDX);
+    EmitPush(ptr, X86_RDX);
+    EmitCallReg(ptr, func);
+    EmitPop(ptr, X86_RSP);
 }
 
-inline void WriteResult(Byte*& ptr, const BtInstr& instr) {
-    if (instr.res_loc == DATALOC_STACK) {
-        Byte code[] = {
-            0x50  // push rax
-        };
-        EMIT_CODE();
-    }
-    else if (instr.res_loc == DATALOC_R9) {
-        Byte code[] = {
-            0x49, 0x89, 0xC1
-        };
-        EMIT_CODE();
-    }
-    else if (instr.res_loc == DATALOC_R14) {
-        Byte code[] = {
-            0x49, 0x89, 0xC6
-        };
-        EMIT_CODE();
-    }
+/*!
+ * Shared tail of the lazy stubs (esi: block). Has the block translated by
+ * ResolveLazy and jumps to it. Blocks start and end with the ZVM stack in
+ * memory, so the host call only has to keep rsp and the fixed registers.
+ */
+void BinTran::WriteLazyResolver(Byte*& ptr) {
+    const Byte* (*resolve)(BinTran*, std::size_t) = &ResolveLazy;
+    EmitMovImm64(ptr, X86_RDI, std::uint64_t(this));
+    EmitMovImm64(ptr, X86_RAX, std::uint64_t(resolve));
+    WriteHostCall(ptr, X86_RAX);
+    EmitJmpReg(ptr, X86_RAX);
 }
 
-inline void WriteAdd(Byte*& ptr, const BtInstr& instr) {
-    LoadOperands(ptr, instr);
+/*!
+ * Stands in for block 'b' until it is translated.
+ */
+void BinTran::WriteLazyStub(Byte*& ptr, std::size_t b) {
+    EmitMovImm(ptr, X86_RSI, Data(b));
+    EmitJmp32(ptr);
+    PatchRel32(ptr, code_ + lazy_resolver_);
+}
 
-    Byte code[] = {
-        0x4C, 0x01, 0xC0,  // add rax, r8
-    };
-    EMIT_CODE();
+/*!
+ * Jump to the block following in ZVM order, patched by the caller.
+ */
+void BinTran::WriteFallThrough(Byte*& ptr) {
+    EmitJmp32(ptr);
+}
 
-    WriteResult(ptr, instr);
+/*!
+ * Increments profile counter 'counter' of io::Runtime::counters. Only
+ * placed between instructions, where rax and the flags are free.
+ */
+void BinTran::WriteProfileCount(Byte*& ptr, std::size_t counter) {
+    EmitLoad(ptr, X86_QWORD, X86_RAX,
+             RuntimeField(offsetof(io::Runtime, counters)));
+    EmitIncMem(ptr, X86_QWORD,
+               Mem(X86_RAX, std::int32_t(counter * sizeof(std::uint64_t))));
 }
 
-inline void WriteSub(Byte*& ptr, const BtInstr& instr) {
-    LoadOperands(ptr, instr);
+/*!
+ * Aborts the program with 'fault' through io::Runtime::fault.
+ */
+inline void WriteFault(Byte*& ptr, NativeFault fault) {
+    EmitMov(ptr, X86_QWORD, X86_RDI, X86_R14);
+    EmitMovImm(ptr, X86_RSI, fault);
+    EmitLoad(ptr, X86_QWORD, X86_RAX,
+             RuntimeField(offsetof(io::Runtime, fault)));
+    WriteHostCall(ptr, X86_RAX);
+}
 
-    Byte code[] = {
-        0x4C, 0x29, 0xC0,  // sub rax, r8
-    };
-    EMIT_CODE();
+/*!
+ * Makes sure slot 'index' is on the stack before it is accessed. With the
+ * height known, or the slot past the 'capacity' of the stack, that is
+ * decided here. Otherwise the slot's address is compared with rsp, which
+ * needs the stack flushed to memory. Returns false if the access always
+ * faults.
+ */
+inline bool WriteSlotCheck(Byte*& ptr, Data index, const RegisterStack& rs,
+                           std::size_t capacity) {
+    int height = rs.Height();
+    if (index >= 0 && index < height)
+        return true;
+    if (index < 0 || height >= 0 || std::size_t(index) >= capacity) {
+        WriteFault(ptr, FAULT_OUT_OF_BOUNDS);
+        return false;
+    }
 
-    WriteResult(ptr, instr);
+    EmitLea(ptr, X86_RAX, SlotMem(index));
+    EmitAlu(ptr, X86_CMP, X86_QWORD, X86_RAX, X86_RSP);
+    Byte* ok_jump = EmitJcc8(ptr, X86_CC_AE);
+    WriteFault(ptr, FAULT_OUT_OF_BOUNDS);
+    PatchRel8(ok_jump, ptr);
+    return true;
 }
 
-inline void WriteMul(Byte*& ptr, const BtInstr& instr) {
-    LoadOperands(ptr, instr);
+inline void WritePush(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    instr.res_loc = rs.Push(ptr);
+    EmitMovImm(ptr, REG(instr.res_loc), instr.arg);
+}
 
-    Byte code[] = {
-        0x49, 0x0F, 0xAF, 0xC0  // imul rax, r8
-    };
-    EMIT_CODE();
+inline void WriteLoad(Byte*& ptr, BtInstr& instr, RegisterStack& rs,
+                      std::size_t capacity) {
+    if (rs.SlotLocation(instr.arg) == DATALOC_NONE)
+        rs.Flush(ptr);
+    bool reached = WriteSlotCheck(ptr, instr.arg, rs, capacity);
+
+    instr.res_loc = rs.Push(ptr);
+    instr.op1_loc = rs.SlotLocation(instr.arg);
+    if (!reached)
+        return;
+    if (instr.op1_loc == DATALOC_STACK || instr.op1_loc == DATALOC_NONE)
+        EmitLoad(ptr, X86_DWORD, REG(instr.res_loc), SlotMem(instr.arg));
+    else
+        EmitMov(ptr, X86_DWORD, REG(instr.res_loc), REG(instr.op1_loc));
+}
 
-    WriteResult(ptr, instr);
+inline void WriteStore(Byte*& ptr, BtInstr& instr, RegisterStack& rs,
+                       std::size_t capacity) {
+    bool imm = instr.op1_loc == DATALOC_IMM;
+    if (!imm)
+        instr.op1_loc = rs.Pop(ptr);
+    instr.res_loc = rs.SlotLocation(instr.arg);
+    if (instr.res_loc == DATALOC_NONE)
+        rs.Flush(ptr);
+    if (!WriteSlotCheck(ptr, instr.arg, rs, capacity))
+        return;
+
+    bool memory = instr.res_loc == DATALOC_STACK ||
+                  instr.res_loc == DATALOC_NONE;
+    if (imm && memory)
+        EmitStoreImm(ptr, SlotMem(instr.arg), instr.imm);
+    else if (imm)
+        EmitMovImm(ptr, REG(instr.res_loc), instr.imm);
+    else if (memory)
+        EmitStore(ptr, X86_DWORD, SlotMem(instr.arg), REG(instr.op1_loc));
+    else
+        EmitMov(ptr, X86_DWORD, REG(instr.res_loc), REG(instr.op1_loc));
 }
 
-inline void WriteDiv(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x41, 0x58,        // pop r8
-        0x58,              // pop rax
-        0x49, 0xF7, 0xF8,  // idiv r8
-        0x50               // push rax
-    };
+inline void WritePop(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    instr.op1_loc = rs.Pop(ptr);
+}
 
-    EMIT_CODE();
+/*!
+ * Pops the operands of a binary operation into registers. op2 is the top
+ * of stack, op1 the value below it. An operand folded into an immediate
+ * keeps DATALOC_IMM and isn't on the stack.
+ */
+inline void LoadOperands(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    if (instr.op2_loc != DATALOC_IMM)
+        instr.op2_loc = rs.Pop(ptr);
+    if (instr.op1_loc != DATALOC_IMM)
+        instr.op1_loc = rs.Pop(ptr);
 }
 
-// TODO: refactor this
-inline void WriteJump(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0xE9  // jump (relative)
-    };
-    EMIT_CODE();
+/*!
+ * Register operand of a binary operation, the one the result is computed in.
+ */
+inline DataLocation ResultOperand(const BtInstr& instr) {
+    return instr.op1_loc == DATALOC_IMM ? instr.op2_loc : instr.op1_loc;
+}
 
-    EmitAndShiftBuf(ptr, (int32_t)(0));
+/*!
+ * Pushes the result computed in the register operand.
+ */
+inline void WriteResult(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    DataLocation src = ResultOperand(instr);
+    instr.res_loc = rs.Push(ptr, src);
+    EmitMov(ptr, X86_DWORD, REG(instr.res_loc), REG(src));
 }
 
-inline void WriteCall(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0xE8  // call (relative)
-    };
-    EMIT_CODE();
+inline void WriteAdd(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    LoadOperands(ptr, instr, rs);
+    if (instr.op1_loc == DATALOC_IMM || instr.op2_loc == DATALOC_IMM) {
+        EmitAluImm(ptr, X86_ADD, X86_DWORD, REG(ResultOperand(instr)),
+                   instr.imm);
+    } else {
+        EmitAlu(ptr, X86_ADD, X86_DWORD, REG(instr.op1_loc),
+                REG(instr.op2_loc));
+    }
+    WriteResult(ptr, instr, rs);
+}
 
-    EmitAndShiftBuf(ptr, (int32_t)(0));
+inline void WriteSub(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    LoadOperands(ptr, instr, rs);
+    if (instr.op2_loc == DATALOC_IMM) {
+        EmitAluImm(ptr, X86_SUB, X86_DWORD, REG(instr.op1_loc), instr.imm);
+    } else if (instr.op1_loc == DATALOC_IMM) {
+        EmitNeg(ptr, REG(instr.op2_loc));
+        EmitAluImm(ptr, X86_ADD, X86_DWORD, REG(instr.op2_loc), instr.imm);
+    } else {
+        EmitAlu(ptr, X86_SUB, X86_DWORD, REG(instr.op1_loc),
+                REG(instr.op2_loc));
+    }
+    WriteResult(ptr, instr, rs);
 }
 
-inline void WriteJmc(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58,                   // pop rax
-        0x48, 0x83, 0xF8, 0x00, // cmp rax, 0
-        0x0F, 0x85              // jne
-    };
-    EMIT_CODE();
+inline void WriteMul(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    LoadOperands(ptr, instr, rs);
+    if (instr.op1_loc == DATALOC_IMM || instr.op2_loc == DATALOC_IMM) {
+        X86Register reg = REG(ResultOperand(instr));
+        EmitImulImm(ptr, reg, reg, instr.imm);
+    } else {
+        EmitImul(ptr, REG(instr.op1_loc), REG(instr.op2_loc));
+    }
+    WriteResult(ptr, instr, rs);
+}
 
-    EmitAndShiftBuf(ptr, (int32_t)(0));
+inline void WriteDiv(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    LoadOperands(ptr, instr, rs);
+    EmitMov(ptr, X86_DWORD, X86_RAX, REG(instr.op1_loc));
+    EmitIdiv(ptr, REG(instr.op2_loc));
+    EmitMov(ptr, X86_DWORD, REG(instr.op1_loc), X86_RAX);
+    WriteResult(ptr, instr, rs);
 }
 
-inline void WriteGz(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58,                               // pop rax
-        0x41, 0xB8, 0x01, 0x00, 0x00, 0x00, // mov r8, 1
-        0x48, 0x83, 0xF8, 0x00,             // cmp rax, 0
-        0xB8, 0x00, 0x00, 0x00, 0x00,       // mov rax, 0
-        0x49, 0x0F, 0x4F, 0xC0,             // cmovg rax, r8
-        0x50                                // push rax
-    };
+inline void WriteJump(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    // a JMC folded into a JMP still pops its condition
+    if (instr.op1_loc == DATALOC_STACK)
+        instr.op1_loc = rs.Pop(ptr);
+    rs.Flush(ptr);
+    EmitJmp32(ptr);
+}
 
-    EMIT_CODE();
+/*!
+ * Pushes the address of the code following the jump onto the return
+ * address stack and jumps to the callee. The return point must be
+ * emitted right after it.
+ */
+inline void WriteCall(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    rs.Flush(ptr);
+
+    Byte* lea = EmitLeaRip(ptr, X86_RAX);
+    EmitAluImm(ptr, X86_SUB, X86_QWORD, X86_R12, 8);
+    EmitStore(ptr, X86_QWORD, Mem(X86_R12), X86_RAX);
+    EmitJmp32(ptr);
+    PatchRel32(lea, ptr);
 }
 
-inline void WriteGez(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58,                               // pop rax
-        0x41, 0xB8, 0x01, 0x00, 0x00, 0x00, // mov r8, 1
-        0x48, 0x83, 0xF8, 0x00,             // cmp rax, 0
-        0xB8, 0x00, 0x00, 0x00, 0x00,       // mov rax, 0
-        0x49, 0x0F, 0x4D, 0xC0,             // cmovge rax, r8
-        0x50                                // push rax
-    };
+inline void WriteRet(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    rs.Flush(ptr);
+    EmitLoad(ptr, X86_QWORD, X86_RAX, Mem(X86_R12));
+    EmitAluImm(ptr, X86_ADD, X86_QWORD, X86_R12, 8);
+    EmitJmpReg(ptr, X86_RAX);
+}
 
-    EMIT_CODE();
+/*!
+ * PUSHBP and POPBP save and restore bp, which no instruction changes, so
+ * r15 stays put and only the bp stack moves.
+ */
+inline void WritePushBp(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    if (instr.probe) {
+        EmitLoad(ptr, X86_QWORD, X86_RAX, Mem(X86_RBP, -8));
+        return;
+    }
+    EmitAluImm(ptr, X86_SUB, X86_QWORD, X86_RBP, 8);
+    EmitStore(ptr, X86_QWORD, Mem(X86_RBP), X86_R15);
 }
 
-inline void WriteBz(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58,                               // pop rax
-        0x41, 0xB8, 0x01, 0x00, 0x00, 0x00, // mov r8, 1
-        0x48, 0x83, 0xF8, 0x00,             // cmp rax, 0
-        0xB8, 0x00, 0x00, 0x00, 0x00,       // mov rax, 0
-        0x49, 0x0F, 0x4C, 0xC0,             // cmovl rax, r8
-        0x50                                // push rax
-    };
+inline void WritePopBp(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    EmitLoad(ptr, X86_QWORD, X86_R15, Mem(X86_RBP));
+    EmitAluImm(ptr, X86_ADD, X86_QWORD, X86_RBP, 8);
+}
 
-    EMIT_CODE();
+/*!
+ * x86 condition that holds after 'test op, op' when the ZVM comparison
+ * is true.
+ */
+inline X86Condition ConditionCode(Opcode opcode) {
+    switch (opcode) {
+        case OPCODE_GZ: return X86_CC_G;
+        case OPCODE_GEZ: return X86_CC_GE;
+        case OPCODE_BZ: return X86_CC_L;
+        case OPCODE_BEZ: return X86_CC_LE;
+        case OPCODE_EQZ: return X86_CC_E;
+        case OPCODE_NEQZ: return X86_CC_NE;
+        default: throw UndefinedOpcodeException(opcode);
+    }
 }
 
-inline void WriteBez(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58,                               // pop rax
-        0x41, 0xB8, 0x01, 0x00, 0x00, 0x00, // mov r8, 1
-        0x48, 0x83, 0xF8, 0x00,             // cmp rax, 0
-        0xB8, 0x00, 0x00, 0x00, 0x00,       // mov rax, 0
-        0x49, 0x0F, 0x4E, 0xC0,             // cmovle rax, r8
-        0x50                                // push rax
-    };
+/*!
+ * test op, op; jCC target. 'cond' is a comparison fused into the JMC by
+ * FuseCompareBranch, plain JMCs jump on nonzero.
+ */
+inline void WriteJmc(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    instr.op1_loc = rs.Pop(ptr);
+    rs.Flush(ptr);
+    EmitTest(ptr, X86_DWORD, REG(instr.op1_loc), REG(instr.op1_loc));
+    EmitJcc32(ptr, ConditionCode(instr.cond));
+}
 
-    EMIT_CODE();
+/*!
+ * test op, op; setCC res8; movzx res, res8
+ */
+inline void WriteCompare(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    instr.op1_loc = rs.Pop(ptr);
+    EmitTest(ptr, X86_DWORD, REG(instr.op1_loc), REG(instr.op1_loc));
+    instr.res_loc = rs.Push(ptr, instr.op1_loc);
+    EmitSetcc(ptr, ConditionCode(instr.opcode), REG(instr.res_loc));
 }
 
-inline void WriteEqz(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58,                               // pop rax
-        0x41, 0xB8, 0x01, 0x00, 0x00, 0x00, // mov r8, 1
-        0x48, 0x83, 0xF8, 0x00,             // cmp rax, 0
-        0xB8, 0x00, 0x00, 0x00, 0x00,       // mov rax, 0
-        0x49, 0x0F, 0x44, 0xC0,             // cmove rax, r8
-        0x50                                // push rax
-    };
+/*!
+ * Loads the staging pointer 'pos' into rax and calls the runtime function
+ * 'func' if it has reached 'end'. The slow path keeps the registers in
+ * 'live' on the machine stack, so cached values survive the call.
+ */
+inline void WriteStagingCheck(Byte*& ptr, std::size_t pos, std::size_t end,
+                              std::size_t func, unsigned live) {
+    EmitLoad(ptr, X86_QWORD, X86_RAX, RuntimeField(pos));
+    EmitAluLoad(ptr, X86_CMP, X86_QWORD, X86_RAX, RuntimeField(end));
+    Byte* fast_jump = EmitJcc8(ptr, X86_CC_B);
+
+    for (int reg = 0; reg < 16; reg++) {
+        if (live & (1u << reg))
+            EmitPush(ptr, X86Register(reg));
+    }
+    EmitMov(ptr, X86_QWORD, X86_RDI, X86_R14);
+    EmitLoad(ptr, X86_QWORD, X86_RAX, RuntimeField(func));
+    WriteHostCall(ptr, X86_RAX);
+    for (int reg = 15; reg >= 0; reg--) {
+        if (live & (1u << reg))
+            EmitPop(ptr, X86Register(reg));
+    }
+    EmitLoad(ptr, X86_QWORD, X86_RAX, RuntimeField(pos));
+
+    PatchRel8(fast_jump, ptr);
+}
 
-    EMIT_CODE();
+/*!
+ * Advances the staging pointer in rax past the value just moved and
+ * stores it back to 'pos'.
+ */
+inline void WriteStagingAdvance(Byte*& ptr, std::size_t pos) {
+    EmitAluImm(ptr, X86_ADD, X86_QWORD, X86_RAX, sizeof(Data));
+    EmitStore(ptr, X86_QWORD, RuntimeField(pos), X86_RAX);
 }
 
-inline void WriteNeqz(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x58,                               // pop rax
-        0x41, 0xB8, 0x01, 0x00, 0x00, 0x00, // mov r8, 1
-        0x48, 0x83, 0xF8, 0x00,             // cmp rax, 0
-        0xB8, 0x00, 0x00, 0x00, 0x00,       // mov rax, 0
-        0x49, 0x0F, 0x45, 0xC0,             // cmovne rax, r8
-        0x50                                // push rax
-    };
+/*!
+ * Takes the next value from the runtime's input staging array, refilling
+ * it when empty.
+ */
+inline void WriteInput(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    instr.res_loc = rs.Push(ptr);
+    X86Register res = REG(instr.res_loc);
 
-    EMIT_CODE();
+    WriteStagingCheck(ptr, offsetof(io::Runtime, in_pos),
+                      offsetof(io::Runtime, in_end),
+                      offsetof(io::Runtime, refill),
+                      rs.BusyRegisters() & ~(1u << res));
+
+    EmitLoad(ptr, X86_DWORD, res, Mem(X86_RAX));
+    WriteStagingAdvance(ptr, offsetof(io::Runtime, in_pos));
 }
 
-inline void WriteInput(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x41, 0x52,        // push r10
-        0x41, 0x53,        // push r11
-        0x41, 0xFF, 0xD3,  // call r11
-        0x41, 0x5B,        // pop r11
-        0x41, 0x5A,        // pop r10
-        0x50               // push rax
-    };
+/*!
+ * Appends a value to the runtime's output staging array, flushing it
+ * when full.
+ */
+inline void WriteOutput(Byte*& ptr, BtInstr& instr, RegisterStack& rs) {
+    bool imm = instr.op1_loc == DATALOC_IMM;
+    if (!imm)
+        instr.op1_loc = rs.Pop(ptr);
+
+    WriteStagingCheck(ptr, offsetof(io::Runtime, out_pos),
+                      offsetof(io::Runtime, out_end),
+                      offsetof(io::Runtime, flush),
+                      rs.BusyRegisters());
+
+    if (imm)
+        EmitStoreImm(ptr, Mem(X86_RAX), instr.imm);
+    else
+        EmitStore(ptr, X86_DWORD, Mem(X86_RAX), REG(instr.op1_loc));
+    WriteStagingAdvance(ptr, offsetof(io::Runtime, out_pos));
+}
 
-    EMIT_CODE();
-}
-
-inline void WriteOutput(Byte*& ptr, const BtInstr& instr) {
-    Byte code[] = {
-        0x5F,               // pop rdi
-        0x41, 0x52,         // push r10
-        0x41, 0x53,         // push r11
-        0x41, 0xFF, 0xD4,   // call r12
-        0x41, 0x5B,         // pop r11
-        0x41, 0x5A,         // pop r10
-    };
-
-    EMIT_CODE();
-}
-
-void BinTran::WriteInstr(Byte*& ptr, BtInstr& instr) {
-    instr.x86_addr = ptr - (Byte*)translated_code_;
-    zvmaddr_map_[instr.zvm_addr] = &instr;
+/*!
+ * Emits 'instr' at 'ptr'. Its x86 address is recorded relative to 'base'.
+ */
+void BinTran::WriteInstr(Byte*& ptr, const Byte* base, BtInstr& instr,
+                         RegisterStack& rs) {
+    Byte* start = ptr;
+    instr.x86_addr = ptr - base;
+    if (instr.removed)
+        return;
 
     // write command macro
-#define WRT(instrname) Write ## instrname (ptr, instr);
+#define WRT(instrname) Write ## instrname (ptr, instr, rs);
     switch (instr.opcode) {
         case OPCODE_HALT:
-            WRT(Halt);
+            WriteHalt(ptr, instr);
             break;
         case OPCODE_PUSH:
             WRT(Push);
@@ -369,31 +715,33 @@ void BinTran::WriteInstr(Byte*& ptr, BtInstr& instr) {
             WRT(Jmc);
             break;
         case OPCODE_CALL:
-            WRT(Call);
+            if (instr.inlined)
+                WriteInlinedCall(ptr, base, instr, rs);
+            else
+                WRT(Call);
             break;
-        case OPCODE_GZ:
-            WRT(Gz);
+        case OPCODE_RET:
+            WRT(Ret);
             break;
-        case OPCODE_GEZ:
-            WRT(Gez);
+        case OPCODE_PUSHBP:
+            WRT(PushBp);
             break;
-        case OPCODE_BZ:
-            WRT(Bz);
+        case OPCODE_POPBP:
+            WRT(PopBp);
             break;
+        case OPCODE_GZ:
+        case OPCODE_GEZ:
+        case OPCODE_BZ:
         case OPCODE_BEZ:
-            WRT(Bez);
+        case OPCODE_EQZ:
+        case OPCODE_NEQZ:
+            WRT(Compare);
             break;
         case OPCODE_LOAD:
-            WRT(Load);
+            WriteLoad(ptr, instr, rs, data_capacity_);
             break;
         case OPCODE_STORE:
-            WRT(Store);
-            break;
-        case OPCODE_EQZ:
-            WRT(Eqz);
-            break;
-        case OPCODE_NEQZ:
-            WRT(Neqz);
+            WriteStore(ptr, instr, rs, data_capacity_);
             break;
         case OPCODE_INPUT:
             WRT(Input);
@@ -405,8 +753,35 @@ void BinTran::WriteInstr(Byte*& ptr, BtInstr& instr) {
             throw UndefinedOpcodeException(instr.opcode);
     }
 #undef WRT
+    rs.EndInstr();
+
+    // jump writers end with the rel32 of EmitJmp32 or EmitJcc32
+    if (instr.IsJump() && !instr.inlined)
+        instr.x86_patch = instr.x86_addr + (ptr - start) - sizeof(std::int32_t);
+}
+
+/*!
+ * Emits the body of the leaf function called by 'instr' in its place, on
+ * the caller's register stack. The return address stack isn't touched,
+ * only probed so that a full one still overflows.
+ */
+void BinTran::WriteInlinedCall(Byte*& ptr, const Byte* base,
+                               const BtInstr& instr, RegisterStack& rs) {
+    EmitLoad(ptr, X86_QWORD, X86_RAX, Mem(X86_R12, -8));
+
+    const CallTarget& target =
+        call_targets_.at(program_[instr.target].zvm_addr);
+    for (BtInstr body_instr: target.body)
+        WriteInstr(ptr, base, body_instr, rs);
+}
+
+/*!
+ * Spills cached values when control falls through into the next block.
+ */
+void BinTran::WriteBlockEnd(Byte*& ptr, const BasicBlock& block,
+                            RegisterStack& rs) {
+    rs.Flush(ptr);
 }
-#undef EMIT_DATA
-#undef EMIT_CODE
+#undef REG
 
 }  // namespace zvm
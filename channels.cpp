@@ -0,0 +1,298 @@
+/*!
+ channels.cpp - I/O channels of translated programs besides text.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "channels.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+
+namespace zvm {
+
+namespace io {
+
+// SpanInput
+
+SpanInput::SpanInput(const Data* values, std::size_t count)
+    : values_(values),
+      count_(count),
+      taken_(false) {}
+
+DataSpan SpanInput::Next(Data*) {
+    if (taken_)
+        return { nullptr, nullptr };
+
+    // translated code only reads input
+    taken_ = true;
+    Data* values = const_cast<Data*>(values_);
+    return { values, values + count_ };
+}
+
+// SpanOutput
+
+SpanOutput::SpanOutput(Data* values, std::size_t capacity)
+    : values_(values),
+      capacity_(capacity),
+      count_(0),
+      dropped_(0),
+      full_(false) {}
+
+DataSpan SpanOutput::Space(Data* staging) {
+    full_ = count_ == capacity_;
+    if (full_)
+        return { staging, staging + STAGING_SIZE };
+    return { values_ + count_, values_ + capacity_ };
+}
+
+void SpanOutput::Commit(std::size_t count) {
+    if (full_)
+        dropped_ += count;
+    else
+        count_ += count;
+}
+
+// MemoryOutput
+
+MemoryOutput::MemoryOutput(): count_(0) {}
+
+DataSpan MemoryOutput::Space(Data*) {
+    if (values_.size() - count_ < STAGING_SIZE)
+        values_.resize(std::max(values_.size() * 2, count_ + STAGING_SIZE));
+    return { values_.data() + count_, values_.data() + values_.size() };
+}
+
+void MemoryOutput::Commit(std::size_t count) {
+    count_ += count;
+}
+
+// MappedInput
+
+MappedInput::MappedInput(const std::string& filename): taken_(false) {
+    file_.Open(filename);
+    file_.AdviseSequential();
+}
+
+DataSpan MappedInput::Next(Data*) {
+    if (taken_)
+        return { nullptr, nullptr };
+
+    taken_ = true;
+    Data* values = (Data*)file_.Bytes();
+    return { values, values + file_.Size() / sizeof(Data) };
+}
+
+// MappedOutput
+
+MappedOutput::MappedOutput(const std::string& filename)
+    : fd_(-1),
+      window_(nullptr),
+      window_offset_(0),
+      count_(0),
+      failed_(false) {
+    fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+               0644);
+    if (fd_ < 0)
+        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
+}
+
+MappedOutput::~MappedOutput() {
+    Close();
+}
+
+void MappedOutput::Unmap() {
+    if (window_)
+        munmap(window_, MAPPED_WINDOW_SIZE);
+    window_ = nullptr;
+}
+
+DataSpan MappedOutput::Space(Data* staging) {
+    std::size_t offset = count_ * sizeof(Data);
+    if (!failed_ && (!window_ ||
+                     offset >= window_offset_ + MAPPED_WINDOW_SIZE)) {
+        Unmap();
+        window_offset_ = offset / MAPPED_WINDOW_SIZE * MAPPED_WINDOW_SIZE;
+        void* ptr = MAP_FAILED;
+        if (ftruncate(fd_, window_offset_ + MAPPED_WINDOW_SIZE) == 0)
+            ptr = mmap(0, MAPPED_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd_, window_offset_);
+        failed_ = ptr == MAP_FAILED;
+        if (!failed_)
+            window_ = (Data*)ptr;
+    }
+    if (failed_)
+        return { staging, staging + STAGING_SIZE };
+
+    return { window_ + (offset - window_offset_) / sizeof(Data),
+             window_ + MAPPED_WINDOW_SIZE / sizeof(Data) };
+}
+
+void MappedOutput::Commit(std::size_t count) {
+    if (!failed_)
+        count_ += count;
+}
+
+void MappedOutput::Close() {
+    if (fd_ < 0)
+        return;
+
+    Unmap();
+    if (ftruncate(fd_, count_ * sizeof(Data)) != 0)
+        failed_ = true;
+    close(fd_);
+    fd_ = -1;
+}
+
+// PipeInput
+
+PipeInput::PipeInput(int fd): fd_(fd), partial_size_(0) {}
+
+DataSpan PipeInput::Next(Data* staging) {
+    Byte* bytes = (Byte*)staging;
+    std::size_t size = partial_size_;
+    std::memcpy(bytes, partial_, size);
+
+    while (size < sizeof(Data)) {
+        ssize_t count = read(fd_, bytes + size,
+                             STAGING_SIZE * sizeof(Data) - size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0) {
+            partial_size_ = 0;
+            return { staging, staging };
+        }
+        size += count;
+    }
+
+    std::size_t values = size / sizeof(Data);
+    partial_size_ = size % sizeof(Data);
+    std::memcpy(partial_, bytes + values * sizeof(Data), partial_size_);
+    return { staging, staging + values };
+}
+
+// PipeOutput
+
+PipeOutput::PipeOutput(int fd): fd_(fd), space_(nullptr), failed_(false) {}
+
+DataSpan PipeOutput::Space(Data* staging) {
+    space_ = staging;
+    return { staging, staging + STAGING_SIZE };
+}
+
+void PipeOutput::Commit(std::size_t count) {
+    const Byte* bytes = (const Byte*)space_;
+    std::size_t size = count * sizeof(Data);
+    std::size_t written = 0;
+    while (!failed_ && written < size) {
+        ssize_t result = write(fd_, bytes + written, size - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        failed_ = result <= 0;
+        if (!failed_)
+            written += result;
+    }
+}
+
+// RingBuffer
+
+RingBuffer::RingBuffer(std::size_t capacity)
+    : head_(0),
+      tail_(0),
+      closed_(false) {
+    std::size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    values_.resize(size);
+    mask_ = size - 1;
+}
+
+/*!
+ * Wakes the other side if it waits. Taking the mutex orders this after
+ * its last check.
+ */
+void RingBuffer::Notify() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+    }
+    changed_.notify_all();
+}
+
+void RingBuffer::Write(const Data* values, std::size_t count) {
+    while (count > 0) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        auto free = [&] {
+            std::size_t tail = tail_.load(std::memory_order_acquire);
+            return values_.size() - (head - tail);
+        };
+        if (free() == 0) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [&] { return free() > 0; });
+        }
+
+        std::size_t chunk = std::min(std::min(count, free()),
+                                     values_.size() - (head & mask_));
+        std::memcpy(&values_[head & mask_], values, chunk * sizeof(Data));
+        head_.store(head + chunk, std::memory_order_release);
+        Notify();
+        values += chunk;
+        count -= chunk;
+    }
+}
+
+void RingBuffer::Close() {
+    closed_.store(true, std::memory_order_release);
+    Notify();
+}
+
+DataSpan RingBuffer::Acquire() {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    auto ready = [&] {
+        return head_.load(std::memory_order_acquire) != tail ||
+               closed_.load(std::memory_order_acquire);
+    };
+    if (!ready()) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, ready);
+    }
+
+    std::size_t head = head_.load(std::memory_order_acquire);
+    std::size_t count = std::min(head - tail, values_.size() - (tail & mask_));
+    Data* values = &values_[tail & mask_];
+    return { values, values + count };
+}
+
+void RingBuffer::Release(std::size_t count) {
+    if (count == 0)
+        return;
+    tail_.fetch_add(count, std::memory_order_release);
+    Notify();
+}
+
+// RingInput
+
+DataSpan RingInput::Next(Data*) {
+    ring_.Release(held_);
+    DataSpan values = ring_.Acquire();
+    held_ = values.end - values.begin;
+    return values;
+}
+
+}  // namespace io
+
+}  // namespace zvm
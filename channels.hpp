@@ -0,0 +1,252 @@
+/*!
+ channels.hpp - I/O channels of translated programs besides text.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_CHANNELS_HPP_
+#define ZVM_CHANNELS_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "io.hpp"
+#include "zvmarch.hpp"
+
+namespace zvm {
+
+namespace io {
+
+/*!
+ * Input from values in memory, handed to the program as they are. They
+ * must outlive the channel.
+ */
+class SpanInput: public InputChannel {
+public:
+    SpanInput(const Data* values, std::size_t count);
+
+    DataSpan Next(Data* staging) override;
+private:
+    const Data* values_;
+    std::size_t count_;
+    bool taken_;
+};
+
+/*!
+ * Output into a caller's array, written by the program in place. Values
+ * past its capacity are dropped and counted.
+ */
+class SpanOutput: public OutputChannel {
+public:
+    SpanOutput(Data* values, std::size_t capacity);
+
+    DataSpan Space(Data* staging) override;
+    void Commit(std::size_t count) override;
+
+    std::size_t Count() const {
+        return count_;
+    }
+
+    std::size_t Dropped() const {
+        return dropped_;
+    }
+private:
+    Data* values_;
+    std::size_t capacity_;
+    std::size_t count_;
+    std::size_t dropped_;
+    bool full_;  // the room handed out last is the staging array
+};
+
+/*!
+ * Output collected in memory that grows as needed, written by the program
+ * in place.
+ */
+class MemoryOutput: public OutputChannel {
+public:
+    MemoryOutput();
+
+    DataSpan Space(Data* staging) override;
+    void Commit(std::size_t count) override;
+
+    const Data* Values() const {
+        return values_.data();
+    }
+
+    std::size_t Count() const {
+        return count_;
+    }
+private:
+    std::vector<Data> values_;  // the first count_ are output
+    std::size_t count_;
+};
+
+/*!
+ * Input from a file of raw native-endian values, mapped and handed to the
+ * program in place. A partial value at the end of the file is ignored.
+ */
+class MappedInput: public InputChannel {
+public:
+    explicit MappedInput(const std::string& filename);
+
+    DataSpan Next(Data* staging) override;
+private:
+    MappedFile file_;
+    bool taken_;
+};
+
+/*!
+ * Output into a file of raw native-endian values. The file is extended
+ * and mapped MAPPED_WINDOW_SIZE bytes at a time, the program writes into
+ * the mapping, and it is cut to the values written when the channel is
+ * closed. If the file can't be grown, further output is dropped.
+ */
+class MappedOutput: public OutputChannel {
+public:
+    explicit MappedOutput(const std::string& filename);
+    ~MappedOutput();
+
+    MappedOutput(const MappedOutput&) = delete;
+    MappedOutput& operator=(const MappedOutput&) = delete;
+
+    DataSpan Space(Data* staging) override;
+    void Commit(std::size_t count) override;
+    void Close();
+
+    std::size_t Count() const {
+        return count_;
+    }
+
+    bool Failed() const {
+        return failed_;
+    }
+
+    const static std::size_t MAPPED_WINDOW_SIZE = std::size_t(1) << 20;
+private:
+    int fd_;
+    Data* window_;          // mapping of the file from window_offset_
+    std::size_t window_offset_;
+    std::size_t count_;     // values committed
+    bool failed_;
+
+    void Unmap();
+};
+
+/*!
+ * Input of raw native-endian values from a file descriptor, usually a
+ * pipe or a socket, read into the staging array. Values split between
+ * reads are put back together. The descriptor stays the caller's.
+ */
+class PipeInput: public InputChannel {
+public:
+    explicit PipeInput(int fd);
+
+    DataSpan Next(Data* staging) override;
+private:
+    int fd_;
+    Byte partial_[sizeof(Data)];
+    std::size_t partial_size_;
+};
+
+/*!
+ * Output of raw native-endian values to a file descriptor, written from
+ * the staging array. Output is dropped once a write fails.
+ */
+class PipeOutput: public OutputChannel {
+public:
+    explicit PipeOutput(int fd);
+
+    DataSpan Space(Data* staging) override;
+    void Commit(std::size_t count) override;
+
+    bool Failed() const {
+        return failed_;
+    }
+private:
+    int fd_;
+    const Data* space_;
+    bool failed_;
+};
+
+/*!
+ * Single producer, single consumer queue of values. The producer thread
+ * writes and finally closes it; the consumer, a RingInput, reads the
+ * values where they lie. Either side blocks while the ring is full or
+ * empty.
+ */
+class RingBuffer {
+public:
+    /*!
+     * 'capacity' is rounded up to a power of two.
+     */
+    explicit RingBuffer(std::size_t capacity = DEFAULT_CAPACITY);
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    void Write(const Data* values, std::size_t count);
+
+    /*!
+     * Ends the input once the consumer has read what's in the ring.
+     */
+    void Close();
+
+    /*!
+     * Values ready to be read, contiguous in the ring. Empty only once the
+     * ring is closed and drained.
+     */
+    DataSpan Acquire();
+
+    /*!
+     * Frees the first 'count' values acquired.
+     */
+    void Release(std::size_t count);
+
+    const static std::size_t DEFAULT_CAPACITY = 1 << 16;
+private:
+    std::vector<Data> values_;
+    std::size_t mask_;
+    std::atomic<std::size_t> head_;  // values written
+    std::atomic<std::size_t> tail_;  // values released
+    std::atomic<bool> closed_;
+
+    std::mutex mutex_;  // only for blocking
+    std::condition_variable changed_;
+
+    void Notify();
+};
+
+/*!
+ * Input read from a RingBuffer filled by another thread. A span handed to
+ * the program is released on the next call.
+ */
+class RingInput: public InputChannel {
+public:
+    explicit RingInput(RingBuffer& ring): ring_(ring), held_(0) {}
+
+    DataSpan Next(Data* staging) override;
+private:
+    RingBuffer& ring_;
+    std::size_t held_;
+};
+
+}  // namespace io
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_CHANNELS_HPP_ */
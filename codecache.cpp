@@ -0,0 +1,205 @@
+/*!
+ codecache.cpp - executable memory for translated programs.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "codecache.hpp"
+#include "exceptions.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace zvm {
+
+inline std::size_t RoundUp(std::size_t size, std::size_t granularity) {
+    return (size + granularity - 1) / granularity * granularity;
+}
+
+CodeCache::CodeCache(std::size_t reserve_size, std::size_t chunk_size)
+    : base_(nullptr),
+      reserve_size_(0),
+      chunk_size_(0),
+      page_size_(sysconf(_SC_PAGESIZE)),
+      top_(nullptr),
+      open_(false) {
+    chunk_size_ = RoundUp(chunk_size ? chunk_size : 1, page_size_);
+    reserve_size_ = RoundUp(reserve_size, chunk_size_);
+
+    // rel32 displacements must reach across the whole cache
+    if (reserve_size_ > (std::size_t(1) << 31))
+        throw std::logic_error("code cache reservation exceeds rel32 range");
+
+    void* ptr = mmap(0, reserve_size_, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED)
+        throw AllocException();
+
+    base_ = top_ = (Byte*)ptr;
+}
+
+CodeCache::~CodeCache() {
+    if (base_)
+        munmap(base_, reserve_size_);
+}
+
+void CodeCache::Protect(Byte* begin, std::size_t size, int prot) {
+    if (size && mprotect(begin, size, prot) != 0)
+        throw AllocException();
+}
+
+/*!
+ * Opens a writable region at the top of the cache and returns its start.
+ */
+Byte* CodeCache::BeginRegion() {
+    if (open_)
+        throw std::logic_error("code cache region is already open");
+
+    regions_.push_back({ top_, 0, 0 });
+    open_ = true;
+    EnsureSpace(top_, 1);
+    return regions_.back().begin;
+}
+
+/*!
+ * Makes the topmost region starting at 'begin' writable again and returns
+ * its end, where emitting continues. Close it with EndRegion as usual.
+ */
+Byte* CodeCache::ReopenRegion(const Byte* begin) {
+    if (open_)
+        throw std::logic_error("code cache region is already open");
+    if (regions_.empty() || regions_.back().begin != begin)
+        throw std::logic_error("only the topmost code cache region can be "
+                               "reopened");
+
+    Region& region = regions_.back();
+    Protect(region.begin, region.capacity, PROT_READ | PROT_WRITE);
+    open_ = true;
+    return region.begin + region.size;
+}
+
+/*!
+ * Maps 'size' bytes of 'path' starting at the page aligned 'offset' as a
+ * new read+execute region. The file must not change while it is mapped.
+ */
+Byte* CodeCache::MapRegion(const std::string& path, std::uint64_t offset,
+                           std::size_t size) {
+    if (open_)
+        throw std::logic_error("code cache region is already open");
+
+    std::size_t capacity = RoundUp(size ? size : 1, page_size_);
+    if (top_ + capacity > base_ + reserve_size_)
+        throw AllocException();
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw IoException(path, ERR_FILE_OPEN_FAILURE);
+
+    void* ptr = mmap(top_, size ? size : 1, PROT_READ | PROT_EXEC,
+                     MAP_PRIVATE | MAP_FIXED, fd, offset);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        throw AllocException();
+
+    regions_.push_back({ top_, size, capacity });
+    top_ += capacity;
+    return regions_.back().begin;
+}
+
+/*!
+ * Makes sure 'bytes' bytes starting at 'ptr' in the open region can be
+ * written, committing more chunks if needed.
+ */
+void CodeCache::EnsureSpace(const Byte* ptr, std::size_t bytes) {
+    if (!open_)
+        throw std::logic_error("no open code cache region");
+
+    Region& region = regions_.back();
+    std::size_t needed = (ptr - region.begin) + bytes;
+    if (needed <= region.capacity)
+        return;
+
+    std::size_t capacity = RoundUp(needed, chunk_size_);
+    if (region.begin + capacity > base_ + reserve_size_)
+        throw AllocException();
+
+    Protect(region.begin + region.capacity, capacity - region.capacity,
+            PROT_READ | PROT_WRITE);
+    region.capacity = capacity;
+    top_ = region.begin + capacity;
+}
+
+/*!
+ * Closes the open region at 'end', gives back unused pages and makes the
+ * code executable.
+ */
+void CodeCache::EndRegion(const Byte* end) {
+    if (!open_)
+        throw std::logic_error("no open code cache region");
+
+    Region& region = regions_.back();
+    region.size = end - region.begin;
+    if (region.size > region.capacity)
+        throw OutOfBoundsException("code written past the code cache region");
+
+    std::size_t capacity = RoundUp(region.size, page_size_);
+    Byte* unused = region.begin + capacity;
+    std::size_t unused_size = region.capacity - capacity;
+    if (unused_size) {
+        madvise(unused, unused_size, MADV_DONTNEED);
+        Protect(unused, unused_size, PROT_NONE);
+    }
+    region.capacity = capacity;
+    top_ = region.begin + capacity;
+
+    Protect(region.begin, region.capacity, PROT_READ | PROT_EXEC);
+    open_ = false;
+}
+
+/*!
+ * Releases the region starting at 'begin'.
+ */
+void CodeCache::Release(const Byte* begin) {
+    for (auto it = regions_.begin(); it != regions_.end(); ++it) {
+        if (it->begin != begin)
+            continue;
+
+        // a fresh reservation drops both anonymous and file backed pages
+        if (it->capacity)
+            mmap(it->begin, it->capacity, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                 -1, 0);
+        if (open_ && it + 1 == regions_.end())
+            open_ = false;
+
+        regions_.erase(it);
+        if (regions_.empty())
+            top_ = base_;
+        else
+            top_ = regions_.back().begin + regions_.back().capacity;
+        return;
+    }
+}
+
+CodeCacheStats CodeCache::Stats() const {
+    CodeCacheStats stats = { reserve_size_, 0, 0, 0, regions_.size() };
+    for (const auto& region: regions_) {
+        stats.committed += region.capacity;
+        stats.used += region.size;
+    }
+    stats.holes = (top_ - base_) - stats.committed;
+    return stats;
+}
+
+}  // namespace zvm
@@ -0,0 +1,105 @@
+/*!
+ codecache.hpp - executable memory for translated programs.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_CODECACHE_HPP_
+#define ZVM_CODECACHE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "zvmarch.hpp"
+
+namespace zvm {
+
+/*!
+ * Memory usage of a code cache, in bytes.
+ */
+struct CodeCacheStats {
+    std::size_t reserved;   // address space reserved for code
+    std::size_t committed;  // pages backed by memory
+    std::size_t used;       // emitted code
+    std::size_t holes;      // released regions below the top of the cache
+    std::size_t regions;    // live programs
+
+    /*!
+     * Share of the occupied address range that doesn't hold code.
+     */
+    double Fragmentation() const {
+        std::size_t occupied = committed + holes;
+        return occupied ? 1.0 - double(used) / occupied : 0.0;
+    }
+};
+
+/*!
+ * Code cache: one address range reserved up front, so every translated
+ * program lies within rel32 reach of any other, committed in chunks as
+ * code is emitted.
+ *
+ * A program is emitted into a region opened with BeginRegion. Its pages
+ * are writable (and not executable) until EndRegion trims the region to
+ * whole pages and flips them to read+execute. Only one region may be open
+ * at a time; it always grows at the top of the cache. MapRegion places
+ * read-only code straight from a file instead, sharing the page cache
+ * between processes. The topmost region can be reopened with ReopenRegion
+ * to append or patch code, which makes all of it non-executable until it
+ * is closed again. Released regions give their memory back and leave a
+ * hole until everything above them is released too.
+ */
+class CodeCache {
+public:
+    explicit CodeCache(std::size_t reserve_size = DEFAULT_RESERVE_SIZE,
+                       std::size_t chunk_size = DEFAULT_CHUNK_SIZE);
+    ~CodeCache();
+
+    CodeCache(const CodeCache&) = delete;
+    CodeCache& operator=(const CodeCache&) = delete;
+
+    Byte* BeginRegion();
+    Byte* ReopenRegion(const Byte* begin);
+    Byte* MapRegion(const std::string& path, std::uint64_t offset,
+                    std::size_t size);
+    void EnsureSpace(const Byte* ptr, std::size_t bytes);
+    void EndRegion(const Byte* end);
+    void Release(const Byte* begin);
+
+    CodeCacheStats Stats() const;
+
+    const static std::size_t DEFAULT_RESERVE_SIZE = std::size_t(256) << 20;
+    const static std::size_t DEFAULT_CHUNK_SIZE = 4096 * 16;
+private:
+    struct Region {
+        Byte* begin;
+        std::size_t size;      // bytes of code
+        std::size_t capacity;  // committed bytes
+    };
+
+    Byte* base_;
+    std::size_t reserve_size_;
+    std::size_t chunk_size_;
+    std::size_t page_size_;
+
+    Byte* top_;  // end of the topmost region
+    bool open_;  // the last region is being emitted
+    std::vector<Region> regions_;  // ordered by address
+
+    void Protect(Byte* begin, std::size_t size, int prot);
+};
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_CODECACHE_HPP_ */
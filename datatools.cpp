@@ -43,5 +43,81 @@ DecodedInstr FetchInstr(const Byte* ptr, Register& pc) {
     return result;
 }
 
-}  // namespace zvm
+StackEffect GetStackEffect(Opcode opcode) {
+    switch (opcode) {
+        case OPCODE_PUSH:
+        case OPCODE_LOAD:
+        case OPCODE_INPUT:
+            return { 0, 1 };
+        case OPCODE_POP:
+        case OPCODE_STORE:
+        case OPCODE_OUTPUT:
+        case OPCODE_JMC:
+            return { 1, 0 };
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+            return { 2, 1 };
+        case OPCODE_GZ:
+        case OPCODE_BZ:
+        case OPCODE_GEZ:
+        case OPCODE_BEZ:
+        case OPCODE_EQZ:
+        case OPCODE_NEQZ:
+            return { 1, 1 };
+        default:
+            return { 0, 0 };
+    }
+}
+
+bool EndsBasicBlock(Opcode opcode) {
+    return opcode == OPCODE_HALT || opcode == OPCODE_JMP ||
+           opcode == OPCODE_JMC || opcode == OPCODE_CALL ||
+           opcode == OPCODE_RET;
+}
+
+const char* OpcodeName(Opcode opcode) {
+#define OPCODE_NAME(name) case OPCODE_ ## name: return #name;
+    switch (opcode) {
+        OPCODE_NAME(HALT)
+        OPCODE_NAME(PUSH)
+        OPCODE_NAME(POP)
+        OPCODE_NAME(ADD)
+        OPCODE_NAME(LOAD)
+        OPCODE_NAME(STORE)
+        OPCODE_NAME(INPUT)
+        OPCODE_NAME(OUTPUT)
+        OPCODE_NAME(JMP)
+        OPCODE_NAME(JMC)
+        OPCODE_NAME(SUB)
+        OPCODE_NAME(MUL)
+        OPCODE_NAME(DIV)
+        OPCODE_NAME(GZ)
+        OPCODE_NAME(BZ)
+        OPCODE_NAME(GEZ)
+        OPCODE_NAME(BEZ)
+        OPCODE_NAME(CALL)
+        OPCODE_NAME(RET)
+        OPCODE_NAME(PUSHBP)
+        OPCODE_NAME(POPBP)
+        OPCODE_NAME(EQZ)
+        OPCODE_NAME(NEQZ)
+        default:
+            return "UD";
+    }
+#undef OPCODE_NAME
+}
 
+std::uint64_t HashBytes(const void* data, std::size_t size,
+                        std::uint64_t hash) {
+    const std::uint64_t FNV_PRIME = 1099511628211ull;
+    const Byte* bytes = static_cast<const Byte*>(data);
+    for (std::size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+}  // namespace zvm
@@ -17,6 +17,7 @@
 #ifndef ZVM_DATATOOLS_HPP_
 #define ZVM_DATATOOLS_HPP_
 
+#include <cstdint>
 #include "zvmarch.hpp"
 
 namespace zvm {
@@ -36,6 +37,37 @@ void EmitAt(Byte*& buf, T data, std::size_t at) {
 
 DecodedInstr FetchInstr(const Byte* ptr, Register& pc);
 
+/*!
+ * Number of values an instruction pops from and then pushes onto the data
+ * stack.
+ */
+struct StackEffect {
+    int pops;
+    int pushes;
+};
+
+StackEffect GetStackEffect(Opcode opcode);
+
+/*!
+ * Returns true if the instruction transfers control and thus ends a basic
+ * block.
+ */
+bool EndsBasicBlock(Opcode opcode);
+
+/*!
+ * Mnemonic of 'opcode' as zasm spells it, "UD" for undefined opcodes.
+ */
+const char* OpcodeName(Opcode opcode);
+
+const std::uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+/*!
+ * 64-bit FNV-1a hash. Pass a previous result as 'hash' to hash several
+ * buffers as one.
+ */
+std::uint64_t HashBytes(const void* data, std::size_t size,
+                        std::uint64_t hash = FNV_OFFSET_BASIS);
+
 }  // namespace zvm
 
 #endif /* ifndef ZVM_DATATOOLS_HPP_ */
@@ -36,7 +36,10 @@ enum ErrorCode {
     ERR_SYNTAX_UNDEFINED_LABEL = 8,
     ERR_OUT_OF_BOUNDS = 9,
     ERR_STACK_UNDERFLOW = 10,
-    ERR_UNDEFINED_OPCODE = 11
+    ERR_UNDEFINED_OPCODE = 11,
+    ERR_STACK_OVERFLOW = 12,
+    ERR_BAD_OBJECT_FILE = 13,
+    ERR_FILE_WRITE_FAILURE = 14
 };
 
 class IoException: public std::runtime_error {
@@ -51,6 +54,9 @@ public:
             case ERR_FILE_DOESNT_EXIST:
                 errmsg_ = "file \"" + filename + "\" doesn't exist";
                 break;
+            case ERR_FILE_WRITE_FAILURE:
+                errmsg_ = "failed to write file \"" + filename + "\"";
+                break;
             default:
                 errmsg_ = "unknown Io exception";
                 break;
@@ -151,6 +157,13 @@ public:
     {}
 };
 
+class StackOverflowException: public std::runtime_error {
+public:
+    StackOverflowException(const std::string& msg)
+        : std::runtime_error(msg)
+    {}
+};
+
 class DivisionByZeroException: public std::runtime_error {
 public:
     DivisionByZeroException(const std::string& msg)
@@ -158,6 +171,13 @@ public:
     {}
 };
 
+class ObjectFormatException: public std::runtime_error {
+public:
+    ObjectFormatException(const std::string& filename, const std::string& msg)
+        : std::runtime_error("\"" + filename + "\": " + msg)
+    {}
+};
+
 }  // namespace zvm
 
 #endif /* ifndef ZVM_EXCEPTIONS_HPP_ */
@@ -0,0 +1,182 @@
+/*!
+ host.cpp - runs many translated ZVM programs concurrently in one process.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "host.hpp"
+#include <chrono>
+#include <new>
+
+namespace zvm {
+
+typedef std::chrono::steady_clock Clock;
+
+inline double SecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/*!
+ * Fills in the run time and the values a job has moved, not counting
+ * input staged but never taken.
+ */
+inline void RecordRun(JobResult& result, const io::Runtime& rt,
+                      Clock::time_point start) {
+    result.run_seconds = SecondsSince(start);
+    result.values_read = rt.values_read - (rt.in_end - rt.in_pos);
+    result.values_written = rt.values_written;
+}
+
+JobContext::JobContext(const HostJob& job)
+    : sandbox(DATA_MEMORY_SIZE, CALL_STACK_SIZE),
+      reader(job.input_fd),
+      writer(job.output_fd),
+      text_input(reader),
+      text_output(writer),
+      runtime(new io::Runtime) {
+    reader.Tie(&writer);
+    io::InitRuntime(*runtime,
+                    job.input ? *job.input : (io::InputChannel&)text_input,
+                    job.output ? *job.output :
+                                 (io::OutputChannel&)text_output);
+}
+
+Host::Host(std::size_t thread_count, TranslationCache* disk_cache)
+    : disk_cache_(disk_cache),
+      pool_(thread_count),
+      jobs_(0),
+      reused_(0) {}
+
+/*!
+ * Returns the translated program in 'filename', translating it unless a
+ * binary with the same contents was translated before.
+ */
+std::shared_ptr<Host::Program> Host::Acquire(const std::string& filename,
+                                             JobResult& result) {
+    std::shared_ptr<Program> program(new Program(code_cache_));
+    program->object.Load(filename);
+    program->translator.LoadProgram(program->object);
+    // jobs already run on the pool, translation stays on the job's thread
+    program->translator.SetThreadCount(1);
+    std::uint64_t hash = program->translator.SourceHash();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_++;
+        auto found = programs_.find(hash);
+        if (found != programs_.end()) {
+            reused_++;
+            result.reused = true;
+            return found->second;
+        }
+    }
+
+    // another job may have translated the binary while we waited
+    std::lock_guard<std::mutex> translating(translate_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = programs_.find(hash);
+        if (found != programs_.end()) {
+            reused_++;
+            result.reused = true;
+            return found->second;
+        }
+    }
+
+    BinTran& translator = program->translator;
+    program->object.AdviseSequential();
+    try {
+        if (!disk_cache_ || !translator.LoadCached(*disk_cache_)) {
+            translator.Translate();
+            if (disk_cache_)
+                translator.StoreCached(*disk_cache_);
+        }
+    } catch (...) {
+        // a failed translation may hold a region of the code cache, it is
+        // released while no other job translates into the cache
+        program.reset();
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    programs_.emplace(hash, program);
+    return program;
+}
+
+JobResult Host::RunJob(const HostJob& job) {
+    JobResult result = { ERR_OK, "", false, 0.0, 0.0, 0, 0 };
+    try {
+        Clock::time_point start = Clock::now();
+        std::shared_ptr<Program> program = Acquire(job.program, result);
+        result.translate_seconds = SecondsSince(start);
+
+        JobContext context(job);
+        io::Runtime& rt = *context.runtime;
+        start = Clock::now();
+        try {
+            program->translator.Execute(rt, context.sandbox);
+        } catch (...) {
+            RecordRun(result, rt, start);
+            throw;
+        }
+        RecordRun(result, rt, start);
+    } catch (...) {
+        result.status = ErrorCodeOf(std::current_exception(), result.error);
+    }
+    return result;
+}
+
+std::vector<JobResult> Host::Run(const std::vector<HostJob>& jobs) {
+    std::vector<JobResult> results(jobs.size());
+    pool_.ParallelFor(jobs.size(), [&](std::size_t i) {
+        results[i] = RunJob(jobs[i]);
+    });
+    return results;
+}
+
+HostStats Host::Stats() {
+    std::lock_guard<std::mutex> translating(translate_mutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    return { programs_.size(), jobs_, reused_, code_cache_.Stats() };
+}
+
+ErrorCode ErrorCodeOf(std::exception_ptr error, std::string& message) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const IoException& ioerr) {
+        message = ioerr.what();
+        return ioerr.GetErrorCode();
+    } catch (const ObjectFormatException& objerr) {
+        message = objerr.what();
+        return ERR_BAD_OBJECT_FILE;
+    } catch (const AllocException& allocerr) {
+        message = allocerr.what();
+        return ERR_FAILED_MEM_ALLOC;
+    } catch (const std::bad_alloc& allocerr) {
+        message = allocerr.what();
+        return ERR_FAILED_MEM_ALLOC;
+    } catch (const StackUnderflowException& stackerr) {
+        message = stackerr.what();
+        return ERR_STACK_UNDERFLOW;
+    } catch (const StackOverflowException& stackerr) {
+        message = stackerr.what();
+        return ERR_STACK_OVERFLOW;
+    } catch (const std::exception& err) {
+        // out of bounds, undefined opcodes and division by zero alike
+        message = err.what();
+        return ERR_OUT_OF_BOUNDS;
+    }
+}
+
+}  // namespace zvm
@@ -0,0 +1,171 @@
+/*!
+ host.hpp - runs many translated ZVM programs concurrently in one process.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_HOST_HPP_
+#define ZVM_HOST_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bintran.hpp"
+#include "codecache.hpp"
+#include "exceptions.hpp"
+#include "io.hpp"
+#include "objfile.hpp"
+#include "sandbox.hpp"
+#include "threadpool.hpp"
+#include "transcache.hpp"
+
+namespace zvm {
+
+/*!
+ * A program to run: the ZVM binary at 'program' reading its INPUT from
+ * 'input' and writing its OUTPUT to 'output'. Without channels it reads
+ * and writes text on 'input_fd' and 'output_fd'. Channels and descriptors
+ * stay owned by the caller, a channel serves one job at a time.
+ */
+struct HostJob {
+    std::string program;
+    int input_fd;
+    int output_fd;
+    io::InputChannel* input;
+    io::OutputChannel* output;
+};
+
+/*!
+ * Outcome of a job. 'status' is the exit code bintran would have given
+ * the program on its own, 'error' the message of the failure if any.
+ */
+struct JobResult {
+    ErrorCode status;
+    std::string error;
+
+    bool reused;               // translation made for an earlier job
+    double translate_seconds;  // loading the binary and translating it
+    double run_seconds;
+    std::uint64_t values_read;
+    std::uint64_t values_written;
+
+    /*!
+     * Values read and written per second of running.
+     */
+    double Throughput() const {
+        return run_seconds > 0 ?
+               double(values_read + values_written) / run_seconds : 0.0;
+    }
+};
+
+/*!
+ * State of one running job: its own data, call and bp stacks and I/O
+ * channels. Created on the thread that runs the job.
+ */
+struct JobContext {
+    explicit JobContext(const HostJob& job);
+
+    Sandbox sandbox;
+    io::Reader reader;
+    io::Writer writer;
+    io::TextInput text_input;
+    io::TextOutput text_output;
+    std::unique_ptr<io::Runtime> runtime;
+};
+
+struct HostStats {
+    std::size_t programs;      // distinct binaries
+    std::size_t jobs;          // jobs run
+    std::size_t reused;        // jobs that found their translation ready
+    CodeCacheStats code;
+};
+
+/*!
+ * Execution host: translated programs share one code cache and are kept
+ * for the lifetime of the host, keyed by the hash of the binary, so jobs
+ * running the same binary translate it once. Jobs run on a thread pool,
+ * each in a JobContext of its own; the translated code itself is never
+ * written once it runs.
+ *
+ * Translations are made one at a time, as the code cache has only one
+ * open region; jobs whose programs are ready don't wait for them. With a
+ * translation cache, translations are also looked up on disk and stored
+ * there.
+ */
+class Host {
+public:
+    /*!
+     * 'thread_count' 0 means one thread per hardware thread.
+     */
+    explicit Host(std::size_t thread_count = 0,
+                  TranslationCache* disk_cache = nullptr);
+
+    Host(const Host&) = delete;
+    Host& operator=(const Host&) = delete;
+
+    /*!
+     * Runs all 'jobs' on the pool and returns their results in order.
+     * A job failing doesn't affect the others.
+     */
+    std::vector<JobResult> Run(const std::vector<HostJob>& jobs);
+
+    /*!
+     * Runs one job on the calling thread. Safe to call from several
+     * threads at once.
+     */
+    JobResult RunJob(const HostJob& job);
+
+    HostStats Stats();
+
+    std::size_t ThreadCount() const {
+        return pool_.ThreadCount();
+    }
+private:
+    /*!
+     * A binary and its translation. The translator refers to the object.
+     */
+    struct Program {
+        explicit Program(CodeCache& cache): translator(cache) {}
+
+        ObjectFile object;
+        BinTran translator;
+    };
+
+    CodeCache code_cache_;
+    TranslationCache* disk_cache_;
+    ThreadPool pool_;
+
+    std::mutex translate_mutex_;  // guards code_cache_ and disk_cache_
+    std::mutex mutex_;            // guards the members below
+    std::unordered_map<std::uint64_t, std::shared_ptr<Program>> programs_;
+    std::size_t jobs_;
+    std::size_t reused_;
+
+    std::shared_ptr<Program> Acquire(const std::string& filename,
+                                     JobResult& result);
+};
+
+/*!
+ * Exit code for the exception 'error', as bintran reports it.
+ */
+ErrorCode ErrorCodeOf(std::exception_ptr error, std::string& message);
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_HOST_HPP_ */
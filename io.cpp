@@ -0,0 +1,376 @@
+/*!
+ io.cpp - library for input/output.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "io.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+
+namespace zvm {
+
+namespace io {
+
+inline bool IsSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+inline bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// MappedFile
+
+MappedFile::MappedFile()
+    : data_(nullptr),
+      size_(0),
+      mapped_(false) {}
+
+MappedFile::~MappedFile() {
+    Close();
+}
+
+void MappedFile::Close() {
+    if (mapped_)
+        munmap((void*)data_, size_);
+    copy_.clear();
+    copy_.shrink_to_fit();
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = false;
+}
+
+void MappedFile::Open(const std::string& filename, std::size_t padding) {
+    Close();
+
+    if (filename == "-") {
+        ReadStream(STDIN_FD, padding, filename);
+        return;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw IoException(filename, errno == ENOENT ? ERR_FILE_DOESNT_EXIST
+                                                    : ERR_FILE_OPEN_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
+    }
+
+    std::size_t page_size = sysconf(_SC_PAGESIZE);
+    std::size_t size = st.st_size;
+    std::size_t tail = (page_size - size % page_size) % page_size;
+    if (!S_ISREG(st.st_mode) || size == 0 || tail < padding) {
+        try {
+            ReadStream(fd, padding, filename);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        return;
+    }
+
+    void* ptr = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
+
+    data_ = (const Byte*)ptr;
+    size_ = size;
+    mapped_ = true;
+}
+
+/*!
+ * Reads everything left in 'fd' into memory.
+ */
+void MappedFile::ReadStream(int fd, std::size_t padding,
+                            const std::string& filename) {
+    std::size_t size = 0;
+    copy_.resize(BUFFER_SIZE);
+    while (true) {
+        if (copy_.size() - size < BUFFER_SIZE)
+            copy_.resize(copy_.size() * 2);
+
+        ssize_t count = read(fd, copy_.data() + size, copy_.size() - size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            throw IoException(filename, ERR_FILE_OPEN_FAILURE);
+        if (count == 0)
+            break;
+        size += count;
+    }
+
+    copy_.resize(size + padding);
+    std::fill(copy_.begin() + size, copy_.end(), 0);
+    data_ = copy_.data();
+    size_ = size;
+}
+
+void MappedFile::AdviseSequential() const {
+    if (mapped_)
+        madvise((void*)data_, size_, MADV_SEQUENTIAL);
+}
+
+// Reader
+
+Reader::Reader(int fd)
+    : fd_(fd),
+      buffer_(new char[BUFFER_SIZE]),
+      pos_(0),
+      end_(0),
+      eof_(false),
+      tie_(nullptr) {}
+
+void Reader::Tie(Writer* writer) {
+    tie_ = writer;
+}
+
+/*!
+ * Reads more data after what's left in the buffer. Returns false at the
+ * end of input.
+ */
+bool Reader::Fill() {
+    if (pos_ > 0) {
+        std::memmove(buffer_.get(), buffer_.get() + pos_, end_ - pos_);
+        end_ -= pos_;
+        pos_ = 0;
+    }
+    if (tie_)
+        tie_->Flush();
+
+    ssize_t count = 0;
+    do {
+        count = read(fd_, buffer_.get() + end_, BUFFER_SIZE - end_);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0) {
+        eof_ = true;
+        return false;
+    }
+    end_ += count;
+    return true;
+}
+
+/*!
+ * Skips whitespace and returns true if the next token can be parsed
+ * without reading more, i.e. it is followed by something in the buffer or
+ * the input is over.
+ */
+bool Reader::TokenReady() {
+    while (pos_ < end_ && IsSpace(buffer_[pos_]))
+        pos_++;
+
+    std::size_t i = pos_;
+    if (i < end_ && (buffer_[i] == '-' || buffer_[i] == '+'))
+        i++;
+    while (i < end_ && IsDigit(buffer_[i]))
+        i++;
+    return i < end_ || eof_ || end_ - pos_ == BUFFER_SIZE;
+}
+
+/*!
+ * Parses an integer at the current position. On failure nothing is
+ * consumed.
+ */
+bool Reader::ParseInt(Data& value) {
+    std::size_t i = pos_;
+    bool negative = false;
+    if (i < end_ && (buffer_[i] == '-' || buffer_[i] == '+'))
+        negative = buffer_[i++] == '-';
+    if (i == end_ || !IsDigit(buffer_[i]))
+        return false;
+
+    std::uint32_t result = 0;
+    for (; i < end_ && IsDigit(buffer_[i]); i++)
+        result = result * 10 + (buffer_[i] - '0');
+
+    value = Data(negative ? 0u - result : result);
+    pos_ = i;
+    return true;
+}
+
+Data Reader::ReadInt() {
+    while (!TokenReady())
+        Fill();
+
+    Data value = 0;
+    ParseInt(value);
+    return value;
+}
+
+/*!
+ * Reads one integer, then as many more as the buffer already holds,
+ * up to 'max_count'. Returns the number of values read.
+ */
+std::size_t Reader::ReadInts(Data* values, std::size_t max_count) {
+    if (max_count == 0)
+        return 0;
+
+    values[0] = ReadInt();
+    std::size_t count = 1;
+    while (count < max_count && TokenReady() && ParseInt(values[count]))
+        count++;
+    return count;
+}
+
+// Writer
+
+Writer::Writer(int fd)
+    : fd_(fd),
+      buffer_(new char[BUFFER_SIZE]),
+      pos_(0) {}
+
+Writer::~Writer() {
+    Flush();
+}
+
+void Writer::WriteInt(Data value) {
+    const std::size_t MAX_INT_LENGTH = 12;  // "-2147483648\n"
+    if (pos_ + MAX_INT_LENGTH > BUFFER_SIZE)
+        Flush();
+
+    char digits[MAX_INT_LENGTH];
+    std::size_t count = 0;
+    std::uint32_t magnitude = value < 0 ? 0u - std::uint32_t(value) : value;
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+
+    char* out = buffer_.get() + pos_;
+    if (value < 0)
+        *out++ = '-';
+    while (count)
+        *out++ = digits[--count];
+    *out++ = '\n';
+    pos_ = out - buffer_.get();
+}
+
+void Writer::Flush() {
+    std::size_t written = 0;
+    while (written < pos_) {
+        ssize_t count = write(fd_, buffer_.get() + written, pos_ - written);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        written += count;
+    }
+    pos_ = 0;
+}
+
+// TextInput
+
+DataSpan TextInput::Next(Data* staging) {
+    std::size_t count = reader_.ReadInts(staging, STAGING_SIZE);
+    return { staging, staging + count };
+}
+
+// TextOutput
+
+DataSpan TextOutput::Space(Data* staging) {
+    space_ = staging;
+    return { staging, staging + STAGING_SIZE };
+}
+
+void TextOutput::Commit(std::size_t count) {
+    for (std::size_t i = 0; i < count; i++)
+        writer_.WriteInt(space_[i]);
+}
+
+void TextOutput::Flush() {
+    writer_.Flush();
+}
+
+// Runtime
+
+/*!
+ * Commits the values written into the current room.
+ */
+inline void CommitOutput(Runtime* rt) {
+    std::size_t count = rt->out_pos - rt->out_begin;
+    rt->output->Commit(count);
+    rt->values_written += count;
+}
+
+/*!
+ * Takes new room from the output channel.
+ */
+inline void TakeSpace(Runtime* rt) {
+    DataSpan space = rt->output->Space(rt->out_values);
+    rt->out_begin = rt->out_pos = space.begin;
+    rt->out_end = space.end;
+}
+
+void RuntimeRefill(Runtime* rt) {
+    // output goes first, text input flushes it before blocking
+    RuntimeFlush(rt);
+
+    DataSpan values = { rt->in_values, rt->in_values };
+    if (!rt->in_over)
+        values = rt->input->Next(rt->in_values);
+    rt->in_over = values.begin == values.end;
+    if (rt->in_over) {
+        rt->in_values[0] = 0;
+        values = { rt->in_values, rt->in_values + 1 };
+    } else {
+        rt->values_read += values.end - values.begin;
+    }
+    rt->in_pos = values.begin;
+    rt->in_end = values.end;
+}
+
+void RuntimeFlush(Runtime* rt) {
+    CommitOutput(rt);
+    TakeSpace(rt);
+}
+
+void InitRuntime(Runtime& rt, InputChannel& input, OutputChannel& output) {
+    rt.in_pos = rt.in_end = rt.in_values;
+    rt.refill = &RuntimeRefill;
+    rt.flush = &RuntimeFlush;
+    rt.fault = nullptr;
+    rt.input = &input;
+    rt.output = &output;
+    rt.in_over = false;
+    rt.values_read = 0;
+    rt.values_written = 0;
+    rt.counters = nullptr;
+    TakeSpace(&rt);
+}
+
+/*!
+ * Commits and flushes everything translated code has output so far.
+ */
+void FlushRuntime(Runtime& rt) {
+    RuntimeFlush(&rt);
+    rt.output->Flush();
+}
+
+}  // namespace io
+
+}  // namespace zvm
@@ -15,10 +15,249 @@
  limitations under the License.
 */
 
+#ifndef ZVM_IO_HPP_
+#define ZVM_IO_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "datatools.hpp"
+#include "zvmarch.hpp"
+
 namespace zvm {
 
 namespace io {
 
+const std::size_t BUFFER_SIZE = 1 << 16;
+const std::size_t STAGING_SIZE = 1024;
+
+const int STDIN_FD = 0;
+const int STDOUT_FD = 1;
+
+/*!
+ * Read-only view of a whole file.
+ *
+ * Regular files are memory-mapped in place; pipes, terminals and "-"
+ * (stdin) are streamed into memory instead. At least 'padding' zero bytes
+ * follow the contents either way, so decoders may read a bounded distance
+ * past the end (a NUL terminator, a truncated operand). A mapping only
+ * provides that within its last page, so files whose tail is too short
+ * are copied as well.
+ */
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    void Open(const std::string& filename, std::size_t padding = 0);
+    void Close();
+
+    /*!
+     * Hints the kernel that the contents will be read front to back.
+     */
+    void AdviseSequential() const;
+
+    const Byte* Bytes() const {
+        return data_;
+    }
+
+    std::size_t Size() const {
+        return size_;
+    }
+
+    bool Mapped() const {
+        return mapped_;
+    }
+private:
+    const Byte* data_;
+    std::size_t size_;
+    bool mapped_;
+    std::vector<Byte> copy_;
+
+    void ReadStream(int fd, std::size_t padding, const std::string& filename);
+};
+
+class Writer;
+
+/*!
+ * Buffered reader of whitespace separated decimal integers.
+ *
+ * Follows scanf("%d"): a value that can't be parsed reads as 0 and is
+ * left in the input, as does the end of input. Before blocking on the
+ * file the tied writer, if any, is flushed, so prompts show up.
+ */
+class Reader {
+public:
+    explicit Reader(int fd = STDIN_FD);
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    void Tie(Writer* writer);
+    Data ReadInt();
+    std::size_t ReadInts(Data* values, std::size_t max_count);
+private:
+    int fd_;
+    std::unique_ptr<char[]> buffer_;
+    std::size_t pos_;
+    std::size_t end_;
+    bool eof_;
+    Writer* tie_;
+
+    bool Fill();
+    bool TokenReady();
+    bool ParseInt(Data& value);
+};
+
+/*!
+ * Buffered writer of integers, one per line.
+ */
+class Writer {
+public:
+    explicit Writer(int fd = STDOUT_FD);
+    ~Writer();
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    void WriteInt(Data value);
+    void Flush();
+private:
+    int fd_;
+    std::unique_ptr<char[]> buffer_;
+    std::size_t pos_;
+};
+
+/*!
+ * Values [begin, end).
+ */
+struct DataSpan {
+    Data* begin;
+    Data* end;
+};
+
+/*!
+ * Source of the values INPUT reads.
+ *
+ * Channels are called from translated code, which exceptions can't
+ * unwind through, so they must not throw; a failing channel ends its
+ * input or drops its output.
+ */
+class InputChannel {
+public:
+    virtual ~InputChannel() {}
+
+    /*!
+     * Returns the next values, which stay valid until the next call. The
+     * channel may put them into 'staging', room for STAGING_SIZE values,
+     * or hand out memory of its own; they are only read. An empty span
+     * ends the input, INPUT reads 0 from then on.
+     */
+    virtual DataSpan Next(Data* staging) = 0;
+};
+
+/*!
+ * Destination of the values OUTPUT writes.
+ */
+class OutputChannel {
+public:
+    virtual ~OutputChannel() {}
+
+    /*!
+     * Returns room for at least one value: 'staging', which holds
+     * STAGING_SIZE values, or memory of the channel's own.
+     */
+    virtual DataSpan Space(Data* staging) = 0;
+
+    /*!
+     * Takes the first 'count' values of the room handed out last, which
+     * mustn't be used afterwards.
+     */
+    virtual void Commit(std::size_t count) = 0;
+
+    /*!
+     * Passes buffered output on to wherever it goes.
+     */
+    virtual void Flush() {}
+};
+
+/*!
+ * Decimal text read through a Reader, as by scanf: the end of input and
+ * values that can't be parsed read as 0.
+ */
+class TextInput: public InputChannel {
+public:
+    explicit TextInput(Reader& reader): reader_(reader) {}
+
+    DataSpan Next(Data* staging) override;
+private:
+    Reader& reader_;
+};
+
+/*!
+ * Decimal text written through a Writer, a value per line.
+ */
+class TextOutput: public OutputChannel {
+public:
+    explicit TextOutput(Writer& writer): writer_(writer), space_(nullptr) {}
+
+    DataSpan Space(Data* staging) override;
+    void Commit(std::size_t count) override;
+    void Flush() override;
+private:
+    Writer& writer_;
+    const Data* space_;
+};
+
+/*!
+ * I/O state shared with translated code. The code moves values between
+ * registers and the spans at in_pos and out_pos inline, and calls
+ * 'refill' or 'flush' with the runtime as the argument only when the
+ * input span runs dry or the output span fills up. 'fault' doesn't
+ * return; it is set by whoever runs the code (see Sandbox). Field offsets
+ * are baked into the code.
+ *
+ * The spans come from the channels. Input is read from wherever the input
+ * channel put it and output written straight into the room the output
+ * channel gave, the staging arrays are only used by channels that ask for
+ * them.
+ */
+struct Runtime {
+    Data* in_pos;
+    Data* in_end;
+    Data* out_pos;
+    Data* out_end;
+    void (*refill)(Runtime* rt);
+    void (*flush)(Runtime* rt);
+    void (*fault)(Runtime* rt, std::uint32_t fault);
+
+    InputChannel* input;
+    OutputChannel* output;
+    Data* out_begin;               // start of the room out_pos moves through
+    bool in_over;                  // the input channel has nothing more
+    std::uint64_t values_read;     // taken from the input channel so far
+    std::uint64_t values_written;  // committed to the output channel so far
+    std::uint64_t* counters;       // block counters of profiled code
+    Data in_values[STAGING_SIZE];
+    Data out_values[STAGING_SIZE];
+};
+
+void InitRuntime(Runtime& rt, InputChannel& input, OutputChannel& output);
+void FlushRuntime(Runtime& rt);
+
+/*!
+ * Commits output written so far to the output channel, without flushing
+ * it, and takes new room from it.
+ */
+void RuntimeFlush(Runtime* rt);
+
 }  // namespace io
 
 }  // namespace zvm
+
+#endif /* ifndef ZVM_IO_HPP_ */
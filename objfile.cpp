@@ -0,0 +1,312 @@
+/*!
+ objfile.cpp - ZVM object file format.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "objfile.hpp"
+#include "exceptions.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+namespace zvm {
+
+static const char OBJECT_MAGIC[4] = { 'Z', 'V', 'M', 'O' };
+static const std::size_t SECTION_ALIGNMENT = 8;
+
+inline std::size_t AlignUp(std::size_t size, std::size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// ObjectFile
+
+ObjectFile::ObjectFile()
+    : legacy_(false),
+      code_(nullptr),
+      code_size_(0),
+      index_(nullptr),
+      index_size_(0),
+      data_(nullptr),
+      data_size_(0),
+      jump_table_(nullptr),
+      jump_table_size_(0) {}
+
+void ObjectFile::Load(const std::string& filename) {
+    filename_ = filename;
+    legacy_ = false;
+    code_ = nullptr;
+    code_size_ = index_size_ = data_size_ = jump_table_size_ = 0;
+    index_ = jump_table_ = nullptr;
+    data_ = nullptr;
+    symbols_.clear();
+    legacy_index_.clear();
+
+    // operands of a truncated last instruction read as zeros
+    file_.Open(filename, MAX_INSTRUCTION_SIZE);
+    Parse();
+}
+
+void ObjectFile::AdviseSequential() const {
+    file_.AdviseSequential();
+}
+
+void ObjectFile::Parse() {
+    const Byte* bytes = file_.Bytes();
+    std::size_t size = file_.Size();
+
+    ObjectHeader header;
+    if (size < sizeof(header) ||
+        std::memcmp(bytes, OBJECT_MAGIC, sizeof(OBJECT_MAGIC)) != 0) {
+        legacy_ = true;
+        code_ = bytes;
+        code_size_ = size;
+        BuildLegacyIndex();
+        return;
+    }
+
+    std::memcpy(&header, bytes, sizeof(header));
+    if (header.version != OBJECT_FORMAT_VERSION)
+        throw ObjectFormatException(filename_, "unsupported format version");
+    if (header.section_count > (size - sizeof(header)) / sizeof(ObjectSection))
+        throw ObjectFormatException(filename_, "truncated section table");
+
+    const ObjectSection* sections =
+        (const ObjectSection*)(bytes + sizeof(header));
+    bool has_code = false;
+    for (std::size_t i = 0; i < header.section_count; i++) {
+        const ObjectSection& section = sections[i];
+        if (section.offset % SECTION_ALIGNMENT != 0 ||
+            section.offset > size || section.size > size - section.offset)
+            throw ObjectFormatException(filename_, "section out of bounds");
+
+        const Byte* ptr = bytes + section.offset;
+        switch (section.type) {
+            case OBJ_SECTION_CODE:
+                // the padding after the file must follow the code
+                if (section.offset + section.size != size ||
+                    section.count != section.size)
+                    throw ObjectFormatException(filename_,
+                                                "malformed code section");
+                code_ = ptr;
+                code_size_ = section.size;
+                has_code = true;
+                break;
+            case OBJ_SECTION_INDEX:
+            case OBJ_SECTION_JUMP_TABLE:
+                if (section.size != section.count * sizeof(std::uint32_t))
+                    throw ObjectFormatException(filename_,
+                                                "malformed address section");
+                if (section.type == OBJ_SECTION_INDEX) {
+                    index_ = (const std::uint32_t*)ptr;
+                    index_size_ = section.count;
+                } else {
+                    jump_table_ = (const std::uint32_t*)ptr;
+                    jump_table_size_ = section.count;
+                }
+                break;
+            case OBJ_SECTION_DATA:
+                if (section.size != section.count * sizeof(Data))
+                    throw ObjectFormatException(filename_,
+                                                "malformed data section");
+                data_ = (const Data*)ptr;
+                data_size_ = section.count;
+                break;
+            case OBJ_SECTION_SYMBOLS:
+                ParseSymbols(ptr, section.size, section.count);
+                break;
+            default:
+                // unknown sections are skipped, so the format can grow
+                break;
+        }
+    }
+
+    if (!has_code)
+        throw ObjectFormatException(filename_, "no code section");
+    if (!index_)
+        BuildLegacyIndex();
+
+    CheckIndex();
+    CheckJumpTable();
+}
+
+void ObjectFile::ParseSymbols(const Byte* ptr, std::size_t size,
+                              std::size_t count) {
+    std::size_t pos = 0;
+    for (std::size_t i = 0; i < count; i++) {
+        std::uint32_t entry[2];
+        if (size - pos < sizeof(entry))
+            throw ObjectFormatException(filename_, "malformed symbol table");
+        std::memcpy(entry, ptr + pos, sizeof(entry));
+        pos += sizeof(entry);
+
+        if (size - pos < entry[1])
+            throw ObjectFormatException(filename_, "malformed symbol table");
+        symbols_.push_back({ std::string((const char*)ptr + pos, entry[1]),
+                             entry[0] });
+        pos = std::min(size, AlignUp(pos + entry[1], sizeof(std::uint32_t)));
+    }
+}
+
+/*!
+ * Checks that the index lists every instruction of the code in order.
+ */
+void ObjectFile::CheckIndex() const {
+    Register pc = 0;
+    for (std::size_t i = 0; i < index_size_; i++) {
+        if (index_[i] != pc || pc >= code_size_)
+            throw ObjectFormatException(filename_,
+                                        "instruction index doesn't match code");
+        FetchInstr(code_, pc);
+    }
+
+    if (pc != code_size_)
+        throw ObjectFormatException(filename_,
+                                    "instruction index doesn't match code");
+}
+
+/*!
+ * Checks that jump targets are instructions or the end of the code.
+ */
+void ObjectFile::CheckJumpTable() const {
+    for (std::size_t i = 0; i < jump_table_size_; i++) {
+        if (jump_table_[i] != code_size_ &&
+            !std::binary_search(index_, index_ + index_size_, jump_table_[i]))
+            throw ObjectFormatException(filename_,
+                                        "jump table entry isn't an instruction");
+    }
+}
+
+/*!
+ * Decodes the code from the start to find instruction boundaries. The
+ * last instruction of a legacy file may be truncated.
+ */
+void ObjectFile::BuildLegacyIndex() {
+    legacy_index_.clear();
+    Register pc = 0;
+    while (pc < code_size_) {
+        legacy_index_.push_back(pc);
+        FetchInstr(code_, pc);
+    }
+
+    index_ = legacy_index_.data();
+    index_size_ = legacy_index_.size();
+}
+
+// ObjectWriter
+
+void ObjectWriter::SetCode(const Byte* code, std::size_t size) {
+    code_.assign(code, code + size);
+}
+
+void ObjectWriter::AddSymbol(const std::string& name, std::uint32_t address) {
+    symbols_.push_back({ name, address });
+}
+
+void ObjectWriter::AddData(Data value) {
+    data_.push_back(value);
+}
+
+void ObjectWriter::AddJumpTarget(std::uint32_t address) {
+    jump_table_.push_back(address);
+}
+
+void ObjectWriter::Write(const std::string& filename) const {
+    // instruction index
+    std::vector<Byte> padded(code_);
+    padded.resize(code_.size() + MAX_INSTRUCTION_SIZE);
+    std::vector<std::uint32_t> index;
+    Register pc = 0;
+    while (pc < code_.size()) {
+        index.push_back(pc);
+        FetchInstr(padded.data(), pc);
+    }
+
+    std::vector<std::uint32_t> jump_table(jump_table_);
+    std::sort(jump_table.begin(), jump_table.end());
+    jump_table.erase(std::unique(jump_table.begin(), jump_table.end()),
+                     jump_table.end());
+
+    std::vector<Byte> symbols;
+    for (const auto& symbol: symbols_) {
+        std::uint32_t entry[2] = { symbol.address,
+                                   std::uint32_t(symbol.name.size()) };
+        symbols.insert(symbols.end(), (const Byte*)entry,
+                       (const Byte*)(entry + 2));
+        symbols.insert(symbols.end(), symbol.name.begin(), symbol.name.end());
+        symbols.resize(AlignUp(symbols.size(), sizeof(std::uint32_t)));
+    }
+
+    struct Content {
+        ObjectSectionType type;
+        std::size_t count;
+        const void* data;
+        std::size_t size;
+    };
+    const Content contents[] = {
+        { OBJ_SECTION_SYMBOLS, symbols_.size(), symbols.data(), symbols.size() },
+        { OBJ_SECTION_DATA, data_.size(), data_.data(),
+          data_.size() * sizeof(Data) },
+        { OBJ_SECTION_JUMP_TABLE, jump_table.size(), jump_table.data(),
+          jump_table.size() * sizeof(std::uint32_t) },
+        { OBJ_SECTION_INDEX, index.size(), index.data(),
+          index.size() * sizeof(std::uint32_t) },
+        { OBJ_SECTION_CODE, code_.size(), code_.data(), code_.size() }
+    };
+    const std::size_t SECTION_COUNT = sizeof(contents) / sizeof(contents[0]);
+
+    ObjectHeader header = {};
+    std::memcpy(header.magic, OBJECT_MAGIC, sizeof(OBJECT_MAGIC));
+    header.version = OBJECT_FORMAT_VERSION;
+    header.section_count = SECTION_COUNT;
+
+    ObjectSection sections[SECTION_COUNT];
+    std::size_t offset = AlignUp(sizeof(header) + sizeof(sections),
+                                 SECTION_ALIGNMENT);
+    for (std::size_t i = 0; i < SECTION_COUNT; i++) {
+        sections[i] = { std::uint32_t(contents[i].type),
+                        std::uint32_t(contents[i].count), offset,
+                        contents[i].size };
+        offset = AlignUp(offset + contents[i].size, SECTION_ALIGNMENT);
+    }
+
+    std::FILE* f = std::fopen(filename.c_str(), "wb");
+    if (!f)
+        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
+
+    // the padding goes by what is written, so stop at the first short write
+    const Byte zeros[SECTION_ALIGNMENT] = {};
+    std::size_t written = 0;
+    auto write = [&](const void* data, std::size_t size) {
+        std::size_t count = std::fwrite(data, 1, size, f);
+        written += count;
+        return count == size;
+    };
+    bool ok = write(&header, sizeof(header)) &&
+              write(sections, sizeof(sections));
+    for (std::size_t i = 0; ok && i < SECTION_COUNT; i++) {
+        ok = write(zeros, sections[i].offset - written) &&
+             write(contents[i].data, contents[i].size);
+    }
+    if (std::fclose(f) != 0 || !ok) {
+        // a truncated object file, but not a device written to
+        struct stat st;
+        if (stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            std::remove(filename.c_str());
+        throw IoException(filename, ERR_FILE_WRITE_FAILURE);
+    }
+}
+
+}  // namespace zvm
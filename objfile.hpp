@@ -0,0 +1,169 @@
+/*!
+ objfile.hpp - ZVM object file format.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_OBJFILE_HPP_
+#define ZVM_OBJFILE_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "datatools.hpp"
+#include "io.hpp"
+#include "zvmarch.hpp"
+
+namespace zvm {
+
+/*!
+ * Object file layout: an ObjectHeader, 'section_count' ObjectSections,
+ * then the section contents, each 8-byte aligned. The code section comes
+ * last, so the padding io::MappedFile adds after the file also follows
+ * the code.
+ */
+struct ObjectHeader {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t section_count;
+    std::uint32_t reserved;
+};
+
+struct ObjectSection {
+    std::uint32_t type;
+    std::uint32_t count;   // number of entries
+    std::uint64_t offset;  // from the start of the file
+    std::uint64_t size;    // in bytes
+};
+
+enum ObjectSectionType {
+    OBJ_SECTION_CODE = 1,        // instruction stream, one byte entries
+    OBJ_SECTION_INDEX = 2,       // uint32 code address of every instruction
+    OBJ_SECTION_SYMBOLS = 3,     // uint32 address, uint32 length, name
+    OBJ_SECTION_DATA = 4,        // initial data stack, bottom first
+    OBJ_SECTION_JUMP_TABLE = 5   // uint32 addresses jumped or called to
+};
+
+struct ObjectSymbol {
+    std::string name;
+    std::uint32_t address;
+};
+
+/*!
+ * Loaded ZVM program: an object file, or a legacy headerless instruction
+ * stream, in which case the instruction index is rebuilt by decoding and
+ * the other sections are empty.
+ *
+ * Code, index, data and jump table point into the mapped file. Loading
+ * checks that the index marks exactly the instructions of the code and
+ * that jump table entries are instruction addresses.
+ */
+class ObjectFile {
+public:
+    ObjectFile();
+
+    ObjectFile(const ObjectFile&) = delete;
+    ObjectFile& operator=(const ObjectFile&) = delete;
+
+    void Load(const std::string& filename);
+    void AdviseSequential() const;
+
+    bool Legacy() const {
+        return legacy_;
+    }
+
+    const Byte* Code() const {
+        return code_;
+    }
+
+    std::size_t CodeSize() const {
+        return code_size_;
+    }
+
+    std::size_t InstrCount() const {
+        return index_size_;
+    }
+
+    std::uint32_t InstrAddr(std::size_t i) const {
+        return index_[i];
+    }
+
+    std::size_t DataSize() const {
+        return data_size_;
+    }
+
+    const Data* InitialData() const {
+        return data_;
+    }
+
+    bool HasJumpTable() const {
+        return jump_table_ != nullptr;
+    }
+
+    std::size_t JumpTableSize() const {
+        return jump_table_size_;
+    }
+
+    std::uint32_t JumpTarget(std::size_t i) const {
+        return jump_table_[i];
+    }
+
+    const std::vector<ObjectSymbol>& Symbols() const {
+        return symbols_;
+    }
+private:
+    io::MappedFile file_;
+    std::string filename_;
+    bool legacy_;
+
+    const Byte* code_;
+    std::size_t code_size_;
+    const std::uint32_t* index_;
+    std::size_t index_size_;
+    const Data* data_;
+    std::size_t data_size_;
+    const std::uint32_t* jump_table_;
+    std::size_t jump_table_size_;
+    std::vector<ObjectSymbol> symbols_;
+    std::vector<std::uint32_t> legacy_index_;
+
+    void Parse();
+    void ParseSymbols(const Byte* ptr, std::size_t size, std::size_t count);
+    void CheckIndex() const;
+    void CheckJumpTable() const;
+    void BuildLegacyIndex();
+};
+
+/*!
+ * Builds object files.
+ */
+class ObjectWriter {
+public:
+    void SetCode(const Byte* code, std::size_t size);
+    void AddSymbol(const std::string& name, std::uint32_t address);
+    void AddData(Data value);
+    void AddJumpTarget(std::uint32_t address);
+    void Write(const std::string& filename) const;
+private:
+    std::vector<Byte> code_;
+    std::vector<ObjectSymbol> symbols_;
+    std::vector<Data> data_;
+    std::vector<std::uint32_t> jump_table_;
+};
+
+const std::uint32_t OBJECT_FORMAT_VERSION = 1;
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_OBJFILE_HPP_ */
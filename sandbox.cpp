@@ -0,0 +1,219 @@
+/*!
+ sandbox.cpp - guarded native stacks for running translated code.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "sandbox.hpp"
+#include "exceptions.hpp"
+#include <csetjmp>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace zvm {
+
+namespace {
+
+/*!
+ * Sandbox::Run in progress on a thread.
+ */
+struct RunContext {
+    sigjmp_buf env;
+    const Sandbox* sandbox;
+};
+
+thread_local RunContext* current_run = nullptr;
+
+/*!
+ * Signal stack of a thread, the faulting code may have no stack left.
+ */
+const std::size_t SIGNAL_STACK_SIZE = 1 << 16;
+thread_local std::unique_ptr<char[]> signal_stack;
+
+struct sigaction previous_segv;
+struct sigaction previous_fpe;
+
+/*!
+ * Passes a signal that isn't a sandbox fault on to the handler installed
+ * before ours, which stays in place for later runs.
+ */
+void ChainFault(int signo, siginfo_t* info, void* context) {
+    const struct sigaction& previous =
+        signo == SIGSEGV ? previous_segv : previous_fpe;
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(signo, info, context);
+    } else if (previous.sa_handler != SIG_DFL &&
+               previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(signo);
+    } else {
+        // the default action ends the process once the handler returns,
+        // a fault can't be ignored either
+        signal(signo, SIG_DFL);
+        raise(signo);
+    }
+}
+
+void HandleFault(int signo, siginfo_t* info, void* context) {
+    RunContext* run = current_run;
+    NativeFault fault = FAULT_NONE;
+    if (run && signo == SIGFPE)
+        fault = FAULT_DIVISION_BY_ZERO;
+    else if (run && signo == SIGSEGV)
+        fault = run->sandbox->Classify(info->si_addr);
+
+    if (fault == FAULT_NONE) {
+        ChainFault(signo, info, context);
+        return;
+    }
+    siglongjmp(run->env, fault);
+}
+
+/*!
+ * Raises a fault found by checks in translated code.
+ */
+void RuntimeFault(io::Runtime*, std::uint32_t fault) {
+    siglongjmp(current_run->env, int(fault));
+}
+
+void InstallHandlers() {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        struct sigaction action = {};
+        action.sa_sigaction = &HandleFault;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_segv);
+        sigaction(SIGFPE, &action, &previous_fpe);
+    });
+
+    if (!signal_stack) {
+        signal_stack.reset(new char[SIGNAL_STACK_SIZE]);
+        stack_t stack = {};
+        stack.ss_sp = signal_stack.get();
+        stack.ss_size = SIGNAL_STACK_SIZE;
+        sigaltstack(&stack, nullptr);
+    }
+}
+
+}  // namespace
+
+GuardedStack::GuardedStack(std::size_t capacity)
+    : mapping_(nullptr),
+      mapping_size_(0),
+      page_size_(sysconf(_SC_PAGESIZE)),
+      capacity_(0) {
+    std::size_t entries_size = capacity * sizeof(std::uint64_t);
+    entries_size = (entries_size + page_size_ - 1) / page_size_ * page_size_;
+    mapping_size_ = entries_size + 2 * page_size_;
+    capacity_ = entries_size / sizeof(std::uint64_t);
+
+    void* ptr = mmap(0, mapping_size_, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED)
+        throw AllocException();
+    mapping_ = (Byte*)ptr;
+
+    if (entries_size &&
+        mprotect(mapping_ + page_size_, entries_size,
+                 PROT_READ | PROT_WRITE) != 0) {
+        munmap(mapping_, mapping_size_);
+        throw AllocException();
+    }
+}
+
+GuardedStack::~GuardedStack() {
+    munmap(mapping_, mapping_size_);
+}
+
+int GuardedStack::Classify(const void* addr) const {
+    const Byte* byte = (const Byte*)addr;
+    if (byte >= mapping_ && byte < mapping_ + page_size_)
+        return -1;
+    if (byte >= mapping_ + mapping_size_ - page_size_ &&
+        byte < mapping_ + mapping_size_)
+        return 1;
+    return 0;
+}
+
+Sandbox::Sandbox(std::size_t data_capacity, std::size_t call_capacity)
+    : data_(data_capacity),
+      calls_(call_capacity),
+      bps_(call_capacity) {}
+
+NativeFault Sandbox::Classify(const void* addr) const {
+    const struct {
+        const GuardedStack& stack;
+        NativeFault overflow;
+        NativeFault underflow;
+    } stacks[] = {
+        { data_, FAULT_STACK_OVERFLOW, FAULT_STACK_UNDERFLOW },
+        { calls_, FAULT_CALL_STACK_OVERFLOW, FAULT_CALL_STACK_UNDERFLOW },
+        { bps_, FAULT_BP_STACK_OVERFLOW, FAULT_BP_STACK_UNDERFLOW }
+    };
+
+    for (const auto& entry: stacks) {
+        int side = entry.stack.Classify(addr);
+        if (side)
+            return side < 0 ? entry.overflow : entry.underflow;
+    }
+    return FAULT_NONE;
+}
+
+void Sandbox::Run(io::Runtime* rt, const std::function<void()>& code) {
+    InstallHandlers();
+    rt->fault = &RuntimeFault;
+
+    RunContext run;
+    run.sandbox = this;
+    RunContext* outer = current_run;
+    current_run = &run;
+
+    int fault = sigsetjmp(run.env, 1);
+    if (fault == FAULT_NONE)
+        code();
+
+    current_run = outer;
+    if (fault != FAULT_NONE) {
+        io::RuntimeFlush(rt);
+        ThrowNativeFault(NativeFault(fault));
+    }
+}
+
+void ThrowNativeFault(NativeFault fault) {
+    switch (fault) {
+        case FAULT_STACK_OVERFLOW:
+            throw StackOverflowException("data stack overflow");
+        case FAULT_STACK_UNDERFLOW:
+            throw StackUnderflowException("data stack underflow");
+        case FAULT_OUT_OF_BOUNDS:
+            throw OutOfBoundsException("data stack index out of bounds");
+        case FAULT_DIVISION_BY_ZERO:
+            throw DivisionByZeroException("division by zero");
+        case FAULT_CALL_STACK_OVERFLOW:
+            throw StackOverflowException("call stack overflow");
+        case FAULT_CALL_STACK_UNDERFLOW:
+            throw StackUnderflowException("call stack underflow");
+        case FAULT_BP_STACK_OVERFLOW:
+            throw StackOverflowException("bp stack overflow");
+        case FAULT_BP_STACK_UNDERFLOW:
+            throw StackUnderflowException("bp stack underflow");
+        default:
+            throw std::logic_error("unknown native fault");
+    }
+}
+
+}  // namespace zvm
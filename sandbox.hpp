@@ -0,0 +1,142 @@
+/*!
+ sandbox.hpp - guarded native stacks for running translated code.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_SANDBOX_HPP_
+#define ZVM_SANDBOX_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include "io.hpp"
+#include "zvmarch.hpp"
+
+namespace zvm {
+
+/*!
+ * Runtime errors of translated code, passed to io::Runtime::fault.
+ */
+enum NativeFault {
+    FAULT_NONE = 0,
+    FAULT_STACK_OVERFLOW = 1,
+    FAULT_STACK_UNDERFLOW = 2,
+    FAULT_OUT_OF_BOUNDS = 3,
+    FAULT_DIVISION_BY_ZERO = 4,
+    FAULT_CALL_STACK_OVERFLOW = 5,
+    FAULT_CALL_STACK_UNDERFLOW = 6,
+    FAULT_BP_STACK_OVERFLOW = 7,
+    FAULT_BP_STACK_UNDERFLOW = 8
+};
+
+/*!
+ * Downward growing stack of 8-byte entries mapped on its own between two
+ * guard pages. The first entry lies right below the upper guard page, so
+ * popping an empty stack faults there; pushing past the capacity runs
+ * into the lower guard page. The capacity is rounded up to whole pages so
+ * that the lower guard page lies right below the last entry.
+ */
+class GuardedStack {
+public:
+    explicit GuardedStack(std::size_t capacity);
+    ~GuardedStack();
+
+    GuardedStack(const GuardedStack&) = delete;
+    GuardedStack& operator=(const GuardedStack&) = delete;
+
+    /*!
+     * Stack pointer of the empty stack, the start of the upper guard page.
+     */
+    std::uint64_t* Top() const {
+        return (std::uint64_t*)(mapping_ + mapping_size_ - page_size_);
+    }
+
+    std::size_t Capacity() const {
+        return capacity_;
+    }
+
+    /*!
+     * -1 for an access to the lower guard page, 1 for the upper one and
+     * 0 for anything else.
+     */
+    int Classify(const void* addr) const;
+private:
+    Byte* mapping_;
+    std::size_t mapping_size_;
+    std::size_t page_size_;
+    std::size_t capacity_;
+};
+
+/*!
+ * Stacks of translated code: the ZVM data stack, the return addresses of
+ * CALL and the bp values saved by PUSHBP, each a GuardedStack. The latter
+ * two have the same capacity, as in the interpreter.
+ *
+ * Run() turns guard page faults and SIGFPE into the exceptions the
+ * interpreter throws, so translated code needs no checks of its own on
+ * push and pop. Calls to the host made by the code must switch to the
+ * host stack.
+ */
+class Sandbox {
+public:
+    Sandbox(std::size_t data_capacity, std::size_t call_capacity);
+
+    Sandbox(const Sandbox&) = delete;
+    Sandbox& operator=(const Sandbox&) = delete;
+
+    /*!
+     * Address of data stack slot 0, slot i is at Slot0() - i.
+     */
+    std::uint64_t* Slot0() const {
+        return data_.Top() - 1;
+    }
+
+    std::uint64_t* CallTop() const {
+        return calls_.Top();
+    }
+
+    std::uint64_t* BpTop() const {
+        return bps_.Top();
+    }
+
+    std::size_t Capacity() const {
+        return data_.Capacity();
+    }
+
+    /*!
+     * Runs translated code through 'code' on this thread. Output staged in
+     * 'rt' is passed on before a fault is thrown. 'code' is left with
+     * siglongjmp on a fault, so it must not own anything.
+     */
+    void Run(io::Runtime* rt, const std::function<void()>& code);
+
+    /*!
+     * Which fault an access to 'addr' is, FAULT_NONE if it isn't a guard.
+     */
+    NativeFault Classify(const void* addr) const;
+private:
+    GuardedStack data_;
+    GuardedStack calls_;
+    GuardedStack bps_;
+};
+
+/*!
+ * Throws the exception the interpreter throws for 'fault'.
+ */
+[[noreturn]] void ThrowNativeFault(NativeFault fault);
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_SANDBOX_HPP_ */
@@ -0,0 +1,223 @@
+#!/bin/bash
+# check.sh - regression checks of zvm, bintran and zasm
+# Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Usage: check.sh ZVM ZASM BINTRAN CHECK PROGRAM...
+#
+# A test program NAME.zas reads NAME.in, if there is one, and NAME.expected
+# holds what it must print: its output, then the error message, if any,
+# then "exit N" with its exit code. NAME.zvm-args, if there is one, holds
+# options for zvm; the program then runs only on the interpreter, as the
+# stacks of translated code have fixed sizes.
+#
+# NAME.hex instead of NAME.zas is a raw binary in hex, for programs zasm
+# can't make. Those run only on the interpreter as well, bintran rejects
+# the bad jumps they are made of.
+#
+# Checks:
+#   engines PROGRAM      every engine runs PROGRAM as expected
+#   objfile PROGRAM      the object file and the raw stream of PROGRAM run
+#                        alike and the object file keeps its labels
+#   cache PROGRAM OTHER  translations are reused, replaced when the binary
+#                        changes to OTHER and thrown away when corrupt
+#   host PROGRAM...      the programs run as one batch on a host, and raw
+#                        values pass through mapped channels
+
+ZVM=$1
+ZASM=$2
+BINTRAN=$3
+CHECK=$4
+shift 4
+
+ENGINES=("$ZVM --switch" "$ZVM" "$ZVM --tiered --tier-threshold 0"
+         "$ZVM --tiered --tier-threshold 1" "$BINTRAN --no-cache"
+         "$BINTRAN --no-cache --lazy")
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+# assemble SOURCE OUTPUT [--raw]
+assemble() {
+    if ! "$ZASM" $3 "$1" "$2" > "$WORK/zasm.log"; then
+        cat "$WORK/zasm.log"
+        echo "FAIL: can't assemble $1"
+        exit 1
+    fi
+}
+
+# input_of PROGRAM - the file the program reads its input from
+input_of() {
+    local input=${1%.*}.in
+    [ -f "$input" ] || input=/dev/null
+    echo "$input"
+}
+
+# run PROGRAM COMMAND... - prints what a run of COMMAND prints the way
+# .expected files hold it
+run() {
+    local program=$1
+    shift
+    "$@" < "$(input_of "$program")" > "$WORK/stdout" 2> "$WORK/stderr"
+    local status=$?
+    cat "$WORK/stdout" "$WORK/stderr"
+    echo "exit $status"
+}
+
+# expect PROGRAM WHAT ACTUAL_FILE
+expect() {
+    if ! diff -u "${1%.*}.expected" "$3" > "$WORK/diff"; then
+        fail "$1: $2"
+        cat "$WORK/diff"
+    fi
+}
+
+check_engines() {
+    local program=$1
+    local name=${program%.*}
+    local zvm_args=
+    local engines=("${ENGINES[@]}")
+    if [ -f "$name.zvm-args" ] || [ "$program" != "$name.zas" ]; then
+        zvm_args=$(cat "$name.zvm-args" 2> /dev/null)
+        engines=("$ZVM --switch" "$ZVM" "$ZVM --tiered --tier-threshold 0"
+                 "$ZVM --tiered --tier-threshold 1")
+    fi
+
+    if [ "$program" = "$name.hex" ]; then
+        grep -v '^;' "$program" | xxd -r -p > "$WORK/program.zo"
+    else
+        assemble "$program" "$WORK/program.zo"
+    fi
+    for engine in "${engines[@]}"; do
+        local args=
+        [ "${engine#$ZVM}" != "$engine" ] && args=$zvm_args
+        run "$program" $engine $args "$WORK/program.zo" > "$WORK/actual"
+        expect "$program" "${engine##*/}" "$WORK/actual"
+    done
+}
+
+check_objfile() {
+    local program=$1
+    assemble "$program" "$WORK/program.zo"
+    assemble "$program" "$WORK/program.zbin" --raw
+
+    [ "$(head -c 4 "$WORK/program.zo")" = ZVMO ] ||
+        fail "$program: object file without the ZVMO magic"
+    [ "$(head -c 4 "$WORK/program.zbin")" != ZVMO ] ||
+        fail "$program: raw stream with the ZVMO magic"
+
+    for binary in program.zo program.zbin; do
+        for engine in "$ZVM" "$BINTRAN --no-cache"; do
+            run "$program" $engine "$WORK/$binary" > "$WORK/actual"
+            expect "$program" "${engine##*/} on $binary" "$WORK/actual"
+        done
+    done
+
+    # the profile names blocks after the labels of the object file
+    "$BINTRAN" --profile "$WORK/profile" "$WORK/program.zo" \
+        < "$(input_of "$program")" > /dev/null 2>&1
+    grep -q ' START$' "$WORK/profile" ||
+        fail "$program: labels lost in the object file"
+}
+
+check_cache() {
+    local program=$1
+    local other=$2
+    local cache="$WORK/cache"
+    local binary="$WORK/program.zo"
+
+    assemble "$program" "$binary"
+    for pass in miss hit; do
+        run "$program" "$BINTRAN" --cache-dir "$cache" "$binary" \
+            > "$WORK/actual"
+        expect "$program" "cache $pass" "$WORK/actual"
+    done
+    [ "$(ls "$cache" | wc -l)" -eq 1 ] ||
+        fail "$program: expected one cache entry"
+
+    # same path, other contents
+    assemble "$other" "$binary"
+    run "$other" "$BINTRAN" --cache-dir "$cache" "$binary" > "$WORK/actual"
+    expect "$other" "cache after the binary changed" "$WORK/actual"
+    [ "$(ls "$cache" | wc -l)" -eq 2 ] ||
+        fail "$other: expected a second cache entry"
+
+    # put ud2 at the start of the code of every entry, the code offset is
+    # the last field of the header
+    for entry in "$cache"/*; do
+        local offset=$(od -An -t u4 -j 44 -N 4 "$entry")
+        printf '\x0f\x0b\x0f\x0b' |
+            dd of="$entry" bs=1 seek=$offset conv=notrunc 2> /dev/null
+    done
+    run "$other" "$BINTRAN" --cache-dir "$cache" "$binary" > "$WORK/actual"
+    expect "$other" "cache with a corrupt entry" "$WORK/actual"
+}
+
+check_host() {
+    local batch="$WORK/batch"
+    local i=0
+    : > "$batch"
+    for program in "$@"; do
+        # twice, the second job reuses the translation
+        assemble "$program" "$WORK/$i.zo"
+        echo "$WORK/$i.zo $(input_of "$program") $WORK/$i.a.out" >> "$batch"
+        echo "$WORK/$i.zo $(input_of "$program") $WORK/$i.b.out" >> "$batch"
+        i=$((i + 1))
+    done
+
+    "$BINTRAN" --no-cache --threads 4 --batch "$batch" 2> "$WORK/host.log"
+    local status=$?
+    [ $status -eq 0 ] || { cat "$WORK/host.log"; fail "batch exit $status"; }
+    grep -q "$# distinct programs, $# jobs reused" "$WORK/host.log" ||
+        fail "translations not reused: $(tail -n 1 "$WORK/host.log")"
+
+    i=0
+    for program in "$@"; do
+        for job in a b; do
+            { cat "$WORK/$i.$job.out"; echo "exit 0"; } > "$WORK/actual"
+            expect "$program" "batch job $i$job" "$WORK/actual"
+        done
+        i=$((i + 1))
+    done
+
+    # raw values in and out: the values before a 0 doubled
+    printf '%s\n' 'START:' '    PUSH 0' 'LOOP:' '    INPUT' '    STORE 0' \
+        '    LOAD 0' '    EQZ' '    JMC END' '    LOAD 0' '    PUSH 2' \
+        '    MUL' '    OUTPUT' '    JMP LOOP' 'END:' '    HALT' \
+        > "$WORK/double.zas"
+    assemble "$WORK/double.zas" "$WORK/double.zo"
+    printf '\x01\x00\x00\x00\xfd\xff\xff\xff\x00\x00\x01\x00' \
+        > "$WORK/raw.in"
+    printf '\x00\x00\x00\x00' >> "$WORK/raw.in"
+    "$BINTRAN" --no-cache --raw-input "$WORK/raw.in" \
+        --raw-output "$WORK/raw.out" "$WORK/double.zo" ||
+        fail "raw channels: exit $?"
+    local values=$(od -An -t d4 -v "$WORK/raw.out" | tr -s ' \n' ' ')
+    [ "$values" = " 2 -6 131072 " ] || fail "raw channels: got '$values'"
+}
+
+case $CHECK in
+    engines) check_engines "$1" ;;
+    objfile) check_objfile "$1" ;;
+    cache) check_cache "$1" "$2" ;;
+    host) check_host "$@" ;;
+    *) echo "unknown check $CHECK"; exit 2 ;;
+esac
+exit $failed
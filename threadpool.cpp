@@ -0,0 +1,114 @@
+/*!
+ threadpool.cpp - worker threads for data parallel jobs.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "threadpool.hpp"
+
+namespace zvm {
+
+ThreadPool::ThreadPool(std::size_t thread_count)
+    : task_(nullptr),
+      count_(0),
+      next_(0),
+      running_(0),
+      generation_(0),
+      stop_(false),
+      error_index_(0) {
+    if (thread_count == 0)
+        thread_count = std::thread::hardware_concurrency();
+    for (std::size_t i = 1; i < thread_count; i++)
+        workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    start_.notify_all();
+    for (auto& worker: workers_)
+        worker.join();
+}
+
+void ThreadPool::ParallelFor(std::size_t count,
+                             const std::function<void(std::size_t)>& task) {
+    if (count == 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &task;
+        count_ = count;
+        next_ = 0;
+        running_ = workers_.size();
+        error_ = nullptr;
+        generation_++;
+    }
+    start_.notify_all();
+
+    RunTasks();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return running_ == 0; });
+    task_ = nullptr;
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::WorkerLoop() {
+    std::size_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_)
+                return;
+            seen = generation_;
+        }
+
+        RunTasks();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--running_ == 0)
+            done_.notify_one();
+    }
+}
+
+/*!
+ * Takes tasks of the current job until there are none left.
+ */
+void ThreadPool::RunTasks() {
+    while (true) {
+        std::size_t i = next_++;
+        if (i >= count_)
+            return;
+
+        try {
+            (*task_)(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_ || i < error_index_) {
+                error_ = std::current_exception();
+                error_index_ = i;
+            }
+        }
+    }
+}
+
+}  // namespace zvm
@@ -0,0 +1,83 @@
+/*!
+ threadpool.hpp - worker threads for data parallel jobs.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_THREADPOOL_HPP_
+#define ZVM_THREADPOOL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace zvm {
+
+/*!
+ * Fixed set of worker threads running one ParallelFor job at a time.
+ *
+ * The calling thread takes part in every job, so a pool of N threads
+ * starts N - 1 workers and a pool of one runs everything inline.
+ */
+class ThreadPool {
+public:
+    /*!
+     * 'thread_count' 0 means one thread per hardware thread.
+     */
+    explicit ThreadPool(std::size_t thread_count = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    std::size_t ThreadCount() const {
+        return workers_.size() + 1;
+    }
+
+    /*!
+     * Runs task(i) for every i in [0, count) and waits for all of them.
+     * Tasks are taken in index order but may finish in any. If some throw,
+     * the exception of the lowest index is rethrown once all are done.
+     */
+    void ParallelFor(std::size_t count,
+                     const std::function<void(std::size_t)>& task);
+private:
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+
+    // current job, guarded by mutex_ except for the atomics
+    const std::function<void(std::size_t)>* task_;
+    std::size_t count_;
+    std::atomic<std::size_t> next_;
+    std::size_t running_;       // workers inside the current job
+    std::size_t generation_;    // bumped for every job
+    bool stop_;
+
+    std::size_t error_index_;
+    std::exception_ptr error_;
+
+    void WorkerLoop();
+    void RunTasks();
+};
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_THREADPOOL_HPP_ */
@@ -0,0 +1,236 @@
+/*!
+ transcache.cpp - persistent cache of translated programs.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "transcache.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <experimental/filesystem>
+#include <system_error>
+#include <unistd.h>
+
+namespace fs = std::experimental::filesystem;
+
+namespace zvm {
+
+static const char CACHE_MAGIC[4] = { 'Z', 'B', 'T', 'C' };
+static const char* ENTRY_EXTENSION = ".btc";
+
+TranslationCache::TranslationCache(const std::string& dir,
+                                   std::size_t max_size)
+    : dir_(dir),
+      max_size_(max_size) {
+    std::error_code ec;
+    fs::create_directories(dir_, ec);
+}
+
+std::string TranslationCache::DefaultDirectory() {
+    if (const char* dir = std::getenv("ZVM_CACHE_DIR"))
+        return dir;
+    if (const char* dir = std::getenv("XDG_CACHE_HOME"))
+        return std::string(dir) + "/bintran";
+    if (const char* dir = std::getenv("HOME"))
+        return std::string(dir) + "/.cache/bintran";
+    return "";
+}
+
+std::string TranslationCache::EntryPath(std::uint64_t source_hash,
+                                        std::uint64_t config_hash) const {
+    char name[64];
+    std::snprintf(name, sizeof(name), "%016llx-%016llx%s",
+                  (unsigned long long)source_hash,
+                  (unsigned long long)config_hash, ENTRY_EXTENSION);
+    return (fs::path(dir_) / name).string();
+}
+
+inline bool ReadEntry(std::FILE* f, std::uint64_t source_hash,
+                      std::uint64_t config_hash, std::uintmax_t file_size,
+                      CachedTranslation& translation) {
+    TranslationHeader header;
+    if (std::fread(&header, sizeof(header), 1, f) != 1)
+        return false;
+
+    std::uint64_t relocs_end =
+        sizeof(header) + std::uint64_t(header.reloc_count) * sizeof(Relocation);
+    if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        header.version != TranslationCache::FORMAT_VERSION ||
+        header.source_hash != source_hash ||
+        header.config_hash != config_hash ||
+        header.entry >= header.code_size ||
+        header.code_offset % sysconf(_SC_PAGESIZE) != 0 ||
+        header.code_offset < relocs_end ||
+        file_size != std::uint64_t(header.code_offset) + header.code_size)
+        return false;
+
+    translation.code.clear();
+    translation.entry = header.entry;
+    translation.relocations.resize(header.reloc_count);
+    translation.code_offset = header.code_offset;
+    translation.code_hash = header.code_hash;
+    translation.code_size = header.code_size;
+
+    if (header.reloc_count &&
+        std::fread(translation.relocations.data(), sizeof(Relocation),
+                   header.reloc_count, f) != header.reloc_count)
+        return false;
+
+    for (const auto& reloc: translation.relocations) {
+        if (reloc.offset + sizeof(std::int32_t) > header.code_size)
+            return false;
+    }
+    return true;
+}
+
+bool TranslationCache::Load(std::uint64_t source_hash,
+                            std::uint64_t config_hash,
+                            CachedTranslation& translation) {
+    std::string path = EntryPath(source_hash, config_hash);
+    std::error_code ec;
+    std::uintmax_t file_size = fs::file_size(path, ec);
+    if (ec)
+        return false;
+
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+
+    bool valid = ReadEntry(f, source_hash, config_hash, file_size,
+                           translation);
+    std::fclose(f);
+
+    if (!valid) {
+        fs::remove(path, ec);
+        return false;
+    }
+
+    translation.path = path;
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+void TranslationCache::Store(std::uint64_t source_hash,
+                             std::uint64_t config_hash,
+                             const CachedTranslation& translation) {
+    std::size_t page_size = sysconf(_SC_PAGESIZE);
+    std::size_t relocs_end = sizeof(TranslationHeader) +
+        translation.relocations.size() * sizeof(Relocation);
+
+    TranslationHeader header = {};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = FORMAT_VERSION;
+    header.source_hash = source_hash;
+    header.config_hash = config_hash;
+    header.code_hash = HashBytes(translation.code.data(),
+                                 translation.code.size());
+    header.code_size = translation.code.size();
+    header.entry = translation.entry;
+    header.reloc_count = translation.relocations.size();
+    header.code_offset = (relocs_end + page_size - 1) / page_size * page_size;
+
+    // write a private file and rename it, so readers never see a partial one
+    std::string path = EntryPath(source_hash, config_hash);
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    std::FILE* f = std::fopen(tmp_path.c_str(), "wb");
+    if (!f)
+        return;
+
+    std::vector<Byte> padding(header.code_offset - relocs_end);
+    bool written =
+        std::fwrite(&header, sizeof(header), 1, f) == 1 &&
+        std::fwrite(translation.relocations.data(), sizeof(Relocation),
+                    header.reloc_count, f) == header.reloc_count &&
+        std::fwrite(padding.data(), 1, padding.size(), f) == padding.size() &&
+        std::fwrite(translation.code.data(), 1, header.code_size, f) ==
+            header.code_size;
+    written = std::fclose(f) == 0 && written;
+
+    std::error_code ec;
+    if (written)
+        fs::rename(tmp_path, path, ec);
+    if (!written || ec) {
+        fs::remove(tmp_path, ec);
+        return;
+    }
+
+    Evict();
+}
+
+void TranslationCache::Remove(std::uint64_t source_hash,
+                              std::uint64_t config_hash) {
+    std::error_code ec;
+    fs::remove(EntryPath(source_hash, config_hash), ec);
+}
+
+/*!
+ * Removes the least recently used entries until the cache fits.
+ */
+void TranslationCache::Evict() {
+    struct Entry {
+        fs::path path;
+        fs::file_time_type time;
+        std::uintmax_t size;
+    };
+
+    std::vector<Entry> entries;
+    std::uintmax_t total = 0;
+    std::error_code ec;
+    for (const auto& item: fs::directory_iterator(dir_, ec)) {
+        if (item.path().extension() != ENTRY_EXTENSION)
+            continue;
+
+        std::error_code item_ec;
+        Entry entry = { item.path(), fs::last_write_time(item.path(), item_ec),
+                        fs::file_size(item.path(), item_ec) };
+        if (item_ec)
+            continue;
+        total += entry.size;
+        entries.push_back(entry);
+    }
+
+    if (total <= max_size_)
+        return;
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.time < b.time; });
+    for (const auto& entry: entries) {
+        if (total <= max_size_)
+            break;
+        if (fs::remove(entry.path, ec))
+            total -= entry.size;
+    }
+}
+
+std::uint64_t TranslatorBuildHash() {
+    static std::uint64_t hash = 0;
+    if (hash)
+        return hash;
+
+    hash = HashBytes(__DATE__ __TIME__, sizeof(__DATE__ __TIME__));
+    std::FILE* f = std::fopen("/proc/self/exe", "rb");
+    if (!f)
+        return hash;
+
+    Byte buf[1 << 16];
+    std::size_t read = 0;
+    while ((read = std::fread(buf, 1, sizeof(buf), f)) > 0)
+        hash = HashBytes(buf, read, hash);
+    std::fclose(f);
+    return hash;
+}
+
+}  // namespace zvm
@@ -0,0 +1,119 @@
+/*!
+ transcache.hpp - persistent cache of translated programs.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_TRANSCACHE_HPP_
+#define ZVM_TRANSCACHE_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "datatools.hpp"
+
+namespace zvm {
+
+enum RelocationKind {
+    /*!
+     * rel32 displacement to another point of the same code, measured from
+     * the end of the field. It stays valid wherever the code is placed.
+     */
+    RELOC_REL32 = 1
+};
+
+/*!
+ * A field of translated code that refers to another location.
+ */
+struct Relocation {
+    std::uint32_t offset;  // offset of the field from the start of the code
+    std::uint32_t kind;
+};
+
+/*!
+ * Translated program as stored in the cache. Store takes the code in
+ * 'code'; Load leaves it empty and says where it lies in the entry file
+ * instead, so it can be mapped in place.
+ */
+struct CachedTranslation {
+    std::vector<Byte> code;
+    std::uint32_t entry;  // offset of the entry point
+    std::vector<Relocation> relocations;
+
+    std::string path;
+    std::uint64_t code_offset;
+    std::uint64_t code_hash;
+    std::uint32_t code_size;
+};
+
+/*!
+ * Header of a cache entry file. It is followed by 'reloc_count'
+ * relocations and, at the page aligned 'code_offset', 'code_size' bytes
+ * of code.
+ */
+struct TranslationHeader {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t source_hash;  // hash of the ZVM binary
+    std::uint64_t config_hash;  // hash of the translator build and options
+    std::uint64_t code_hash;    // hash of the code, catches corrupt files
+    std::uint32_t code_size;
+    std::uint32_t entry;
+    std::uint32_t reloc_count;
+    std::uint32_t code_offset;
+};
+
+/*!
+ * Directory of translated programs keyed by the hash of the source binary
+ * and of the translator configuration.
+ *
+ * Entries whose header fails validation are treated as misses and deleted;
+ * checking the code against its hash is left to whoever maps it. Every
+ * hit refreshes the entry's modification time, and storing evicts the
+ * least recently used entries until the directory fits in 'max_size'.
+ * The cache is best effort: IO failures never propagate to the caller.
+ */
+class TranslationCache {
+public:
+    explicit TranslationCache(const std::string& dir,
+                              std::size_t max_size = DEFAULT_MAX_SIZE);
+
+    bool Load(std::uint64_t source_hash, std::uint64_t config_hash,
+              CachedTranslation& translation);
+    void Store(std::uint64_t source_hash, std::uint64_t config_hash,
+               const CachedTranslation& translation);
+    void Remove(std::uint64_t source_hash, std::uint64_t config_hash);
+
+    static std::string DefaultDirectory();
+
+    const static std::size_t DEFAULT_MAX_SIZE = std::size_t(64) << 20;
+    const static std::uint32_t FORMAT_VERSION = 2;
+private:
+    std::string dir_;
+    std::size_t max_size_;
+
+    std::string EntryPath(std::uint64_t source_hash,
+                          std::uint64_t config_hash) const;
+    void Evict();
+};
+
+/*!
+ * Hash of the running translator executable, so translations made by a
+ * different build are never reused.
+ */
+std::uint64_t TranslatorBuildHash();
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_TRANSCACHE_HPP_ */
@@ -18,10 +18,130 @@
 #ifndef ZVM_X86_ARCH_H_
 #define ZVM_X86_ARCH_H_
 
-#include "bintran.hpp"
+#include <vector>
+#include "zvmarch.hpp"
 
 namespace zvm {
 
+enum DataLocation {
+    DATALOC_NONE,
+    DATALOC_STACK,
+    DATALOC_RAX,
+    DATALOC_RBX,
+    DATALOC_RCX,
+    DATALOC_RDX,
+    DATALOC_RSI,
+    DATALOC_RDI,
+    DATALOC_R8,
+    DATALOC_R9,
+    DATALOC_R10,
+    DATALOC_R11,
+    DATALOC_R14,
+    DATALOC_IMM,
+    DATALOC_STDIN,
+    DATALOC_STDOUT
+};
+
+/*!
+ * x86-64 general purpose registers, numbered as in instruction encoding.
+ */
+enum X86Register {
+    X86_RAX = 0,
+    X86_RCX = 1,
+    X86_RDX = 2,
+    X86_RBX = 3,
+    X86_RSP = 4,
+    X86_RBP = 5,
+    X86_RSI = 6,
+    X86_RDI = 7,
+    X86_R8 = 8,
+    X86_R9 = 9,
+    X86_R10 = 10,
+    X86_R11 = 11,
+    X86_R12 = 12,
+    X86_R13 = 13,
+    X86_R14 = 14,
+    X86_R15 = 15
+};
+
+/*!
+ * Register conventions of translated code:
+ *   rsp - top of the ZVM stack, which lives in a Sandbox
+ *   r15 - address of ZVM stack slot 0, slot i is at [r15 - 8 * i]
+ *   r14 - io::Runtime of the program
+ *   r13 - host rsp on entry, restored by HALT (tier code: by its epilogue);
+ *         calls to the host run below it
+ *   r12 - top of the stack of CALL return addresses (x86 addresses; ZVM
+ *         addresses in tier code)
+ *   rbp - top of the stack of values saved by PUSHBP
+ *   rax, rdx - scratch
+ * The remaining registers form the allocation pool of RegisterStack.
+ */
+X86Register LocationRegister(DataLocation loc);
+
+/*!
+ * Maps the top of the ZVM data stack onto registers within a basic block.
+ *
+ * The ZVM stack is kept as a memory part (the native stack, growing from
+ * r15 down) with a cached part on top of it that lives in registers. New
+ * values get a free register; when none is left the bottom-most cached
+ * value is spilled with a push, which keeps the memory part contiguous.
+ * Flush() pushes all cached values, which is required at block boundaries
+ * and before any call, so every block starts and ends with the whole
+ * stack in memory.
+ */
+class RegisterStack {
+public:
+    RegisterStack();
+
+    /*!
+     * Starts a block. 'height' is the ZVM stack depth at block entry, or
+     * -1 if it isn't known statically.
+     */
+    void Reset(int height);
+
+    /*!
+     * Allocates a register for a new top of stack, preferring 'hint'.
+     */
+    DataLocation Push(Byte*& ptr, DataLocation hint = DATALOC_NONE);
+
+    /*!
+     * Pops the top of stack into a register and returns it. The register
+     * stays valid until EndInstr().
+     */
+    DataLocation Pop(Byte*& ptr);
+
+    /*!
+     * Releases registers of values popped by the current instruction.
+     */
+    void EndInstr();
+
+    void Flush(Byte*& ptr);
+
+    /*!
+     * Location of absolute stack slot 'index': a register, DATALOC_STACK
+     * for memory, or DATALOC_NONE if the stack height is unknown.
+     */
+    DataLocation SlotLocation(Data index) const;
+
+    int Height() const {
+        return height_;
+    }
+
+    /*!
+     * Registers holding live values, bit per X86Register.
+     */
+    unsigned BusyRegisters() const {
+        return busy_;
+    }
+private:
+    std::vector<DataLocation> cached_;  // bottom to top
+    std::vector<DataLocation> popped_;
+    unsigned busy_;                     // bit per X86Register
+    int height_;
+
+    DataLocation AllocRegister(Byte*& ptr, DataLocation hint);
+};
 
 }  // namespace zvm
 
@@ -0,0 +1,423 @@
+/*!
+ x86encoder.hpp - encoder of the x86-64 instructions bintran emits.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef ZVM_X86_ENCODER_HPP_
+#define ZVM_X86_ENCODER_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include "datatools.hpp"
+#include "x86arch.hpp"
+
+namespace zvm {
+
+/*!
+ * Operand size. ZVM values are 32-bit, pointers 64-bit.
+ */
+enum X86Size {
+    X86_DWORD = 0,
+    X86_QWORD = 1
+};
+
+/*!
+ * Memory operand [base + disp].
+ */
+struct X86Mem {
+    X86Register base;
+    std::int32_t disp;
+};
+
+constexpr X86Mem Mem(X86Register base, std::int32_t disp = 0) {
+    return { base, disp };
+}
+
+/*!
+ * Condition codes, the low nibble of jCC and setCC.
+ */
+enum X86Condition {
+    X86_CC_B = 0x2,
+    X86_CC_AE = 0x3,
+    X86_CC_E = 0x4,
+    X86_CC_NE = 0x5,
+    X86_CC_L = 0xC,
+    X86_CC_GE = 0xD,
+    X86_CC_LE = 0xE,
+    X86_CC_G = 0xF
+};
+
+/*!
+ * Arithmetic group, numbered as the /ext field of its immediate forms.
+ * 'op r/m, reg' is encoded as ext * 8 + 1, 'op reg, r/m' as ext * 8 + 3.
+ */
+enum X86AluOp {
+    X86_ADD = 0,
+    X86_OR = 1,
+    X86_AND = 4,
+    X86_SUB = 5,
+    X86_XOR = 6,
+    X86_CMP = 7
+};
+
+constexpr bool FitsInt8(std::int64_t value) {
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+constexpr Byte Rex(X86Size size, int reg, int index, int base) {
+    return Byte(0x40 | (size << 3) | ((reg >> 3) << 2) |
+                ((index >> 3) << 1) | (base >> 3));
+}
+
+constexpr Byte ModRm(int mod, int reg, int rm) {
+    return Byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+constexpr Byte Sib(int scale, int index, int base) {
+    return Byte((scale << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+static_assert(Rex(X86_QWORD, X86_R9, 0, X86_RAX) == 0x4C &&
+              ModRm(3, X86_R9, X86_RAX) == 0xC8,
+              "mov rax, r9 must encode as 4C 89 C8");
+static_assert(Rex(X86_QWORD, X86_RAX, 0, X86_R12) == 0x49 &&
+              Sib(0, X86_RSP, X86_R12) == 0x24,
+              "mov [r12], rax must encode as 49 89 04 24");
+
+// building blocks
+
+inline void EmitRex(Byte*& ptr, X86Size size, int reg, int base) {
+    Byte rex = Rex(size, reg, 0, base);
+    if (rex != 0x40)
+        EmitAndShiftBuf(ptr, rex);
+}
+
+inline void EmitOpcode(Byte*& ptr, std::initializer_list<Byte> opcode) {
+    for (Byte byte: opcode)
+        EmitAndShiftBuf(ptr, byte);
+}
+
+/*!
+ * ModRM of a register operand 'rm'; 'reg' is a register or an /ext.
+ */
+inline void EmitRegOperand(Byte*& ptr, int reg, X86Register rm) {
+    EmitAndShiftBuf(ptr, ModRm(3, reg, rm));
+}
+
+/*!
+ * ModRM, SIB and displacement of 'mem' in the shortest form: no
+ * displacement if it's 0 and the base allows it, disp8 if it fits.
+ */
+inline void EmitMemOperand(Byte*& ptr, int reg, X86Mem mem) {
+    bool sib = (mem.base & 7) == X86_RSP;
+    int mod = 2;
+    if (mem.disp == 0 && (mem.base & 7) != X86_RBP)
+        mod = 0;
+    else if (FitsInt8(mem.disp))
+        mod = 1;
+
+    EmitAndShiftBuf(ptr, ModRm(mod, reg, sib ? X86_RSP : mem.base));
+    if (sib)
+        EmitAndShiftBuf(ptr, Sib(0, X86_RSP, mem.base));
+    if (mod == 1)
+        EmitAndShiftBuf(ptr, std::int8_t(mem.disp));
+    else if (mod == 2)
+        EmitAndShiftBuf(ptr, mem.disp);
+}
+
+/*!
+ * 'opcode reg, rm' with two register operands.
+ */
+inline void EmitRegReg(Byte*& ptr, X86Size size,
+                       std::initializer_list<Byte> opcode, int reg,
+                       X86Register rm) {
+    EmitRex(ptr, size, reg, rm);
+    EmitOpcode(ptr, opcode);
+    EmitRegOperand(ptr, reg, rm);
+}
+
+/*!
+ * 'opcode reg, mem' with a memory operand.
+ */
+inline void EmitRegMem(Byte*& ptr, X86Size size,
+                       std::initializer_list<Byte> opcode, int reg,
+                       X86Mem mem) {
+    EmitRex(ptr, size, reg, mem.base);
+    EmitOpcode(ptr, opcode);
+    EmitMemOperand(ptr, reg, mem);
+}
+
+// data movement
+
+inline void EmitMov(Byte*& ptr, X86Size size, X86Register dst,
+                    X86Register src) {
+    if (dst != src)
+        EmitRegReg(ptr, size, { 0x89 }, src, dst);
+}
+
+/*!
+ * Loads a 32-bit constant. Zero is loaded with xor, which clobbers the
+ * flags.
+ */
+inline void EmitMovImm(Byte*& ptr, X86Register dst, Data imm) {
+    if (imm == 0) {
+        EmitRegReg(ptr, X86_DWORD, { 0x31 }, dst, dst);  // xor dst, dst
+        return;
+    }
+    EmitRex(ptr, X86_DWORD, 0, dst);
+    EmitAndShiftBuf(ptr, Byte(0xB8 + (dst & 7)));
+    EmitAndShiftBuf(ptr, imm);
+}
+
+inline void EmitMovImm64(Byte*& ptr, X86Register dst, std::uint64_t imm) {
+    EmitRex(ptr, X86_QWORD, 0, dst);
+    EmitAndShiftBuf(ptr, Byte(0xB8 + (dst & 7)));
+    EmitAndShiftBuf(ptr, imm);
+}
+
+inline void EmitLoad(Byte*& ptr, X86Size size, X86Register dst, X86Mem src) {
+    EmitRegMem(ptr, size, { 0x8B }, dst, src);
+}
+
+inline void EmitStore(Byte*& ptr, X86Size size, X86Mem dst, X86Register src) {
+    EmitRegMem(ptr, size, { 0x89 }, src, dst);
+}
+
+/*!
+ * mov dst, [base + index * 8]. 'base' can't be rbp or r13, which have no
+ * form without a displacement here, nor can 'index' be rsp.
+ */
+inline void EmitLoadIndexed(Byte*& ptr, X86Register dst, X86Register base,
+                            X86Register index) {
+    EmitAndShiftBuf(ptr, Rex(X86_QWORD, dst, index, base));
+    EmitOpcode(ptr, { 0x8B });
+    EmitAndShiftBuf(ptr, ModRm(0, dst, X86_RSP));
+    EmitAndShiftBuf(ptr, Sib(3, index, base));
+}
+
+inline void EmitStoreImm(Byte*& ptr, X86Mem dst, Data imm) {
+    EmitRegMem(ptr, X86_DWORD, { 0xC7 }, 0, dst);
+    EmitAndShiftBuf(ptr, imm);
+}
+
+inline void EmitLea(Byte*& ptr, X86Register dst, X86Mem src) {
+    EmitRegMem(ptr, X86_QWORD, { 0x8D }, dst, src);
+}
+
+/*!
+ * lea dst, [rip + disp32]. Returns the end of the instruction, the
+ * displacement is patched with PatchRel32.
+ */
+inline Byte* EmitLeaRip(Byte*& ptr, X86Register dst) {
+    EmitRex(ptr, X86_QWORD, dst, 0);
+    EmitAndShiftBuf(ptr, Byte(0x8D));
+    EmitAndShiftBuf(ptr, ModRm(0, dst, X86_RBP));
+    EmitAndShiftBuf(ptr, std::int32_t(0));
+    return ptr;
+}
+
+inline void EmitPush(Byte*& ptr, X86Register reg) {
+    EmitRex(ptr, X86_DWORD, 0, reg);
+    EmitAndShiftBuf(ptr, Byte(0x50 + (reg & 7)));
+}
+
+inline void EmitPop(Byte*& ptr, X86Register reg) {
+    EmitRex(ptr, X86_DWORD, 0, reg);
+    EmitAndShiftBuf(ptr, Byte(0x58 + (reg & 7)));
+}
+
+/*!
+ * Pushes a sign-extended 32-bit constant.
+ */
+inline void EmitPushImm(Byte*& ptr, Data imm) {
+    if (FitsInt8(imm)) {
+        EmitAndShiftBuf(ptr, Byte(0x6A));
+        EmitAndShiftBuf(ptr, std::int8_t(imm));
+    } else {
+        EmitAndShiftBuf(ptr, Byte(0x68));
+        EmitAndShiftBuf(ptr, imm);
+    }
+}
+
+// arithmetic
+
+inline void EmitAlu(Byte*& ptr, X86AluOp op, X86Size size, X86Register dst,
+                    X86Register src) {
+    EmitRegReg(ptr, size, { Byte(op * 8 + 1) }, src, dst);
+}
+
+/*!
+ * 'op reg, imm' with an imm8 if the constant fits.
+ */
+inline void EmitAluImm(Byte*& ptr, X86AluOp op, X86Size size, X86Register reg,
+                       Data imm) {
+    if (FitsInt8(imm)) {
+        EmitRegReg(ptr, size, { 0x83 }, op, reg);
+        EmitAndShiftBuf(ptr, std::int8_t(imm));
+    } else {
+        EmitRegReg(ptr, size, { 0x81 }, op, reg);
+        EmitAndShiftBuf(ptr, imm);
+    }
+}
+
+inline void EmitAluLoad(Byte*& ptr, X86AluOp op, X86Size size,
+                        X86Register dst, X86Mem src) {
+    EmitRegMem(ptr, size, { Byte(op * 8 + 3) }, dst, src);
+}
+
+inline void EmitTest(Byte*& ptr, X86Size size, X86Register a, X86Register b) {
+    EmitRegReg(ptr, size, { 0x85 }, b, a);
+}
+
+inline void EmitImul(Byte*& ptr, X86Register dst, X86Register src) {
+    EmitRegReg(ptr, X86_DWORD, { 0x0F, 0xAF }, dst, src);
+}
+
+/*!
+ * imul dst, src, imm with an imm8 if the constant fits.
+ */
+inline void EmitImulImm(Byte*& ptr, X86Register dst, X86Register src,
+                        Data imm) {
+    if (FitsInt8(imm)) {
+        EmitRegReg(ptr, X86_DWORD, { 0x6B }, dst, src);
+        EmitAndShiftBuf(ptr, std::int8_t(imm));
+    } else {
+        EmitRegReg(ptr, X86_DWORD, { 0x69 }, dst, src);
+        EmitAndShiftBuf(ptr, imm);
+    }
+}
+
+inline void EmitIncMem(Byte*& ptr, X86Size size, X86Mem mem) {
+    EmitRegMem(ptr, size, { 0xFF }, 0, mem);
+}
+
+inline void EmitNeg(Byte*& ptr, X86Register reg) {
+    EmitRegReg(ptr, X86_DWORD, { 0xF7 }, 3, reg);
+}
+
+/*!
+ * cdq; idiv divisor: edx:eax / divisor, quotient in eax.
+ */
+inline void EmitIdiv(Byte*& ptr, X86Register divisor) {
+    EmitAndShiftBuf(ptr, Byte(0x99));
+    EmitRegReg(ptr, X86_DWORD, { 0xF7 }, 7, divisor);
+}
+
+/*!
+ * setCC dst8; movzx dst, dst8. Registers 4-7 need a REX prefix to name
+ * their low byte.
+ */
+inline void EmitSetcc(Byte*& ptr, X86Condition cc, X86Register dst) {
+    Byte rex = Rex(X86_DWORD, 0, 0, dst);
+    if (rex != 0x40 || (dst >= X86_RSP && dst <= X86_RDI))
+        EmitAndShiftBuf(ptr, rex);
+    EmitOpcode(ptr, { 0x0F, Byte(0x90 | cc) });
+    EmitRegOperand(ptr, 0, dst);
+
+    rex = Rex(X86_DWORD, dst, 0, dst);
+    if (rex != 0x40 || (dst >= X86_RSP && dst <= X86_RDI))
+        EmitAndShiftBuf(ptr, rex);
+    EmitOpcode(ptr, { 0x0F, 0xB6 });
+    EmitRegOperand(ptr, dst, dst);
+}
+
+// control flow
+
+inline void EmitCallReg(Byte*& ptr, X86Register func) {
+    EmitRegReg(ptr, X86_DWORD, { 0xFF }, 2, func);
+}
+
+inline void EmitJmpReg(Byte*& ptr, X86Register target) {
+    EmitRegReg(ptr, X86_DWORD, { 0xFF }, 4, target);
+}
+
+inline void EmitRet(Byte*& ptr) {
+    EmitAndShiftBuf(ptr, Byte(0xC3));
+}
+
+/*!
+ * Jumps with a zero rel32 placeholder as their last field, to be patched
+ * with PatchRel32 once the target is known.
+ */
+inline void EmitJmp32(Byte*& ptr) {
+    EmitAndShiftBuf(ptr, Byte(0xE9));
+    EmitAndShiftBuf(ptr, std::int32_t(0));
+}
+
+inline void EmitJcc32(Byte*& ptr, X86Condition cc) {
+    EmitOpcode(ptr, { 0x0F, Byte(0x80 | cc) });
+    EmitAndShiftBuf(ptr, std::int32_t(0));
+}
+
+/*!
+ * Short jumps over code emitted right after them, patched with
+ * PatchRel8. Return the end of the jump.
+ */
+inline Byte* EmitJmp8(Byte*& ptr) {
+    EmitOpcode(ptr, { 0xEB, 0x00 });
+    return ptr;
+}
+
+inline Byte* EmitJcc8(Byte*& ptr, X86Condition cc) {
+    EmitOpcode(ptr, { Byte(0x70 | cc), 0x00 });
+    return ptr;
+}
+
+/*!
+ * Fills 'size' bytes with the recommended multi-byte nops, at most nine
+ * bytes each.
+ */
+inline void EmitNop(Byte*& ptr, std::size_t size) {
+    static const Byte NOPS[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0F, 0x1F, 0x00 },
+        { 0x0F, 0x1F, 0x40, 0x00 },
+        { 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 }
+    };
+    while (size > 0) {
+        std::size_t length = size < 9 ? size : 9;
+        for (std::size_t i = 0; i < length; i++)
+            EmitAndShiftBuf(ptr, NOPS[length - 1][i]);
+        size -= length;
+    }
+}
+
+/*!
+ * Makes the rel8 ending at 'end' lead to 'dest'.
+ */
+inline void PatchRel8(Byte* end, const Byte* dest) {
+    std::ptrdiff_t distance = dest - end;
+    if (!FitsInt8(distance))
+        throw std::logic_error("short jump out of range");
+    end[-1] = Byte(std::int8_t(distance));
+}
+
+/*!
+ * Makes the rel32 ending at 'end' lead to 'dest'.
+ */
+inline void PatchRel32(Byte* end, const Byte* dest) {
+    *(std::int32_t*)(end - sizeof(std::int32_t)) = std::int32_t(dest - end);
+}
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_X86_ENCODER_HPP_ */
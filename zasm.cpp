@@ -15,22 +15,25 @@
  limitations under the License.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <cstring>
 #include <cctype>
 #include <map>
-#include <experimental/filesystem>
+#include <vector>
 #include "exceptions.hpp"
 #include "zvmarch.hpp"
 #include "datatools.hpp"
-
-namespace fs = std::experimental::filesystem;
+#include "io.hpp"
+#include "objfile.hpp"
 
 namespace zvm {
 
 static const char COMMENT_SYMBOL = ';';
 static const char LABEL_SUFFIX = ':';
+static const char DATA_DIRECTIVE[] = ".data";
 
 class Asm {
 public:
@@ -39,12 +42,17 @@ public:
     void LoadSource(const std::string& filename);
     void Assemble();
     void WriteBinaryToFile(const std::string& filename);
+    void WriteObjectToFile(const std::string& filename);
 private:
     std::string source_filename_;
+    io::MappedFile source_file_;
     std::size_t source_size_;
-    char* source_;
+    const char* source_;
     Byte* output_buf_;
     std::size_t output_buf_size_;
+    std::map<std::string, std::size_t> labels_;
+    std::vector<std::size_t> jump_targets_;
+    std::vector<Data> data_;
 };
 
 Asm::Asm(): source_size_(0),
@@ -53,41 +61,25 @@ Asm::Asm(): source_size_(0),
             output_buf_size_(0) {}
 
 Asm::~Asm() {
-    delete[] source_;
     delete[] output_buf_;
 }
 
 void Asm::LoadSource(const std::string& filename) {
-    if (!fs::exists(filename))
-        throw IoException(filename, ERR_FILE_DOESNT_EXIST);
-
-    if (source_)
-        delete[] source_;
     source_filename_ = filename;
 
-    std::size_t filesize = fs::file_size(filename);
-
-    std::FILE* f = std::fopen(filename.c_str(), "r");
-    if (!f)
-        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
-
-    source_ = new char[filesize + 1]();
-    if (!source_)
-        throw AllocException();
-
-    std::fread(source_, sizeof(*source_), filesize, f);
-
-    std::fclose(f);
-
-    source_size_ = filesize; // may cause extra bytes on Windows
+    // the parser relies on a NUL terminator
+    source_file_.Open(filename, 1);
+    source_file_.AdviseSequential();
+    source_ = (const char*)source_file_.Bytes();
+    source_size_ = source_file_.Size();
 }
 
-inline void SkipSpaces(char*& current) {
+inline void SkipSpaces(const char*& current) {
     while (std::isspace(*current))
         current++;
 }
 
-inline void SkipComment(char*& current) {
+inline void SkipComment(const char*& current) {
     SkipSpaces(current);
     while (*current == COMMENT_SYMBOL) {
         current = strchrnul(current, '\n');
@@ -95,6 +87,22 @@ inline void SkipComment(char*& current) {
     }
 }
 
+/*!
+ * Copies the word at 'current' into 'word' (at most 'max_size' chars) and
+ * returns its length in the source. Unlike sscanf("%s") this doesn't
+ * measure the whole rest of the source on every call.
+ */
+inline int ReadWord(const char* current, char* word, std::size_t max_size) {
+    const char* end = current;
+    while (*end && !std::isspace(*end))
+        end++;
+
+    std::size_t length = std::min(std::size_t(end - current), max_size);
+    std::memcpy(word, current, length);
+    word[length] = '\0';
+    return end - current;
+}
+
 inline std::size_t GetLineNum(const char* current) {
     // TODO: return line number
     return 0;
@@ -108,14 +116,13 @@ void Asm::Assemble() {
     const std::size_t MAX_WORD_SIZE = 256;
 
     char curword[MAX_WORD_SIZE + 1] = {};
-    char* current = source_;
+    const char* current = source_;
 
     output_buf_ = new Byte[MAX_INSTRUCTION_SIZE * source_size_]();
     if (!output_buf_)
         throw AllocException();
     Byte* cur_outptr = output_buf_;
 
-    std::map<std::string, std::size_t> labels;
     std::multimap<std::size_t, std::string> label_patches;
 
     while (true) {
@@ -123,23 +130,39 @@ void Asm::Assemble() {
 
         SkipSpaces(current);
         SkipComment(current);
-        std::sscanf(current, "%s%n", curword, &wordlen);
+        wordlen = ReadWord(current, curword, MAX_WORD_SIZE);
 
         if (wordlen == 0) {
             break;
         }
         current += wordlen;
 
-        if (curword[wordlen - 1] == LABEL_SUFFIX) {
-            curword[wordlen - 1] = '\0';
-            if (labels.find(curword) != labels.end()) {
+        std::size_t wordsize = std::strlen(curword);
+        if (curword[wordsize - 1] == LABEL_SUFFIX) {
+            curword[wordsize - 1] = '\0';
+            if (labels_.find(curword) != labels_.end()) {
                 throw SyntaxError(source_filename_,
                                   GetLineNum(current),
                                   ERR_SYNTAX_LABEL_REDEF,
                                   curword);
             }
 
-            labels[curword] = cur_outptr - output_buf_;
+            labels_[curword] = cur_outptr - output_buf_;
+            continue;
+        }
+
+        // .data V appends V to the initial data stack
+        if (strcasecmp(curword, DATA_DIRECTIVE) == 0) {
+            SkipSpaces(current);
+            char* end = nullptr;
+            Data value = Data(std::strtol(current, &end, 10));
+            if (end == current)
+                throw SyntaxError(source_filename_,
+                                  GetLineNum(current),
+                                  ERR_SYNTAX_WRONG_INSTR_ARGS,
+                                  DATA_DIRECTIVE);
+            current = end;
+            data_.push_back(value);
             continue;
         }
 
@@ -187,19 +210,22 @@ void Asm::Assemble() {
             // 1 arg instructions
             case OPCODE_PUSH:
             case OPCODE_LOAD:
-            case OPCODE_STORE:
-                if (std::sscanf(current, "%d%n", &arg, &wordlen) == 0)
+            case OPCODE_STORE: {
+                char* end = nullptr;
+                arg = Data(std::strtol(current, &end, 10));
+                if (end == current)
                     throw SyntaxError(source_filename_,
                                       GetLineNum(current),
                                       ERR_SYNTAX_WRONG_INSTR_ARGS,
                                       "opcode " + std::to_string(opcode));
-                current += wordlen;
+                current = end;
                 EmitAndShiftBuf(cur_outptr, arg);
                 break;
+            }
             case OPCODE_JMP:
             case OPCODE_JMC:
             case OPCODE_CALL:
-                std::sscanf(current, "%s%n", curword, &wordlen);
+                wordlen = ReadWord(current, curword, MAX_WORD_SIZE);
                 if (wordlen == 0)
                     throw SyntaxError(source_filename_,
                                       GetLineNum(current),
@@ -219,13 +245,14 @@ void Asm::Assemble() {
 
     output_buf_size_ = cur_outptr - output_buf_;
     for (auto it = label_patches.begin(); it != label_patches.end(); ++it) {
-        if (labels.find(it->second) == labels.end())
+        if (labels_.find(it->second) == labels_.end())
             throw SyntaxError(source_filename_,
                               GetLineNum(current),
                               ERR_SYNTAX_UNDEFINED_LABEL,
                               it->second);
         else
-            EmitAt(output_buf_, (int)labels[it->second], it->first);
+            EmitAt(output_buf_, (int)labels_[it->second], it->first);
+        jump_targets_.push_back(labels_[it->second]);
     }
 }
 #undef COMPARE_INSTR
@@ -240,25 +267,42 @@ void Asm::WriteBinaryToFile(const std::string& filename) {
     fclose(f);
 }
 
+void Asm::WriteObjectToFile(const std::string& filename) {
+    ObjectWriter writer;
+    writer.SetCode(output_buf_, output_buf_size_);
+    for (const auto& label: labels_)
+        writer.AddSymbol(label.first, label.second);
+    for (std::size_t target: jump_targets_)
+        writer.AddJumpTarget(target);
+    for (Data value: data_)
+        writer.AddData(value);
+    writer.Write(filename);
+}
+
 }  // namespace zvm
 
 inline void DisplayUsage() {
-    std::printf("Usage: zasm SOURCE OUTPUT\n");
+    std::printf("Usage: zasm [--raw] SOURCE OUTPUT\n");
 }
 
 int main(int argc, char* argv[]) {
     using namespace zvm;
 
-    if (argc != 3) {
+    // --raw writes a headerless instruction stream for older loaders
+    bool raw = argc == 4 && std::strcmp(argv[1], "--raw") == 0;
+    if (argc != 3 && !raw) {
         DisplayUsage();
         return ERR_WRONG_CMD_LINE_ARGS;
     }
 
     try {
         Asm zasm;
-        zasm.LoadSource(argv[1]);
+        zasm.LoadSource(argv[argc - 2]);
         zasm.Assemble();
-        zasm.WriteBinaryToFile(argv[2]);
+        if (raw)
+            zasm.WriteBinaryToFile(argv[argc - 1]);
+        else
+            zasm.WriteObjectToFile(argv[argc - 1]);
     } catch (const IoException& ioerr) {
         std::fprintf(stderr, "IO error: %s\n", ioerr.what());
         return ioerr.GetErrorCode();
@@ -15,83 +15,78 @@
  limitations under the License.
 */
 
-#include <stack>
-#include <vector>
-#include <string>
-#include <experimental/filesystem>
+#include "zvm.hpp"
+#include <algorithm>
+#include <cstdlib>
 #include "exceptions.hpp"
-#include "zvmarch.hpp"
 #include "datatools.hpp"
 
-namespace fs = std::experimental::filesystem;
-
 namespace zvm {
 
-class Zvm {
-public:
-    Zvm();
-    ~Zvm();
-
-    void LoadBinary(const std::string& filename);
-    void Run();
-private:
-    Byte* program_memory_;
-    std::size_t program_size_;
-    std::vector<Data> data_stack_;
-    std::stack<Register> call_stack_;
-    std::stack<Register> bp_stack_;
-
-    Register pc_;
-    Register sp_;
-    Register bp_;
-
-    bool halt_flag_;
-
-    void Execute(Opcode opcode, Data arg);
-    void Push(Data val);
-    Data Pop();
-    void PushBp();
-    void PopBp();
-    void PushAddr(Register val);
-    Register PopAddr();
-};
-
-Zvm::Zvm(): program_memory_(nullptr),
-            program_size_(0),
-            pc_(0),
-            sp_(0),
-            bp_(0),
-            halt_flag_(false) {}
-
-Zvm::~Zvm() {
-    delete program_memory_;
+/*!
+ * Distance between consecutive data stack slots in the sandbox, in Data
+ * units: slot i is the low half of the 8-byte word at Slot0() - i.
+ */
+const std::ptrdiff_t SANDBOX_STRIDE =
+    -std::ptrdiff_t(sizeof(std::uint64_t) / sizeof(Data));
+
+/*!
+ * Data stack slot 0 in the sandbox, as the interpreter addresses it.
+ */
+inline Data* SandboxSlots(const Sandbox& sandbox) {
+    return (Data*)sandbox.Slot0();
 }
 
-void Zvm::LoadBinary(const std::string& filename) {
-    if (!fs::exists(filename))
-        throw IoException(filename, ERR_FILE_DOESNT_EXIST);
-
-    if (program_memory_)
-        delete[] program_memory_;
-
-    std::size_t filesize = fs::file_size(filename);
-    std::FILE* f = std::fopen(filename.c_str(), "rb");
-    if (!f)
-        throw IoException(filename, ERR_FILE_OPEN_FAILURE);
-
-    program_memory_ = new Byte[filesize]();
-    if (!program_memory_)
-        throw AllocException();
+Zvm::Zvm(std::size_t data_stack_size, std::size_t call_stack_size,
+         int input_fd, int output_fd)
+    : program_memory_(nullptr),
+      program_size_(0),
+      data_stack_(data_stack_size, "data stack"),
+      call_stack_(call_stack_size, "call stack"),
+      bp_stack_(call_stack_size, "bp stack"),
+      reader_(input_fd),
+      writer_(output_fd),
+      text_input_(reader_),
+      text_output_(writer_),
+      pc_(0),
+      bp_(0),
+      halt_flag_(false),
+      tiered_(false),
+      tier_threshold_(TIER_THRESHOLD) {
+    reader_.Tie(&writer_);
+}
 
-    std::fread(program_memory_, sizeof(*program_memory_), filesize, f);
+Zvm::~Zvm() {}
 
-    std::fclose(f);
-    program_size_ = filesize;
+void Zvm::LoadBinary(const std::string& filename) {
+    program_.Load(filename);
+    program_memory_ = program_.Code();
+    program_size_ = program_.CodeSize();
 }
 
-void Zvm::Run() {
-    pc_ = sp_ = bp_ = 0;
+void Zvm::Run(DispatchMode mode) {
+    pc_ = bp_ = 0;
+    halt_flag_ = false;
+    data_stack_.Clear();
+    call_stack_.Clear();
+    bp_stack_.Clear();
+    for (std::size_t i = 0; i < program_.DataSize(); i++)
+        Push(program_.InitialData()[i]);
+
+    tiered_ = mode == DISPATCH_TIERED;
+    if (tiered_)
+        InitTier();
+
+    if (mode == DISPATCH_SWITCH)
+        RunSwitch();
+    else if (tiered_)
+        RunThreaded<true>();
+    else
+        RunThreaded<false>();
+    writer_.Flush();
+}
 
+void Zvm::RunSwitch() {
     while (!halt_flag_) {
         if (pc_ >= program_size_)
             throw OutOfBoundsException("PC out of bounds");
@@ -101,6 +96,379 @@ void Zvm::Run() {
     }
 }
 
+/*!
+ * Decodes the whole program once. Every instruction becomes a handler
+ * address plus operand.
+ *
+ * The program is split into check regions: basic blocks, additionally cut
+ * after INPUT and OUTPUT so that stack errors are never reported before
+ * output that precedes them. Each region starts with a check entry that
+ * validates the data stack depth for the whole region, which lets the
+ * instruction handlers push and pop without bounds checks. A region that
+ * fails the check is run by RunSwitch instead, so an earlier fault in it,
+ * a division by zero say, is the one reported.
+ *
+ * A trap entry reached by falling off the end of the program is appended,
+ * and an entry for each jump into the program that doesn't land on an
+ * instruction boundary: it hands over to RunSwitch, which decodes the
+ * program from there. Jumps and calls out of the program trap where they
+ * are, taken or not.
+ *
+ * In tiered mode check entries also count block executions, and HALT,
+ * which tier code exits in front of, and every block start tier code may
+ * jump out to begin regions, so execution always comes back from native
+ * code at a check entry.
+ */
+void Zvm::Predecode(const ThreadedHandlers& handlers) {
+    struct Decoded {
+        Register addr;
+        DecodedInstr instr;
+        bool leader;
+    };
+    std::vector<Decoded> decoded;
+
+    addr_to_index_.assign(program_size_, -1);
+
+    decoded.reserve(program_.InstrCount());
+    for (std::size_t i = 0; i < program_.InstrCount(); i++) {
+        Register addr = program_.InstrAddr(i);
+        Register pc = addr;
+        DecodedInstr instr = FetchInstr(program_memory_, pc);
+
+        addr_to_index_[addr] = decoded.size();
+        decoded.push_back({ addr, instr, decoded.empty() });
+    }
+
+    // find region leaders
+    for (std::size_t i = 0; i < decoded.size(); i++) {
+        Opcode opcode = decoded[i].instr.opcode;
+        Data target = decoded[i].instr.args[0];
+
+        if ((opcode == OPCODE_JMP || opcode == OPCODE_JMC ||
+             opcode == OPCODE_CALL) &&
+            target >= 0 && std::size_t(target) < program_size_ &&
+            addr_to_index_[target] >= 0)
+            decoded[addr_to_index_[target]].leader = true;
+
+        if ((EndsBasicBlock(opcode) || opcode == OPCODE_INPUT ||
+             opcode == OPCODE_OUTPUT) && i + 1 < decoded.size())
+            decoded[i + 1].leader = true;
+
+        // regions begin wherever tier code can exit to
+        if (tiered_ && (opcode == OPCODE_HALT ||
+                        jit_->IsBlockStart(decoded[i].addr)))
+            decoded[i].leader = true;
+    }
+
+    threaded_code_.clear();
+    threaded_addrs_.clear();
+
+    for (std::size_t i = 0; i < decoded.size(); i++) {
+        if (decoded[i].leader) {
+            int depth = 0;
+            Data pops = 0, pushes = 0;
+            std::size_t j = i;
+            do {
+                StackEffect effect = GetStackEffect(decoded[j].instr.opcode);
+                depth -= effect.pops;
+                pops = std::max(pops, -depth);
+                depth += effect.pushes;
+                pushes = std::max(pushes, depth);
+                j++;
+            } while (j < decoded.size() && !decoded[j].leader);
+
+            addr_to_index_[decoded[i].addr] = threaded_code_.size();
+            threaded_code_.push_back({ tiered_ ? handlers.check_tiered
+                                               : handlers.check,
+                                       pops, pushes });
+            threaded_addrs_.push_back(decoded[i].addr);
+        } else {
+            // only region starts can be entered
+            addr_to_index_[decoded[i].addr] = -1;
+        }
+
+        Opcode opcode = decoded[i].instr.opcode;
+        std::size_t opc = std::uint8_t(opcode);
+        const void* handler = opc < handlers.opcode_count ?
+                              handlers.opcodes[opc] : nullptr;
+        if (!handler)
+            throw UndefinedOpcodeException(opcode);
+
+        threaded_code_.push_back({ handler, decoded[i].instr.args[0], 0 });
+        threaded_addrs_.push_back(decoded[i].addr);
+    }
+
+    const Data end_index = threaded_code_.size();
+    threaded_code_.push_back({ handlers.trap_end, 0, 0 });
+    threaded_addrs_.push_back(program_size_);
+
+    // resolve jump targets to instruction indices
+    for (Data i = 0; i < end_index; i++) {
+        ThreadedInstr& instr = threaded_code_[i];
+        if (instr.handler == handlers.check ||
+            instr.handler == handlers.check_tiered)
+            continue;
+
+        Opcode opcode = Opcode(*(program_memory_ + threaded_addrs_[i]));
+        if (opcode != OPCODE_JMP && opcode != OPCODE_JMC &&
+            opcode != OPCODE_CALL)
+            continue;
+
+        // out of the program the instruction faults itself, like in
+        // RunSwitch; a target inside an instruction gets an entry of its own
+        if (instr.arg < 0 || std::size_t(instr.arg) >= program_size_) {
+            instr.handler = handlers.trap_bad_jump;
+        } else if (addr_to_index_[instr.arg] < 0) {
+            Register target = instr.arg;
+            instr.arg = threaded_code_.size();
+            threaded_code_.push_back({ handlers.mid_instr, 0, 0 });
+            threaded_addrs_.push_back(target);
+        } else {
+            instr.arg = addr_to_index_[instr.arg];
+        }
+    }
+}
+
+/*!
+ * Direct-threaded interpreter loop. Each handler ends with a computed goto
+ * to the handler of the next instruction, so there is no central dispatch
+ * branch and no re-decoding of the program bytes.
+ *
+ * The data stack lives in locals while the loop runs: 'sp' points at the
+ * slot of the top element and the top element itself is cached in 'tos'.
+ * Depth is checked once per region by the check entries (see Predecode),
+ * so the handlers below never check bounds on push or pop.
+ *
+ * TIERED runs on the stacks in the sandbox, shared with tier code (see
+ * EnterTier). The top element isn't cached there: the empty stack has no
+ * spare slot to spill it to, only a guard page.
+ */
+template<bool TIERED>
+void Zvm::RunThreaded() {
+    static const void* const opcode_handlers[] = {
+        [OPCODE_HALT] = &&op_halt,
+        [OPCODE_PUSH] = &&op_push,
+        [OPCODE_POP] = &&op_pop,
+        [OPCODE_ADD] = &&op_add,
+        [OPCODE_LOAD] = &&op_load,
+        [OPCODE_STORE] = &&op_store,
+        [OPCODE_INPUT] = &&op_input,
+        [OPCODE_OUTPUT] = &&op_output,
+        [0x8] = nullptr,
+        [OPCODE_JMP] = &&op_jmp,
+        [OPCODE_JMC] = &&op_jmc,
+        [OPCODE_SUB] = &&op_sub,
+        [OPCODE_MUL] = &&op_mul,
+        [OPCODE_DIV] = &&op_div,
+        [OPCODE_GZ] = &&op_gz,
+        [OPCODE_BZ] = &&op_bz,
+        [OPCODE_GEZ] = &&op_gez,
+        [OPCODE_BEZ] = &&op_bez,
+        [OPCODE_CALL] = &&op_call,
+        [OPCODE_RET] = &&op_ret,
+        [OPCODE_PUSHBP] = &&op_pushbp,
+        [OPCODE_POPBP] = &&op_popbp,
+        [OPCODE_EQZ] = &&op_eqz,
+        [OPCODE_NEQZ] = &&op_neqz,
+    };
+    const ThreadedHandlers handlers = {
+        opcode_handlers,
+        sizeof(opcode_handlers) / sizeof(*opcode_handlers),
+        &&check,
+        &&check_tiered,
+        &&trap_end,
+        &&trap_bad_jump,
+        &&mid_instr
+    };
+
+    program_.AdviseSequential();
+    Predecode(handlers);
+    if (TIERED)
+        tier_blocks_.assign(threaded_code_.size(), { 0, { nullptr, nullptr } });
+
+    const std::ptrdiff_t stride = TIERED ? SANDBOX_STRIDE : 1;
+    const ThreadedInstr* code = threaded_code_.data();
+    const ThreadedInstr* ip = code;
+    Data* const base = TIERED ? SandboxSlots(*sandbox_) : data_stack_.Base();
+    Data* sp = base + stride * (std::ptrdiff_t(data_stack_.Size()) - 1);
+    Data tos = TIERED ? 0 : *sp;
+    Data op1 = 0;
+    Register idx = 0;
+
+#define DISPATCH() goto *ip->handler
+#define NEXT() { ip++; DISPATCH(); }
+#define JUMP_TO(index) { ip = code + (index); DISPATCH(); }
+#define DEPTH() std::size_t((sp - base) / stride + 1)
+#define SLOT(index) base[stride * std::ptrdiff_t(index)]
+#define TOS (TIERED ? *sp : tos)
+#define SPILL() { if (!TIERED) *sp = tos; }
+#define FILL() { if (!TIERED) tos = *sp; }
+#define PUSH(val) { SPILL(); sp += stride; TOS = (val); }
+#define POP(dst) { (dst) = TOS; sp -= stride; FILL(); }
+#define SYNC_STACK() { SPILL(); data_stack_.SetSize(DEPTH()); }
+
+    DISPATCH();
+
+check_tiered:
+    {
+        TierBlock& tier = tier_blocks_[ip - code];
+        if (!tier.entry.code && tier.count <= tier_threshold_ &&
+            tier.count++ == tier_threshold_)
+            CompileTier(ip - code);
+
+        if (tier.entry.code) {
+            SYNC_STACK();
+            pc_ = RunNative(tier.entry);
+            sp = base + stride * (std::ptrdiff_t(data_stack_.Size()) - 1);
+            FILL();
+            if (pc_ >= program_size_)
+                goto trap_end;
+            if (addr_to_index_[pc_] < 0)
+                goto run_switch;
+            JUMP_TO(addr_to_index_[pc_]);
+        }
+    }
+    // fall through
+check:
+    data_stack_.SetSize(DEPTH());
+    if (!data_stack_.Fits(ip->arg, ip->aux))
+        goto check_failed;
+    NEXT();
+check_failed:
+    // the region faults, maybe earlier than on the data stack
+    pc_ = threaded_addrs_[ip - code];
+    goto run_switch;
+mid_instr:
+    // a jump into the middle of an instruction, decoded from there
+    pc_ = threaded_addrs_[ip - code];
+run_switch:
+    SYNC_STACK();
+    if (TIERED)
+        LeaveTier();
+    RunSwitch();
+    return;
+op_halt:
+    SYNC_STACK();
+    if (TIERED)
+        LeaveTier();
+    halt_flag_ = true;
+    pc_ = threaded_addrs_[ip - code];
+    return;
+op_push:
+    PUSH(ip->arg);
+    NEXT();
+op_pop:
+    POP(op1);
+    NEXT();
+op_add:
+    POP(op1);
+    TOS += op1;
+    NEXT();
+op_sub:
+    POP(op1);
+    TOS -= op1;
+    NEXT();
+op_mul:
+    POP(op1);
+    TOS *= op1;
+    NEXT();
+op_div:
+    POP(op1);
+    if (op1 == 0)
+        throw DivisionByZeroException("division by zero");
+    TOS /= op1;
+    NEXT();
+op_load:
+    idx = bp_ + ip->arg;
+    if (idx >= DEPTH())
+        throw OutOfBoundsException("data stack index out of bounds");
+    SPILL();
+    PUSH(SLOT(idx));
+    NEXT();
+op_store:
+    POP(op1);
+    idx = bp_ + ip->arg;
+    if (idx >= DEPTH())
+        throw OutOfBoundsException("data stack index out of bounds");
+    SPILL();
+    SLOT(idx) = op1;
+    FILL();
+    NEXT();
+op_input:
+    PUSH(ReadInput());
+    NEXT();
+op_output:
+    POP(op1);
+    writer_.WriteInt(op1);
+    NEXT();
+op_jmp:
+    JUMP_TO(ip->arg);
+op_jmc:
+    POP(op1);
+    if (op1)
+        JUMP_TO(ip->arg);
+    NEXT();
+op_gz:
+    TOS = TOS > 0;
+    NEXT();
+op_bz:
+    TOS = TOS < 0;
+    NEXT();
+op_gez:
+    TOS = TOS >= 0;
+    NEXT();
+op_bez:
+    TOS = TOS <= 0;
+    NEXT();
+op_eqz:
+    TOS = TOS == 0;
+    NEXT();
+op_neqz:
+    TOS = TOS != 0;
+    NEXT();
+op_call:
+    if (TIERED)
+        PushTierAddr(threaded_addrs_[ip - code + 1]);
+    else
+        PushAddr(threaded_addrs_[ip - code + 1]);
+    JUMP_TO(ip->arg);
+op_ret:
+    pc_ = TIERED ? PopTierAddr() : PopAddr();
+    if (pc_ >= program_size_)
+        goto trap_end;
+    if (addr_to_index_[pc_] < 0)
+        goto run_switch;
+    JUMP_TO(addr_to_index_[pc_]);
+op_pushbp:
+    if (TIERED)
+        PushTierBp();
+    else
+        PushBp();
+    NEXT();
+op_popbp:
+    if (TIERED)
+        PopTierBp();
+    else
+        PopBp();
+    NEXT();
+trap_end:
+    throw OutOfBoundsException("PC out of bounds");
+trap_bad_jump:
+    throw OutOfBoundsException("JMP out of bounds");
+
+#undef SYNC_STACK
+#undef POP
+#undef PUSH
+#undef FILL
+#undef SPILL
+#undef TOS
+#undef SLOT
+#undef DEPTH
+#undef JUMP_TO
+#undef NEXT
+#undef DISPATCH
+}
+
 void Zvm::Execute(Opcode opcode, Data arg) {
     Data op1 = 0, op2 = 0;
 
@@ -137,18 +505,17 @@ void Zvm::Execute(Opcode opcode, Data arg) {
             Push(op2 / op1);
             break;
         case OPCODE_LOAD:
-            Push(data_stack_.at(bp_ + arg));
+            Push(data_stack_.At(bp_ + arg));
             break;
         case OPCODE_STORE:
-            data_stack_.at(bp_ + arg) = Pop();
+            op1 = Pop();
+            data_stack_.At(bp_ + arg) = op1;
             break;
         case OPCODE_INPUT:
-            scanf("%d", &op1);
-            Push(op1);
+            Push(ReadInput());
             break;
         case OPCODE_OUTPUT:
-            op1 = Pop();
-            printf("%d\n", op1);
+            writer_.WriteInt(Pop());
             break;
         case OPCODE_JMP:
             if (arg < 0 || std::size_t(arg) >= program_size_)
@@ -207,79 +574,183 @@ void Zvm::Execute(Opcode opcode, Data arg) {
 }
 
 void Zvm::Push(Data val) {
-    data_stack_.push_back(val);
-    sp_++;
+    data_stack_.Push(val);
 }
 
 Data Zvm::Pop() {
-    if (sp_ == 0)
-        throw StackUnderflowException("data stack underflow");
-    Data val = data_stack_.back();
-    data_stack_.pop_back();
+    return data_stack_.Pop();
+}
+
+/*!
+ * Sets up the native side of tiered execution: the translator working on
+ * the loaded program, the io::Runtime tier code does I/O through and the
+ * guarded native stacks, which the interpreter's stacks move into.
+ * Programs the translator rejects run threaded.
+ */
+void Zvm::InitTier() {
+    if (!jit_) {
+        jit_.reset(new BinTran());
+        jit_->LoadProgram(program_);
+    }
+    tiered_ = jit_->PrepareTier();
+    if (!tiered_)
+        return;
 
-    return val;
+    if (!runtime_) {
+        runtime_.reset(new io::Runtime);
+        io::InitRuntime(*runtime_, text_input_, text_output_);
+    }
+    if (!sandbox_)
+        sandbox_.reset(new Sandbox(data_stack_.Capacity(),
+                                   call_stack_.Capacity()));
+    jit_->SetDataCapacity(sandbox_->Capacity());
+    EnterTier();
+}
+
+/*!
+ * Moves the stacks into the sandbox, where they stay while execution is
+ * tiered, so that the interpreter and tier code hand over without copying
+ * anything. They take the layout of TierFrame; bp stack entries become
+ * slot addresses.
+ */
+void Zvm::EnterTier() {
+    Data* slots = SandboxSlots(*sandbox_);
+    const Data* values = data_stack_.Base();
+    for (std::size_t i = 0; i < data_stack_.Size(); i++)
+        slots[SANDBOX_STRIDE * std::ptrdiff_t(i)] = values[i];
+
+    tier_frame_.calls = sandbox_->CallTop();
+    for (std::size_t i = 0; i < call_stack_.Size(); i++)
+        *--tier_frame_.calls = call_stack_.Base()[i];
+
+    tier_frame_.bps = sandbox_->BpTop();
+    for (std::size_t i = 0; i < bp_stack_.Size(); i++) {
+        std::uint64_t* slot = sandbox_->Slot0() - bp_stack_.Base()[i];
+        *--tier_frame_.bps = std::uint64_t(slot);
+    }
+}
+
+/*!
+ * Moves the stacks back from the sandbox, once tiered execution is over:
+ * the program halted or RunSwitch takes over.
+ */
+void Zvm::LeaveTier() {
+    const Data* slots = SandboxSlots(*sandbox_);
+    Data* values = data_stack_.Base();
+    for (std::size_t i = 0; i < data_stack_.Size(); i++)
+        values[i] = slots[SANDBOX_STRIDE * std::ptrdiff_t(i)];
+
+    call_stack_.Clear();
+    for (const std::uint64_t* entry = sandbox_->CallTop();
+         entry != tier_frame_.calls;)
+        call_stack_.Push(Register(*--entry));
+
+    bp_stack_.Clear();
+    for (const std::uint64_t* entry = sandbox_->BpTop();
+         entry != tier_frame_.bps;) {
+        const std::uint64_t* slot = (const std::uint64_t*)*--entry;
+        bp_stack_.Push(Register(sandbox_->Slot0() - slot));
+    }
+    tiered_ = false;
+}
+
+/*!
+ * Translates the block of check entry 'index' for tiered execution.
+ * Blocks the translator can't enter stay interpreted.
+ */
+bool Zvm::CompileTier(std::size_t index) {
+    return jit_->TranslateTier(threaded_addrs_[index],
+                               tier_blocks_[index].entry);
+}
+
+/*!
+ * Runs tier code from 'entry' and returns the ZVM address it exited at.
+ *
+ * Tier code works on the stacks in the sandbox in place, only the data
+ * stack depth and bp pass through the frame: rsp at the top slot and r15
+ * at slot bp_. Output staged by tier code is passed on to the writer
+ * before the interpreter can write anything itself.
+ */
+Register Zvm::RunNative(const TierEntry& entry) {
+    std::uint64_t* slot0 = sandbox_->Slot0();
+    tier_frame_.base = slot0 - bp_;
+    tier_frame_.sp = slot0 - std::ptrdiff_t(data_stack_.Size()) + 1;
+    sandbox_->Run(runtime_.get(), [&] {
+        entry.code(runtime_.get(), &tier_frame_, entry.block);
+    });
+    io::RuntimeFlush(runtime_.get());
+
+    // the guard pages keep the stacks within the capacities of the
+    // sandbox, which may be rounded up past those of the interpreter
+    std::size_t depth = slot0 - tier_frame_.sp + 1;
+    if (depth > data_stack_.Capacity())
+        throw StackOverflowException("data stack overflow");
+    if (std::size_t(sandbox_->CallTop() - tier_frame_.calls) >
+        call_stack_.Capacity())
+        throw StackOverflowException("call stack overflow");
+    if (std::size_t(sandbox_->BpTop() - tier_frame_.bps) >
+        bp_stack_.Capacity())
+        throw StackOverflowException("bp stack overflow");
+    data_stack_.SetSize(depth);
+    bp_ = Register(slot0 - tier_frame_.base);
+    return tier_frame_.pc;
+}
+
+/*!
+ * Reads an input value. Values tier code has already taken from the
+ * reader come first.
+ */
+inline Data Zvm::ReadInput() {
+    if (runtime_ && runtime_->in_pos < runtime_->in_end)
+        return *runtime_->in_pos++;
+    return reader_.ReadInt();
 }
 
 void Zvm::PushBp() {
-    bp_stack_.push(bp_);
+    bp_stack_.Push(bp_);
 }
 
 void Zvm::PopBp() {
-    if (bp_stack_.size() == 0)
-        throw StackUnderflowException("bp stack underflow");
-    bp_ = bp_stack_.top();
-    bp_stack_.pop();
+    bp_ = bp_stack_.Pop();
 }
 
 void Zvm::PushAddr(Register val) {
-    call_stack_.push(val);
+    call_stack_.Push(val);
 }
 
 Register Zvm::PopAddr() {
-    if (call_stack_.size() == 0)
-        throw StackUnderflowException("call stack underflow");
-    Register addr = call_stack_.top();
-    call_stack_.pop();
-    return addr;
+    return call_stack_.Pop();
 }
 
-} // namespace zvm
-
-inline void DisplayUsage() {
-    std::printf("Usage: zvm PROGRAM\n");
+/*!
+ * The call stack and bp stack of tiered execution are the sandbox's (see
+ * EnterTier), bounded by the capacities of the interpreter's own.
+ */
+void Zvm::PushTierBp() {
+    if (std::size_t(sandbox_->BpTop() - tier_frame_.bps) ==
+        bp_stack_.Capacity())
+        throw StackOverflowException("bp stack overflow");
+    *--tier_frame_.bps = std::uint64_t(sandbox_->Slot0() - bp_);
 }
 
-int main(int argc, char* argv[]) {
-    using namespace zvm;
-
-    if (argc != 2) {
-        DisplayUsage();
-        return ERR_WRONG_CMD_LINE_ARGS;
-    }
+void Zvm::PopTierBp() {
+    if (tier_frame_.bps == sandbox_->BpTop())
+        throw StackUnderflowException("bp stack underflow");
+    const std::uint64_t* slot = (const std::uint64_t*)*tier_frame_.bps++;
+    bp_ = Register(sandbox_->Slot0() - slot);
+}
 
-    try {
-        Zvm zvm;
-        zvm.LoadBinary(argv[1]);
-        zvm.Run();
-    } catch (const IoException& ioerr) {
-        std::fprintf(stderr, "IO error: %s\n", ioerr.what());
-        return ioerr.GetErrorCode();
-    } catch (const AllocException& allocerr) {
-        std::fprintf(stderr, "Allocation error: %s\n", allocerr.what());
-        return ERR_FAILED_MEM_ALLOC;
-    } catch (const OutOfBoundsException& bnderr) {
-        std::fprintf(stderr, "Runtime error: %s\n", bnderr.what());
-        return ERR_OUT_OF_BOUNDS;
-    } catch (const StackUnderflowException& stackerr) {
-        std::fprintf(stderr, "Runtime error: %s\n", stackerr.what());
-        return ERR_STACK_UNDERFLOW;
-    } catch (const UndefinedOpcodeException& opcerr) {
-        std::fprintf(stderr, "Runtime error: %s\n", opcerr.what());
-        return ERR_OUT_OF_BOUNDS;
-    } catch (const DivisionByZeroException& diverr) {
-        std::fprintf(stderr, "Runtime error: %s\n", diverr.what());
-        return ERR_OUT_OF_BOUNDS;
-    }
+void Zvm::PushTierAddr(Register val) {
+    if (std::size_t(sandbox_->CallTop() - tier_frame_.calls) ==
+        call_stack_.Capacity())
+        throw StackOverflowException("call stack overflow");
+    *--tier_frame_.calls = val;
+}
 
-    return ERR_OK;
+Register Zvm::PopTierAddr() {
+    if (tier_frame_.calls == sandbox_->CallTop())
+        throw StackUnderflowException("call stack underflow");
+    return Register(*tier_frame_.calls++);
 }
+
+} // namespace zvm
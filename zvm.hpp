@@ -0,0 +1,152 @@
+/*
+ zvm.hpp - ZeronSix's stack-based virtual machine.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_ZVM_HPP_
+#define ZVM_ZVM_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "bintran.hpp"
+#include "io.hpp"
+#include "objfile.hpp"
+#include "sandbox.hpp"
+#include "zvmarch.hpp"
+#include "zvmstack.hpp"
+
+namespace zvm {
+
+/*!
+ * Interpreter dispatch strategy.
+ */
+enum DispatchMode {
+    DISPATCH_SWITCH,   // reference mode: fetch, decode and switch every step
+    DISPATCH_THREADED, // pre-decoded program with computed-goto dispatch
+    DISPATCH_TIERED    // threaded, hot blocks are translated to x86
+};
+
+/*!
+ * Executions of a block after which the tiered engine translates it.
+ */
+const std::uint32_t TIER_THRESHOLD = 1000;
+
+/*!
+ * The interpreter. INPUT reads text from 'input_fd' and OUTPUT writes it
+ * to 'output_fd'; the descriptors stay the caller's.
+ */
+class Zvm {
+public:
+    Zvm(std::size_t data_stack_size = DATA_MEMORY_SIZE,
+        std::size_t call_stack_size = CALL_STACK_SIZE,
+        int input_fd = io::STDIN_FD, int output_fd = io::STDOUT_FD);
+    ~Zvm();
+
+    void LoadBinary(const std::string& filename);
+    void Run(DispatchMode mode = DISPATCH_THREADED);
+
+    void SetTierThreshold(std::uint32_t threshold) {
+        tier_threshold_ = threshold;
+    }
+private:
+    /*!
+     * Pre-decoded instruction: the address of its handler in RunThreaded
+     * plus the operand. Jump and call operands hold instruction indices
+     * instead of byte addresses. Stack check entries keep the number of
+     * values their block pops below its entry depth in arg and the maximum
+     * growth above it in aux.
+     */
+    struct ThreadedInstr {
+        const void* handler;
+        Data arg;
+        Data aux;
+    };
+
+    /*!
+     * Addresses of the RunThreaded labels Predecode needs.
+     */
+    struct ThreadedHandlers {
+        const void* const* opcodes;
+        std::size_t opcode_count;
+        const void* check;
+        const void* check_tiered;
+        const void* trap_end;
+        const void* trap_bad_jump;
+        const void* mid_instr;
+    };
+
+    ObjectFile program_;
+    const Byte* program_memory_;
+    std::size_t program_size_;
+    std::vector<ThreadedInstr> threaded_code_;
+    std::vector<Register> threaded_addrs_;
+    std::vector<std::int32_t> addr_to_index_;
+    FixedStack<Data> data_stack_;
+    FixedStack<Register> call_stack_;
+    FixedStack<Register> bp_stack_;
+    io::Reader reader_;
+    io::Writer writer_;
+    io::TextInput text_input_;    // tier code's view of reader_
+    io::TextOutput text_output_;  // and writer_
+
+    /*!
+     * Tiered execution state of a check entry: how often it ran and the
+     * translated code of its block, once there is some.
+     */
+    struct TierBlock {
+        std::uint32_t count;
+        TierEntry entry;
+    };
+
+    Register pc_;
+    Register bp_;
+
+    bool halt_flag_;
+
+    bool tiered_;
+    std::uint32_t tier_threshold_;
+    std::unique_ptr<BinTran> jit_;
+    std::unique_ptr<io::Runtime> runtime_;
+    std::vector<TierBlock> tier_blocks_;  // by threaded_code_ index
+    std::unique_ptr<Sandbox> sandbox_;    // native stacks
+    TierFrame tier_frame_;  // the stacks while tiered, in the sandbox
+
+    void RunSwitch();
+    template<bool TIERED> void RunThreaded();
+    void Predecode(const ThreadedHandlers& handlers);
+    void InitTier();
+    void EnterTier();
+    void LeaveTier();
+    bool CompileTier(std::size_t index);
+    Register RunNative(const TierEntry& entry);
+    Data ReadInput();
+    void Execute(Opcode opcode, Data arg);
+    void Push(Data val);
+    Data Pop();
+    void PushBp();
+    void PopBp();
+    void PushAddr(Register val);
+    Register PopAddr();
+    void PushTierBp();
+    void PopTierBp();
+    void PushTierAddr(Register val);
+    Register PopTierAddr();
+};
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_ZVM_HPP_ */
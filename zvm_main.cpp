@@ -0,0 +1,91 @@
+/*
+ zvm_main.cpp - command line of the ZVM interpreter.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "zvm.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "exceptions.hpp"
+
+inline void DisplayUsage() {
+    std::printf("Usage: zvm [--switch | --tiered] [--tier-threshold N] "
+                "[--stack-size N] [--call-stack-size N] PROGRAM\n");
+}
+
+int main(int argc, char* argv[]) {
+    using namespace zvm;
+
+    DispatchMode mode = DISPATCH_THREADED;
+    std::size_t data_stack_size = DATA_MEMORY_SIZE;
+    std::size_t call_stack_size = CALL_STACK_SIZE;
+    std::uint32_t tier_threshold = TIER_THRESHOLD;
+    int argi = 1;
+    for (; argi < argc - 1; argi++) {
+        std::string opt = argv[argi];
+        if (opt == "--switch") {
+            mode = DISPATCH_SWITCH;
+        } else if (opt == "--tiered") {
+            mode = DISPATCH_TIERED;
+        } else if (opt == "--tier-threshold" && argi + 2 < argc) {
+            tier_threshold = std::strtoul(argv[++argi], nullptr, 10);
+        } else if (opt == "--stack-size" && argi + 2 < argc) {
+            data_stack_size = std::strtoul(argv[++argi], nullptr, 10);
+        } else if (opt == "--call-stack-size" && argi + 2 < argc) {
+            call_stack_size = std::strtoul(argv[++argi], nullptr, 10);
+        } else {
+            break;
+        }
+    }
+
+    if (argc != argi + 1) {
+        DisplayUsage();
+        return ERR_WRONG_CMD_LINE_ARGS;
+    }
+
+    try {
+        Zvm zvm(data_stack_size, call_stack_size);
+        zvm.SetTierThreshold(tier_threshold);
+        zvm.LoadBinary(argv[argi]);
+        zvm.Run(mode);
+    } catch (const IoException& ioerr) {
+        std::fprintf(stderr, "IO error: %s\n", ioerr.what());
+        return ioerr.GetErrorCode();
+    } catch (const ObjectFormatException& objerr) {
+        std::fprintf(stderr, "Object file error: %s\n", objerr.what());
+        return ERR_BAD_OBJECT_FILE;
+    } catch (const AllocException& allocerr) {
+        std::fprintf(stderr, "Allocation error: %s\n", allocerr.what());
+        return ERR_FAILED_MEM_ALLOC;
+    } catch (const OutOfBoundsException& bnderr) {
+        std::fprintf(stderr, "Runtime error: %s\n", bnderr.what());
+        return ERR_OUT_OF_BOUNDS;
+    } catch (const StackUnderflowException& stackerr) {
+        std::fprintf(stderr, "Runtime error: %s\n", stackerr.what());
+        return ERR_STACK_UNDERFLOW;
+    } catch (const StackOverflowException& stackerr) {
+        std::fprintf(stderr, "Runtime error: %s\n", stackerr.what());
+        return ERR_STACK_OVERFLOW;
+    } catch (const UndefinedOpcodeException& opcerr) {
+        std::fprintf(stderr, "Runtime error: %s\n", opcerr.what());
+        return ERR_OUT_OF_BOUNDS;
+    } catch (const DivisionByZeroException& diverr) {
+        std::fprintf(stderr, "Runtime error: %s\n", diverr.what());
+        return ERR_OUT_OF_BOUNDS;
+    }
+
+    return ERR_OK;
+}
@@ -42,6 +42,10 @@ const std::size_t PROGRAM_MEMORY_SIZE = 1024;
  * Maximum size of data memory.
  */
 const std::size_t DATA_MEMORY_SIZE = 2048;
+/*!
+ * Maximum depth of call and base pointer stacks.
+ */
+const std::size_t CALL_STACK_SIZE = 1024;
 /*!
  * Instruction size (in bytes).
  */
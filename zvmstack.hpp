@@ -0,0 +1,136 @@
+/*!
+ zvmstack.hpp - fixed-capacity stacks used by the virtual machine.
+ Copyright 2017 Vyacheslav "ZeronSix" Zhdanovskiy <zeronsix@gmail.com>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZVM_ZVMSTACK_HPP_
+#define ZVM_ZVMSTACK_HPP_
+
+#include <cstdlib>
+#include <cstddef>
+#include <string>
+#include "exceptions.hpp"
+
+namespace zvm {
+
+/*!
+ * Cache line size used to align stack buffers.
+ */
+const std::size_t CACHE_LINE_SIZE = 64;
+
+/*!
+ * Stack with a preallocated, contiguous, cache-aligned buffer.
+ *
+ * Push/Pop check bounds on every call. The Unchecked variants and the raw
+ * Base()/SetSize() interface are meant for code that has already checked
+ * a whole sequence of operations at once with Fits().
+ *
+ * One spare slot is reserved right below Base(), so code caching the top
+ * of stack in a local may spill it to Base()[-1] when the stack is empty.
+ */
+template<class T>
+class FixedStack {
+public:
+    FixedStack(std::size_t capacity, const std::string& name)
+        : buffer_(nullptr),
+          base_(nullptr),
+          size_(0),
+          capacity_(capacity),
+          name_(name) {
+        std::size_t bytes = (capacity_ + 1) * sizeof(T);
+        bytes = (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE *
+                CACHE_LINE_SIZE;
+
+        buffer_ = static_cast<T*>(std::aligned_alloc(CACHE_LINE_SIZE, bytes));
+        if (!buffer_)
+            throw AllocException();
+        buffer_[0] = T();
+        base_ = buffer_ + 1;
+    }
+
+    ~FixedStack() {
+        std::free(buffer_);
+    }
+
+    FixedStack(const FixedStack&) = delete;
+    FixedStack& operator=(const FixedStack&) = delete;
+
+    std::size_t Size() const {
+        return size_;
+    }
+
+    std::size_t Capacity() const {
+        return capacity_;
+    }
+
+    void Clear() {
+        size_ = 0;
+    }
+
+    void Push(T val) {
+        if (size_ == capacity_)
+            throw StackOverflowException(name_ + " overflow");
+        PushUnchecked(val);
+    }
+
+    T Pop() {
+        if (size_ == 0)
+            throw StackUnderflowException(name_ + " underflow");
+        return PopUnchecked();
+    }
+
+    void PushUnchecked(T val) {
+        base_[size_++] = val;
+    }
+
+    T PopUnchecked() {
+        return base_[--size_];
+    }
+
+    /*!
+     * Bounds-checked access by index from the bottom of the stack.
+     */
+    T& At(std::size_t index) {
+        if (index >= size_)
+            throw OutOfBoundsException(name_ + " index out of bounds");
+        return base_[index];
+    }
+
+    /*!
+     * Whether 'pops' values can be popped and then 'pushes' values pushed
+     * on top of the current contents.
+     */
+    bool Fits(std::size_t pops, std::size_t pushes) const {
+        return size_ >= pops && size_ + pushes <= capacity_;
+    }
+
+    T* Base() {
+        return base_;
+    }
+
+    void SetSize(std::size_t size) {
+        size_ = size;
+    }
+private:
+    T* buffer_;
+    T* base_;
+    std::size_t size_;
+    std::size_t capacity_;
+    std::string name_;
+};
+
+}  // namespace zvm
+
+#endif /* ifndef ZVM_ZVMSTACK_HPP_ */